@@ -0,0 +1,283 @@
+#include "cbor_writer.h"
+
+#include <cmath>
+
+namespace
+{
+int hexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// reads the XXXX of a \uXXXX escape, -1 if it is not one
+int32_t readCodeUnit(const char *text, size_t len, size_t at)
+{
+    if (at + 6 > len || text[at] != '\\' || text[at + 1] != 'u')
+    {
+        return -1;
+    }
+
+    int32_t unit = 0;
+    for (size_t idx = at + 2; idx < at + 6; ++idx)
+    {
+        const int digit = hexDigit(text[idx]);
+        if (digit < 0)
+        {
+            return -1;
+        }
+        unit = (unit << 4) | digit;
+    }
+    return unit;
+}
+
+size_t putUtf8(uint32_t code_point, char *out)
+{
+    if (code_point < 0x80)
+    {
+        out[0] = static_cast<char>(code_point);
+        return 1;
+    }
+    if (code_point < 0x800)
+    {
+        out[0] = static_cast<char>(0xc0 | (code_point >> 6));
+        out[1] = static_cast<char>(0x80 | (code_point & 0x3f));
+        return 2;
+    }
+    if (code_point < 0x10000)
+    {
+        out[0] = static_cast<char>(0xe0 | (code_point >> 12));
+        out[1] = static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+        out[2] = static_cast<char>(0x80 | (code_point & 0x3f));
+        return 3;
+    }
+    out[0] = static_cast<char>(0xf0 | (code_point >> 18));
+    out[1] = static_cast<char>(0x80 | ((code_point >> 12) & 0x3f));
+    out[2] = static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+    out[3] = static_cast<char>(0x80 | (code_point & 0x3f));
+    return 4;
+}
+
+// undoes the JSON escapes of a string value, the result is never longer than the input
+size_t unescapeJson(const char *text, size_t len, char *out)
+{
+    size_t out_len = 0;
+
+    for (size_t idx = 0; idx < len; ++idx)
+    {
+        if (text[idx] != '\\' || idx + 1 >= len)
+        {
+            out[out_len++] = text[idx];
+            continue;
+        }
+
+        const char escape = text[idx + 1];
+        if (escape == 'u')
+        {
+            int32_t unit = readCodeUnit(text, len, idx);
+            if (unit < 0)
+            {
+                out[out_len++] = text[idx];
+                continue;
+            }
+            idx += 5;
+
+            // a surrogate pair takes two escapes
+            const int32_t low = readCodeUnit(text, len, idx + 1);
+            if (unit >= 0xd800 && unit < 0xdc00 && low >= 0xdc00 && low < 0xe000)
+            {
+                unit = 0x10000 + ((unit - 0xd800) << 10) + (low - 0xdc00);
+                idx += 6;
+            }
+            out_len += putUtf8(static_cast<uint32_t>(unit), out + out_len);
+            continue;
+        }
+
+        switch (escape)
+        {
+        case 'b':
+            out[out_len++] = '\b';
+            break;
+        case 'f':
+            out[out_len++] = '\f';
+            break;
+        case 'n':
+            out[out_len++] = '\n';
+            break;
+        case 'r':
+            out[out_len++] = '\r';
+            break;
+        case 't':
+            out[out_len++] = '\t';
+            break;
+        default: // '"', '\\' and '/'
+            out[out_len++] = escape;
+            break;
+        }
+        ++idx;
+    }
+
+    return out_len;
+}
+} // namespace
+
+void CborWriter::signedInt(int64_t value)
+{
+    if (value >= 0)
+    {
+        head(0, static_cast<uint64_t>(value));
+    }
+    else
+    {
+        head(1, static_cast<uint64_t>(-1 - value));
+    }
+}
+
+void CborWriter::text(const char *text, size_t textLen)
+{
+    head(3, textLen);
+    put(text, textLen);
+}
+
+// as a single precision float if that loses nothing
+void CborWriter::number(double value)
+{
+    const float single = static_cast<float>(value);
+
+    if (static_cast<double>(single) == value)
+    {
+        uint32_t bits;
+        memcpy(&bits, &single, sizeof(bits));
+        put(0xfa);
+        putBigEndian(bits, sizeof(bits));
+    }
+    else
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        put(0xfb);
+        putBigEndian(bits, sizeof(bits));
+    }
+}
+
+void CborWriter::fisValue(const FisFieldSpec &spec, const FisValue &value)
+{
+    if (!value.present)
+    {
+        null();
+        return;
+    }
+
+    if (value.isString)
+    {
+        char unescaped[FisValue::CAPACITY];
+        text(unescaped, unescapeJson(value.text, value.len, unescaped));
+        return;
+    }
+
+    if (strcmp(value.text, "true") == 0 || strcmp(value.text, "false") == 0)
+    {
+        boolean(value.text[0] == 't');
+        return;
+    }
+
+    if (strcmp(value.text, "null") == 0)
+    {
+        null();
+        return;
+    }
+
+    char *end = nullptr;
+    const long long integer = strtoll(value.text, &end, 10);
+    if (end != value.text && *end == '\0')
+    {
+        signedInt(spec.scale ? integer * spec.scale : integer);
+        return;
+    }
+
+    const double real = strtod(value.text, &end);
+    if (end == value.text || *end != '\0')
+    {
+        // not a JSON number after all, the endpoint gets to see what it was
+        text(value.text, value.len);
+        return;
+    }
+
+    if (spec.scale)
+    {
+        signedInt(llround(real * spec.scale));
+    }
+    else
+    {
+        number(real);
+    }
+}
+
+// the initial byte and the shortest form of the argument
+void CborWriter::head(uint8_t major, uint64_t value)
+{
+    const uint8_t type = major << 5;
+
+    if (value < 24)
+    {
+        put(static_cast<uint8_t>(type | value));
+    }
+    else if (value <= 0xff)
+    {
+        put(type | 24);
+        putBigEndian(value, 1);
+    }
+    else if (value <= 0xffff)
+    {
+        put(type | 25);
+        putBigEndian(value, 2);
+    }
+    else if (value <= 0xffffffffu)
+    {
+        put(type | 26);
+        putBigEndian(value, 4);
+    }
+    else
+    {
+        put(type | 27);
+        putBigEndian(value, 8);
+    }
+}
+
+void CborWriter::putBigEndian(uint64_t value, uint8_t bytes)
+{
+    while (bytes > 0)
+    {
+        --bytes;
+        put(static_cast<uint8_t>(value >> (8 * bytes)));
+    }
+}
+
+void CborWriter::put(uint8_t byte)
+{
+    if (pos < len)
+    {
+        buf[pos] = byte;
+    }
+    ++pos;
+}
+
+void CborWriter::put(const void *data, size_t dataLen)
+{
+    if (pos + dataLen <= len)
+    {
+        memcpy(buf + pos, data, dataLen);
+    }
+    pos += dataLen;
+}
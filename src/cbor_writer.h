@@ -0,0 +1,64 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "fis_extractor.h"
+
+// how samples and delta messages are encoded for the endpoint
+enum class WireFormat : uint8_t
+{
+    JSON, // {"ts":...,"fields":{"lat":48.2,...}}
+    CBOR  // the same record with integer keys, see FisRecordKey
+};
+
+// The keys of the CBOR records. The FIS fields inside KEY_FIELDS are keyed by their index in
+// FIS_FIELDS. Keys are never reused, so the ingest side can rely on them across firmware versions.
+enum FisRecordKey : uint8_t
+{
+    KEY_TS = 0,       // unix time or null, samples only
+    KEY_FIELDS = 1,   // map of field index to value
+    // delta messages only, as in the JSON ones
+    KEY_SEQ = 2,
+    KEY_BASE = 3,
+    KEY_KEYFRAME = 4
+};
+
+// Writes CBOR (RFC 8949) items into a fixed buffer. Like snprintf it keeps counting when the
+// buffer is full, size() then is larger than the buffer and the result is unusable.
+class CborWriter
+{
+public:
+    // for writing an indefinite length array around items written separately
+    static constexpr uint8_t ARRAY_START = 0x9f;
+    static constexpr uint8_t BREAK = 0xff;
+
+    CborWriter(uint8_t *buf, size_t len) : buf{buf}, len{len} {}
+
+    void unsignedInt(uint64_t value) { head(0, value); }
+    void signedInt(int64_t value);
+    void text(const char *text, size_t textLen);
+    void array(size_t count) { head(4, count); }
+    void map(size_t count) { head(5, count); }
+    void beginArray() { put(ARRAY_START); } // indefinite length, closed by end()
+    void end() { put(BREAK); }
+    void boolean(bool value) { put(value ? 0xf5 : 0xf4); }
+    void null() { put(0xf6); }
+    void number(double value);
+
+    // a FIS field value: fixed point if the field has a scale, integers as integers, JSON
+    // strings unescaped to UTF-8
+    void fisValue(const FisFieldSpec &spec, const FisValue &value);
+
+    size_t size() const { return pos; }
+    bool overflow() const { return pos > len; }
+
+private:
+    void head(uint8_t major, uint64_t value);
+    void putBigEndian(uint64_t value, uint8_t bytes);
+    void put(uint8_t byte);
+    void put(const void *data, size_t dataLen);
+
+    uint8_t *buf;
+    size_t len;
+    size_t pos{0};
+};
@@ -0,0 +1,63 @@
+#include "change_detector.h"
+
+#include "logger.h"
+
+namespace
+{
+constexpr uint64_t FNV_PRIME = 1099511628211ULL;
+} // namespace
+
+size_t HashingStream::write(const uint8_t *buf, size_t size)
+{
+    for (size_t idx = 0; idx < size; ++idx)
+    {
+        state = (state ^ buf[idx]) * FNV_PRIME;
+    }
+
+    if (forward)
+    {
+        return forward->write(buf, size);
+    }
+
+    return size;
+}
+
+void ChangeDetector::addRequestHeaders(HttpRequest &request) const
+{
+    if (acknowledged.etag[0] != '\0')
+    {
+        request.addHeader("If-None-Match", acknowledged.etag);
+    }
+
+    if (acknowledged.lastModified[0] != '\0')
+    {
+        request.addHeader("If-Modified-Since", acknowledged.lastModified);
+    }
+}
+
+bool ChangeDetector::takeValidators(const ResponseHeaders &headers)
+{
+    // both are as large as in ResponseHeaders, where values that do not fit are left empty
+    static_assert(sizeof(pending.etag) == sizeof(headers.etag) &&
+                      sizeof(pending.lastModified) == sizeof(headers.lastModified),
+                  "the validators fit");
+    memcpy(pending.etag, headers.etag, sizeof(pending.etag));
+    memcpy(pending.lastModified, headers.lastModified, sizeof(pending.lastModified));
+
+    return pending.etag[0] != '\0' || pending.lastModified[0] != '\0';
+}
+
+void ChangeDetector::acknowledge(uint64_t bodyHash)
+{
+    acknowledged = pending;
+    acknowledgedHash = bodyHash;
+    haveHash = true;
+}
+
+void ChangeDetector::printStats() const
+{
+    LOG_I("Change detection: %u not modified, %u unchanged by hash, validators: %s",
+          notModifiedCount,
+          unchangedCount,
+          acknowledged.etag[0] != '\0' || acknowledged.lastModified[0] != '\0' ? "yes" : "no");
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "http_request.h"
+
+// Hashes everything written to it with 64 bit FNV-1a, optionally passing it on to another stream
+class HashingStream : public Stream
+{
+public:
+    explicit HashingStream(Stream *forward = nullptr) : forward{forward} {}
+
+    uint64_t hash() const { return state; }
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *buf, size_t size) override;
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    void flush() override {}
+
+private:
+    Stream *forward;
+    uint64_t state{14695981039346656037ULL};
+};
+
+// Decides whether a response has to be uploaded again. If the server sends ETag or Last-Modified,
+// they are sent back as If-None-Match / If-Modified-Since and the server answers 304 while nothing
+// changed. Without them, the body hash of the last acknowledged upload is compared instead.
+class ChangeDetector
+{
+public:
+    void addRequestHeaders(HttpRequest &request) const;
+
+    // remembers the validators of a 200 response, returns false if the server sent none
+    bool takeValidators(const ResponseHeaders &headers);
+
+    bool unchanged(uint64_t bodyHash) const { return haveHash && bodyHash == acknowledgedHash; }
+
+    // the upload of the last response was acknowledged, only changes after it are interesting now
+    void acknowledge(uint64_t bodyHash);
+
+    void countNotModified() { ++notModifiedCount; }
+    void countUnchanged() { ++unchangedCount; }
+    void printStats() const;
+
+private:
+    struct Validators
+    {
+        char etag[96]{};
+        char lastModified[40]{};
+    };
+
+    Validators pending;
+    Validators acknowledged;
+
+    uint64_t acknowledgedHash{0};
+    bool haveHash{false};
+
+    uint32_t notModifiedCount{0};
+    uint32_t unchangedCount{0};
+};
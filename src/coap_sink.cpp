@@ -0,0 +1,272 @@
+#include "coap_sink.h"
+
+#include <cstring>
+
+#include <IPAddress.h>
+#include <esp_system.h>
+#include <lwip/sockets.h>
+
+#include "cbor_writer.h"
+#include "dns_cache.h"
+#include "logger.h"
+#include "metrics.h"
+
+namespace
+{
+constexpr uint8_t VERSION = 1;
+constexpr uint8_t TYPE_CON = 0;
+constexpr uint8_t TYPE_ACK = 2;
+constexpr uint8_t TYPE_RST = 3;
+constexpr uint8_t CODE_POST = 0x02; // 0.02
+constexpr uint8_t TOKEN_LEN = 4;
+constexpr uint8_t PAYLOAD_MARKER = 0xff;
+
+constexpr uint16_t OPTION_URI_PATH = 11;
+constexpr uint16_t OPTION_CONTENT_FORMAT = 12;
+constexpr uint8_t CONTENT_FORMAT_CBOR = 60;
+
+// the 4 bit delta or length of an option header, larger values follow in 1 or 2 bytes
+uint8_t optionNibble(size_t value)
+{
+    return value < 13 ? value : value < 269 ? 13 : 14;
+}
+
+size_t putOptionExtension(uint8_t *buf, size_t value)
+{
+    if (value < 13)
+    {
+        return 0;
+    }
+    if (value < 269)
+    {
+        buf[0] = value - 13;
+        return 1;
+    }
+    buf[0] = (value - 269) >> 8;
+    buf[1] = (value - 269) & 0xff;
+    return 2;
+}
+
+// an option delta after the previous one, returns its length, 0 if it does not fit
+size_t putOption(uint8_t *buf, size_t len, uint16_t delta, const uint8_t *value, size_t valueLen)
+{
+    if (valueLen > 1024 || 5 + valueLen > len)
+    {
+        return 0;
+    }
+
+    size_t pos = 0;
+    buf[pos++] = optionNibble(delta) << 4 | optionNibble(valueLen);
+    pos += putOptionExtension(buf + pos, delta);
+    pos += putOptionExtension(buf + pos, valueLen);
+    memcpy(buf + pos, value, valueLen);
+    return pos + valueLen;
+}
+} // namespace
+
+CoapSink::CoapSink(const char *url)
+    : Sink{url, BATCH_MAX_SAMPLES, BATCH_MAX_AGE_MS, STACK_SIZE},
+      url{url},
+      nextMessageId{static_cast<uint16_t>(esp_random())}
+{
+    valid = parseUrl(url, parts) && parts.scheme == UrlScheme::COAP;
+    if (!valid)
+    {
+        LOG_W("[COAP] invalid url: %s", url);
+    }
+}
+
+size_t CoapSink::buildHeader(uint8_t *buf, size_t len, uint16_t messageId, uint32_t token) const
+{
+    if (len < 4 + TOKEN_LEN)
+    {
+        return 0;
+    }
+
+    size_t pos = 0;
+    buf[pos++] = VERSION << 6 | TYPE_CON << 4 | TOKEN_LEN;
+    buf[pos++] = CODE_POST;
+    buf[pos++] = messageId >> 8;
+    buf[pos++] = messageId & 0xff;
+    memcpy(buf + pos, &token, TOKEN_LEN);
+    pos += TOKEN_LEN;
+
+    // one Uri-Path option per segment, a query is not passed on
+    uint16_t last_option = 0;
+    const char *segment = parts.path;
+    while (*segment && *segment != '?')
+    {
+        while (*segment == '/')
+        {
+            ++segment;
+        }
+        const size_t segment_len = strcspn(segment, "/?");
+        if (segment_len == 0)
+        {
+            break;
+        }
+
+        const size_t option_len = putOption(buf + pos, len - pos, OPTION_URI_PATH - last_option,
+                                            reinterpret_cast<const uint8_t *>(segment), segment_len);
+        if (option_len == 0)
+        {
+            return 0;
+        }
+        pos += option_len;
+        last_option = OPTION_URI_PATH;
+        segment += segment_len;
+    }
+
+    const size_t option_len =
+        putOption(buf + pos, len - pos, OPTION_CONTENT_FORMAT - last_option, &CONTENT_FORMAT_CBOR, 1);
+    if (option_len == 0 || pos + option_len >= len)
+    {
+        return 0;
+    }
+    pos += option_len;
+
+    buf[pos++] = PAYLOAD_MARKER;
+    return pos;
+}
+
+bool CoapSink::send(const FisSample *const *samples, size_t &count, FailureClass &failure)
+{
+    const size_t batch_count = count;
+    count = 0;
+    failure = FailureClass::BAD_RESPONSE;
+    if (!valid)
+    {
+        return false;
+    }
+
+    uint8_t message[MAX_MESSAGE];
+    const uint16_t message_id = nextMessageId++;
+    size_t pos = buildHeader(message, sizeof(message), message_id, esp_random());
+    if (pos == 0)
+    {
+        LOG_W("[COAP] %s: the path does not fit into a message", url);
+        return false;
+    }
+
+    // as many records as fit, with room for the closing BREAK
+    message[pos++] = CborWriter::ARRAY_START;
+    size_t taken = 0;
+    while (taken < batch_count && pos < sizeof(message) - 1)
+    {
+        const size_t len = formatSampleCbor(*samples[taken], message + pos, sizeof(message) - 1 - pos);
+        if (len == 0)
+        {
+            break;
+        }
+        pos += len;
+        ++taken;
+    }
+    message[pos++] = CborWriter::BREAK;
+
+    if (taken == 0)
+    {
+        // never fits, it would block the sink forever
+        LOG_W("[COAP] %s: a sample does not fit into a message, dropped", url);
+        count = 1;
+        return true;
+    }
+
+    if (!exchange(message, pos, message_id, failure))
+    {
+        return false;
+    }
+
+    LOG_D("[COAP] %s: %u samples in %u bytes", url, static_cast<unsigned>(taken), static_cast<unsigned>(pos));
+    count = taken;
+    return true;
+}
+
+bool CoapSink::exchange(const uint8_t *request, size_t len, uint16_t messageId, FailureClass &failure)
+{
+    IPAddress address;
+    if (!dnsResolve(parts.host, address))
+    {
+        failure = FailureClass::DNS;
+        return false;
+    }
+
+    const int fd = lwip_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0)
+    {
+        failure = FailureClass::CONNECT;
+        return false;
+    }
+
+    timeval tv;
+    tv.tv_sec = ACK_TIMEOUT_MS / 1000;
+    tv.tv_usec = (ACK_TIMEOUT_MS % 1000) * 1000;
+    lwip_setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = address;
+    server_addr.sin_port = htons(parts.port);
+
+    // the same message id again, so the server can tell a retransmission
+    failure = FailureClass::TIMEOUT;
+    bool answered = false;
+    bool accepted = false;
+    uint8_t answer[64]; // only the header of the response matters, the rest is cut off
+    for (uint8_t attempt = 0; attempt < ATTEMPTS && !answered; ++attempt)
+    {
+        if (lwip_sendto(fd, request, len, 0, reinterpret_cast<const sockaddr *>(&server_addr), sizeof(server_addr)) <
+            0)
+        {
+            failure = FailureClass::CONNECT;
+            break;
+        }
+        countBytesOut(len);
+
+        // answers to an earlier message that timed out are skipped by their id
+        int received;
+        while ((received = lwip_recvfrom(fd, answer, sizeof(answer), 0, nullptr, nullptr)) > 0)
+        {
+            countBytesIn(received);
+
+            const uint8_t type = answer[0] >> 4 & 0x03;
+            if (received < 4 || answer[0] >> 6 != VERSION || (type != TYPE_ACK && type != TYPE_RST) ||
+                (answer[2] << 8 | answer[3]) != messageId)
+            {
+                continue;
+            }
+
+            answered = true;
+            const uint8_t code_class = answer[1] >> 5;
+            if (type == TYPE_ACK && (answer[1] == 0 || code_class == 2))
+            {
+                accepted = true;
+            }
+            else if (type == TYPE_ACK && code_class == 4)
+            {
+                failure = FailureClass::HTTP_4XX;
+            }
+            else if (type == TYPE_ACK && code_class == 5)
+            {
+                failure = FailureClass::HTTP_5XX;
+            }
+            else
+            {
+                failure = FailureClass::BAD_RESPONSE;
+            }
+
+            if (!accepted)
+            {
+                LOG_W("[COAP] %s: refused with %u.%02u", url, code_class, answer[1] & 0x1f);
+            }
+            break;
+        }
+    }
+
+    lwip_close(fd);
+
+    if (!answered)
+    {
+        LOG_W("[COAP] %s: no acknowledgement", url);
+    }
+    return accepted;
+}
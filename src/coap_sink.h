@@ -0,0 +1,40 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "sink.h"
+#include "upload_stream.h"
+
+// Sends the samples to a coap:// URL (RFC 7252) as a confirmable POST with a CBOR array of the
+// records of formatSampleCbor() as its payload, one datagram per batch. No TLS and no
+// connection, a batch costs one datagram and its acknowledgement. The response code of the
+// piggybacked response decides like an HTTP status, an empty ACK counts as accepted.
+// Batches that do not fit into MAX_MESSAGE go out in several messages, there is no block-wise
+// transfer.
+class CoapSink : public Sink
+{
+public:
+    static constexpr size_t BATCH_MAX_SAMPLES = 3;
+    static constexpr uint32_t BATCH_MAX_AGE_MS = 10000;
+    static constexpr uint32_t STACK_SIZE = 4096;
+
+    static constexpr size_t MAX_MESSAGE = 1024; // stays below the 1152 bytes RFC 7252 allows
+    static constexpr uint32_t ACK_TIMEOUT_MS = 2000;
+    static constexpr uint8_t ATTEMPTS = 2; // a datagram that got lost, then RetryPolicy backs off
+
+    // url has to stay valid
+    explicit CoapSink(const char *url);
+
+protected:
+    bool send(const FisSample *const *samples, size_t &count, FailureClass &failure) override;
+
+private:
+    // the request up to and including the payload marker, 0 if it does not fit
+    size_t buildHeader(uint8_t *buf, size_t len, uint16_t messageId, uint32_t token) const;
+    bool exchange(const uint8_t *request, size_t len, uint16_t messageId, FailureClass &failure);
+
+    const char *url;
+    UrlParts parts;
+    bool valid{false};
+    uint16_t nextMessageId;
+};
@@ -0,0 +1,218 @@
+#include "cookie_store.h"
+
+#include "logger.h"
+#include "wall_clock.h"
+
+namespace
+{
+bool isSpace(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+// the part of [begin, end) without the spaces around it
+void trim(const char *&begin, const char *&end)
+{
+    while (begin < end && isSpace(*begin))
+    {
+        ++begin;
+    }
+    while (end > begin && isSpace(end[-1]))
+    {
+        --end;
+    }
+}
+
+// copies [begin, end) with a terminating zero, false if it does not fit
+bool copyPart(const char *begin, const char *end, char *dest, size_t len)
+{
+    const size_t part_len = end - begin;
+    if (part_len >= len)
+    {
+        return false;
+    }
+
+    memcpy(dest, begin, part_len);
+    dest[part_len] = '\0';
+    return true;
+}
+
+bool keyIs(const char *begin, const char *end, const char *key)
+{
+    const size_t key_len = strlen(key);
+    return static_cast<size_t>(end - begin) == key_len && strncasecmp(begin, key, key_len) == 0;
+}
+
+bool expiredAt(const StoredCookie &cookie, time_t now)
+{
+    return now != 0 && cookie.expires != 0 && cookie.expires <= now;
+}
+
+// RFC 6265 path-match
+bool pathMatches(const char *cookiePath, const char *requestPath)
+{
+    const size_t len = strlen(cookiePath);
+    if (strncmp(cookiePath, requestPath, len) != 0)
+    {
+        return false;
+    }
+
+    const char next = requestPath[len];
+    return cookiePath[len - 1] == '/' || next == '\0' || next == '/' || next == '?';
+}
+} // namespace
+
+void CookieStore::set(const char *setCookie, time_t now)
+{
+    const char *const pair_end = setCookie + strcspn(setCookie, ";");
+    const char *const equals = static_cast<const char *>(memchr(setCookie, '=', pair_end - setCookie));
+    if (!equals)
+    {
+        return;
+    }
+
+    StoredCookie cookie;
+    const char *name = setCookie;
+    const char *name_end = equals;
+    const char *value = equals + 1;
+    const char *value_end = pair_end;
+    trim(name, name_end);
+    trim(value, value_end);
+
+    if (name == name_end || !copyPart(name, name_end, cookie.name, sizeof(cookie.name)) ||
+        !copyPart(value, value_end, cookie.value, sizeof(cookie.value)))
+    {
+        LOG_W("[COOKIE] %.*s does not fit, left out", static_cast<int>(name_end - name), name);
+        return;
+    }
+
+    cookie.path[0] = '/';
+
+    // Max-Age wins over Expires, wherever it comes
+    bool have_max_age = false;
+    time_t expires = 0;
+    bool expired = false;
+
+    for (const char *attribute = pair_end; *attribute == ';';)
+    {
+        ++attribute;
+        const char *const attribute_end = attribute + strcspn(attribute, ";");
+        const char *key = attribute;
+        const char *key_end = static_cast<const char *>(memchr(attribute, '=', attribute_end - attribute));
+        const char *argument = key_end ? key_end + 1 : attribute_end;
+        const char *argument_end = attribute_end;
+        if (!key_end)
+        {
+            key_end = attribute_end;
+        }
+        trim(key, key_end);
+        trim(argument, argument_end);
+
+        if (keyIs(key, key_end, "Max-Age"))
+        {
+            const long max_age = atol(argument);
+            have_max_age = true;
+            expired = max_age <= 0;
+            expires = now != 0 && max_age > 0 ? now + max_age : 0;
+        }
+        else if (keyIs(key, key_end, "Expires") && !have_max_age)
+        {
+            // also the older "Wed, 14-Oct-2026 17:00:00 GMT"
+            char date[40];
+            time_t date_value;
+            if (copyPart(argument, argument_end, date, sizeof(date)))
+            {
+                for (char *c = date; *c; ++c)
+                {
+                    *c = *c == '-' ? ' ' : *c;
+                }
+                if (parseHttpDate(date, date_value))
+                {
+                    expired = now != 0 && date_value <= now;
+                    expires = date_value;
+                }
+            }
+        }
+        else if (keyIs(key, key_end, "Path") && argument < argument_end && *argument == '/')
+        {
+            copyPart(argument, argument_end, cookie.path, sizeof(cookie.path));
+        }
+        else if (keyIs(key, key_end, "Secure"))
+        {
+            cookie.secure = true;
+        }
+
+        attribute = attribute_end;
+    }
+
+    cookie.expires = expires;
+
+    if (expired)
+    {
+        // the server deletes it
+        for (size_t idx = 0; idx < count; ++idx)
+        {
+            if (strcmp(cookies[idx].name, cookie.name) == 0 && strcmp(cookies[idx].path, cookie.path) == 0)
+            {
+                remove(idx);
+                break;
+            }
+        }
+        return;
+    }
+
+    add(cookie);
+}
+
+bool CookieStore::add(const StoredCookie &cookie)
+{
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        if (strcmp(cookies[idx].name, cookie.name) == 0 && strcmp(cookies[idx].path, cookie.path) == 0)
+        {
+            cookies[idx] = cookie;
+            return true;
+        }
+    }
+
+    if (count == MAX_COOKIES)
+    {
+        LOG_W("[COOKIE] no slot left for %s", cookie.name);
+        return false;
+    }
+
+    cookies[count++] = cookie;
+    return true;
+}
+
+size_t CookieStore::header(const char *path, time_t now, char *buf, size_t len) const
+{
+    size_t pos = 0;
+
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        const StoredCookie &cookie = cookies[idx];
+        if (expiredAt(cookie, now) || !pathMatches(cookie.path, path))
+        {
+            continue;
+        }
+
+        const int written = snprintf(buf + pos, len - pos, "%s%s=%s", pos > 0 ? "; " : "", cookie.name, cookie.value);
+        if (written < 0 || pos + written >= len)
+        {
+            return 0;
+        }
+        pos += written;
+    }
+
+    return pos;
+}
+
+void CookieStore::remove(size_t idx)
+{
+    for (; idx + 1 < count; ++idx)
+    {
+        cookies[idx] = cookies[idx + 1];
+    }
+    --count;
+}
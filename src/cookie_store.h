@@ -0,0 +1,48 @@
+#pragma once
+
+#include <Arduino.h>
+
+struct StoredCookie
+{
+    static constexpr size_t NAME_CAPACITY = 32;
+    static constexpr size_t VALUE_CAPACITY = 448; // an encrypted Laravel session
+    static constexpr size_t PATH_CAPACITY = 32;
+
+    char name[NAME_CAPACITY]{};
+    char value[VALUE_CAPACITY]{};
+    char path[PATH_CAPACITY]{};
+    time_t expires{0}; // unix time, 0 for a session cookie
+    bool secure{false};
+};
+
+// The cookies of the one host a HostConnection talks to, in fixed slots instead of the
+// CookieJar of HTTPClient, a std::vector of Strings that grows and shrinks with every
+// Set-Cookie. Cookies are host-only and matched by their path. Expired ones are dropped,
+// unless the clock is not set yet. Then nothing can be told to be expired.
+// Cookies that do not fit into a slot are left out rather than cut off.
+class CookieStore
+{
+public:
+    static constexpr size_t MAX_COOKIES = 4;
+
+    // the value of a Set-Cookie header, now is the unix time, 0 if unknown
+    void set(const char *setCookie, time_t now);
+
+    // adds or replaces a cookie by its name, false if all slots are taken
+    bool add(const StoredCookie &cookie);
+
+    // writes "name=value; name=value" of the cookies for path, returns its length, 0 if there
+    // is none or they do not fit into len
+    size_t header(const char *path, time_t now, char *buf, size_t len) const;
+
+    size_t size() const { return count; }
+    const StoredCookie &operator[](size_t idx) const { return cookies[idx]; }
+
+    void clear() { count = 0; }
+
+private:
+    void remove(size_t idx);
+
+    StoredCookie cookies[MAX_COOKIES];
+    size_t count{0};
+};
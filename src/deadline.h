@@ -0,0 +1,55 @@
+#pragma once
+
+#include <Arduino.h>
+#include <esp_timer.h>
+
+// A point in time on the esp_timer clock. It counts microseconds since boot in 64 bits, so
+// unlike millis() it does not wrap while the device runs, and deadlines can simply be compared.
+class Deadline
+{
+public:
+    static int64_t now() { return esp_timer_get_time(); }
+
+    // milliseconds since a now()
+    static uint32_t msSince(int64_t since) { return static_cast<uint32_t>((now() - since) / 1000); }
+
+    // expires ms from now
+    void start(uint32_t ms)
+    {
+        at = now() + static_cast<int64_t>(ms) * 1000;
+        armed = true;
+    }
+
+    // expires periodMs after the previous deadline, however late that one was noticed, so a
+    // periodic deadline does not slip. If it is more than a period behind, or was not armed,
+    // the period starts now, nothing is caught up after a stall.
+    void advance(uint32_t periodMs)
+    {
+        const int64_t period = static_cast<int64_t>(periodMs) * 1000;
+        const int64_t current = now();
+
+        at = armed && current - at < period ? at + period : current + period;
+        armed = true;
+    }
+
+    void stop() { armed = false; }
+
+    bool pending() const { return armed; }
+    bool expired() const { return armed && now() >= at; }
+
+    // until it expires, 0 if it did, UINT32_MAX if it is not armed
+    uint32_t remainingMs() const
+    {
+        if (!armed)
+        {
+            return UINT32_MAX;
+        }
+
+        const int64_t remaining = (at - now() + 999) / 1000;
+        return remaining > 0 ? static_cast<uint32_t>(std::min<int64_t>(remaining, UINT32_MAX - 1)) : 0;
+    }
+
+private:
+    int64_t at{0};
+    bool armed{false};
+};
@@ -0,0 +1,152 @@
+#include "delta_encoder.h"
+
+#include "logger.h"
+
+size_t DeltaEncoder::encode(const FisSnapshot &snapshot, char *buf, size_t len)
+{
+    const bool keyframe = nextIsKeyframe();
+
+    size_t pos = 0;
+    const auto append = [&](const char *format, auto... args) -> void
+    {
+        if (pos < len)
+        {
+            pos += snprintf(buf + pos, len - pos, format, args...);
+        }
+    };
+
+    const uint32_t sequence = lastSequence + 1;
+
+    if (keyframe)
+    {
+        append("{\"seq\":%u,\"keyframe\":true,\"fields\":{", sequence);
+    }
+    else
+    {
+        append("{\"seq\":%u,\"base\":%u,\"keyframe\":false,\"fields\":{", sequence, acknowledgedSequence);
+    }
+
+    uint8_t field_count = 0;
+
+    for (size_t idx = 0; idx < FIS_FIELD_COUNT; ++idx)
+    {
+        if (!includes(snapshot, idx, keyframe))
+        {
+            continue;
+        }
+
+        const FisValue &value = snapshot.values[idx];
+
+        append("%s\"%s\":", field_count > 0 ? "," : "", FIS_FIELDS[idx].name);
+
+        if (!value.present)
+        {
+            append("%s", "null");
+        }
+        else if (value.isString)
+        {
+            append("\"%s\"", value.text);
+        }
+        else
+        {
+            append("%s", value.text);
+        }
+
+        ++field_count;
+    }
+
+    if (!keyframe && field_count == 0)
+    {
+        return 0;
+    }
+
+    append("%s", "}}");
+
+    if (pos >= len)
+    {
+        LOG_W("[DELTA] message does not fit into the buffer");
+        return 0;
+    }
+
+    encoded(snapshot, keyframe);
+    return pos;
+}
+
+size_t DeltaEncoder::encodeCbor(const FisSnapshot &snapshot, uint8_t *buf, size_t len)
+{
+    const bool keyframe = nextIsKeyframe();
+
+    size_t field_count = 0;
+    for (size_t idx = 0; idx < FIS_FIELD_COUNT; ++idx)
+    {
+        field_count += includes(snapshot, idx, keyframe);
+    }
+
+    if (!keyframe && field_count == 0)
+    {
+        return 0;
+    }
+
+    CborWriter cbor(buf, len);
+
+    cbor.map(keyframe ? 3 : 4);
+    cbor.unsignedInt(KEY_SEQ);
+    cbor.unsignedInt(lastSequence + 1);
+    if (!keyframe)
+    {
+        cbor.unsignedInt(KEY_BASE);
+        cbor.unsignedInt(acknowledgedSequence);
+    }
+    cbor.unsignedInt(KEY_KEYFRAME);
+    cbor.boolean(keyframe);
+
+    cbor.unsignedInt(KEY_FIELDS);
+    cbor.map(field_count);
+    for (size_t idx = 0; idx < FIS_FIELD_COUNT; ++idx)
+    {
+        if (includes(snapshot, idx, keyframe))
+        {
+            cbor.unsignedInt(idx);
+            cbor.fisValue(FIS_FIELDS[idx], snapshot.values[idx]);
+        }
+    }
+
+    if (cbor.overflow())
+    {
+        LOG_W("[DELTA] message does not fit into the buffer");
+        return 0;
+    }
+
+    encoded(snapshot, keyframe);
+    return cbor.size();
+}
+
+// a keyframe has all present fields, a delta the ones that changed, with null if they went away
+bool DeltaEncoder::includes(const FisSnapshot &snapshot, size_t field, bool keyframe) const
+{
+    const FisValue &value = snapshot.values[field];
+    return keyframe ? value.present : value != acknowledgedSnapshot.values[field];
+}
+
+void DeltaEncoder::encoded(const FisSnapshot &snapshot, bool keyframe)
+{
+    ++lastSequence;
+    pendingSnapshot = snapshot;
+    pendingKeyframe = keyframe;
+}
+
+void DeltaEncoder::acknowledge()
+{
+    acknowledgedSnapshot = pendingSnapshot;
+    acknowledgedSequence = lastSequence;
+
+    if (pendingKeyframe)
+    {
+        sinceKeyframe = 0;
+        keyframeRequested = false;
+    }
+    else
+    {
+        ++sinceKeyframe;
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "cbor_writer.h"
+#include "fis_extractor.h"
+
+// Encodes FIS snapshots as small JSON messages that only carry the fields that changed since
+// the last message the endpoint acknowledged:
+//   {"seq":12,"base":11,"keyframe":false,"fields":{"speed":87,"next":"Linz Hbf"}}
+// Fields that disappeared are sent as null. Every KEYFRAME_INTERVAL messages, and after every
+// failed upload, a keyframe with all fields is sent instead, so the endpoint never has to
+// guess which state a delta applies to. encodeCbor() writes the same message as CBOR, with the
+// integer keys of FisRecordKey and the FIS fields keyed by their index.
+class DeltaEncoder
+{
+public:
+    static constexpr uint16_t KEYFRAME_INTERVAL = 30; // every 5 minutes at the default poll rate
+    static constexpr size_t MAX_MESSAGE_LEN = 768;
+
+    // writes the message for snapshot into buf and returns its length,
+    // 0 if no field changed (or buf is too small)
+    size_t encode(const FisSnapshot &snapshot, char *buf, size_t len);
+    size_t encodeCbor(const FisSnapshot &snapshot, uint8_t *buf, size_t len);
+
+    // the message of the last encode() was acknowledged by the endpoint
+    void acknowledge();
+
+    // the message of the last encode() was lost, the next one will be a keyframe
+    void reject() { keyframeRequested = true; }
+
+    uint32_t sequence() const { return lastSequence; }
+
+private:
+    bool nextIsKeyframe() const { return keyframeRequested || sinceKeyframe + 1 >= KEYFRAME_INTERVAL; }
+    bool includes(const FisSnapshot &snapshot, size_t field, bool keyframe) const;
+    void encoded(const FisSnapshot &snapshot, bool keyframe);
+
+    FisSnapshot acknowledgedSnapshot;
+    FisSnapshot pendingSnapshot;
+    bool pendingKeyframe{false};
+
+    uint32_t lastSequence{0};
+    uint32_t acknowledgedSequence{0};
+    uint16_t sinceKeyframe{0};
+    bool keyframeRequested{true};
+};
@@ -0,0 +1,604 @@
+#include "dns_cache.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include <Preferences.h>
+#include <WiFi.h>
+#include <esp_system.h>
+#include <freertos/semphr.h>
+#include <lwip/sockets.h>
+
+#include "deadline.h"
+#include "logger.h"
+#include "sink.h"
+
+// can be set from build_flags, e.g. -DDNS_FALLBACK='"railnet.oebb.at=1.2.3.4"', comma separated
+#ifndef DNS_FALLBACK
+#define DNS_FALLBACK ""
+#endif
+#ifndef DNS_WAIT_MS
+#define DNS_WAIT_MS 3000
+#endif
+
+namespace
+{
+constexpr const char *const NAMESPACE = "dns";
+constexpr uint8_t FORMAT_VERSION = 2; // 1 had 4 hosts
+
+// Railnet, the endpoint and a host per sink, beyond that the least recently used one goes
+constexpr size_t MAX_HOSTS = 2 + SinkFanOut::MAX_SINKS;
+constexpr size_t HOST_LEN = 64;
+constexpr uint32_t MIN_TTL_S = 30;   // a TTL of 0 must not make the task spin
+constexpr uint32_t MAX_TTL_S = 3600;
+constexpr uint32_t RETRY_MS = 5000;  // after a failed lookup, while there is no link as well
+constexpr uint32_t QUERY_TIMEOUT_MS = 2000;
+constexpr uint8_t QUERY_ATTEMPTS = 2;
+constexpr uint32_t WAIT_STEP_MS = 20;
+constexpr uint32_t TASK_STACK_SIZE = 4096; // two messages of 512 bytes on it
+
+constexpr uint16_t DNS_PORT = 53;
+constexpr size_t HEADER_LEN = 12;
+constexpr size_t MAX_MESSAGE = 512; // all a DNS server sends over UDP without EDNS
+constexpr uint16_t TYPE_A = 1;
+constexpr uint16_t CLASS_IN = 1;
+
+struct Entry
+{
+    char host[HOST_LEN];
+    uint32_t ip;       // 0 while it has none
+    Deadline refresh;  // the TTL, not armed or expired means it is due for a lookup
+    int64_t lastUsed;  // by dnsAddHost() or dnsResolve(), for the eviction
+};
+
+// what is kept in NVS
+struct StoredHost
+{
+    char host[HOST_LEN];
+    uint32_t ip;
+};
+
+Entry entries[MAX_HOSTS]{};
+size_t entryCount = 0;
+SemaphoreHandle_t tableMutex = xSemaphoreCreateMutex();
+TaskHandle_t resolverTaskHandle = nullptr;
+
+// only the resolver task
+StoredHost savedHosts[MAX_HOSTS]{}; // what NVS holds
+uint32_t queries = 0;
+uint32_t failedQueries = 0;
+uint32_t maxQueryMs = 0;
+
+std::atomic<uint32_t> freshHits{0};
+std::atomic<uint32_t> staleHits{0};
+std::atomic<uint32_t> waits{0};
+std::atomic<uint32_t> blockingLookups{0};
+std::atomic<uint32_t> evictions{0};
+
+class TableLock
+{
+public:
+    TableLock() { xSemaphoreTake(tableMutex, portMAX_DELAY); }
+    ~TableLock() { xSemaphoreGive(tableMutex); }
+};
+
+bool due(const Entry &entry)
+{
+    return !entry.refresh.pending() || entry.refresh.expired();
+}
+
+// with the table locked
+Entry *find(const char *host)
+{
+    for (size_t idx = 0; idx < entryCount; ++idx)
+    {
+        if (strcmp(entries[idx].host, host) == 0)
+        {
+            return &entries[idx];
+        }
+    }
+    return nullptr;
+}
+
+// with the table locked, the least recently used entry makes room when the table is full,
+// nullptr if the name is too long
+Entry *add(const char *host)
+{
+    Entry *entry = find(host);
+    if (entry || strlen(host) >= HOST_LEN)
+    {
+        return entry;
+    }
+
+    if (entryCount < MAX_HOSTS)
+    {
+        entry = &entries[entryCount++];
+    }
+    else
+    {
+        entry = std::min_element(entries, entries + MAX_HOSTS,
+                                 [](const Entry &a, const Entry &b) { return a.lastUsed < b.lastUsed; });
+        LOG_W("[DNS] table full, %s makes room for %s", entry->host, host);
+        evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    strcpy(entry->host, host);
+    entry->ip = 0;
+    entry->refresh.stop();
+    entry->lastUsed = Deadline::now();
+    return entry;
+}
+
+void wakeResolver()
+{
+    if (resolverTaskHandle)
+    {
+        xTaskNotifyGive(resolverTaskHandle);
+    }
+}
+
+uint16_t readU16(const uint8_t *p)
+{
+    return static_cast<uint16_t>(p[0] << 8 | p[1]);
+}
+
+uint32_t readU32(const uint8_t *p)
+{
+    return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 | static_cast<uint32_t>(p[2]) << 8 |
+           p[3];
+}
+
+// a query for the A record of host, the length, 0 if the name does not fit
+size_t buildQuery(const char *host, uint16_t id, uint8_t *buf, size_t len)
+{
+    const uint8_t header[HEADER_LEN] = {static_cast<uint8_t>(id >> 8), static_cast<uint8_t>(id), 0x01, 0x00, // RD
+                                        0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+    memcpy(buf, header, sizeof(header));
+    size_t pos = HEADER_LEN;
+
+    // www.example.com is sent as 3www7example3com0
+    const char *label = host;
+    while (*label)
+    {
+        const char *dot = strchr(label, '.');
+        const size_t label_len = dot ? static_cast<size_t>(dot - label) : strlen(label);
+        if (label_len == 0 || label_len > 63 || pos + 1 + label_len + 5 > len)
+        {
+            return 0;
+        }
+
+        buf[pos++] = static_cast<uint8_t>(label_len);
+        memcpy(buf + pos, label, label_len);
+        pos += label_len;
+        label += dot ? label_len + 1 : label_len;
+    }
+
+    const uint8_t question[5] = {0x00, 0x00, TYPE_A, 0x00, CLASS_IN};
+    memcpy(buf + pos, question, sizeof(question));
+    return pos + sizeof(question);
+}
+
+// moves pos past the name at it, false if it runs out of the message
+bool skipName(const uint8_t *buf, size_t len, size_t &pos)
+{
+    while (pos < len)
+    {
+        const uint8_t label_len = buf[pos];
+        if ((label_len & 0xc0) == 0xc0)
+        {
+            // a pointer to a name earlier in the message ends it
+            pos += 2;
+            return pos <= len;
+        }
+
+        pos += 1 + label_len;
+        if (label_len == 0)
+        {
+            return pos <= len;
+        }
+    }
+    return false;
+}
+
+// the first A record of the answer, ttl is the lowest TTL up to it, CNAMEs included
+bool parseAnswer(const uint8_t *buf, size_t len, uint16_t id, uint32_t &ip, uint32_t &ttl)
+{
+    if (len < HEADER_LEN || readU16(buf) != id || !(buf[2] & 0x80) || (buf[3] & 0x0f) != 0)
+    {
+        return false;
+    }
+
+    const uint16_t question_count = readU16(buf + 4);
+    const uint16_t answer_count = readU16(buf + 6);
+    size_t pos = HEADER_LEN;
+
+    for (uint16_t idx = 0; idx < question_count; ++idx)
+    {
+        // the type and class follow the name
+        if (!skipName(buf, len, pos) || pos + 4 > len)
+        {
+            return false;
+        }
+        pos += 4;
+    }
+
+    ttl = UINT32_MAX;
+    for (uint16_t idx = 0; idx < answer_count; ++idx)
+    {
+        if (!skipName(buf, len, pos) || pos + 10 > len)
+        {
+            return false;
+        }
+
+        const uint16_t type = readU16(buf + pos);
+        const uint16_t record_class = readU16(buf + pos + 2);
+        const uint32_t record_ttl = readU32(buf + pos + 4);
+        const uint16_t data_len = readU16(buf + pos + 8);
+        pos += 10;
+        if (pos + data_len > len)
+        {
+            return false;
+        }
+
+        ttl = std::min(ttl, record_ttl);
+        if (type == TYPE_A && record_class == CLASS_IN && data_len == 4)
+        {
+            // IPAddress keeps the first octet in the lowest byte
+            memcpy(&ip, buf + pos, sizeof(ip));
+            return true;
+        }
+        pos += data_len;
+    }
+
+    return false;
+}
+
+bool query(const char *host, uint32_t &ip, uint32_t &ttl)
+{
+    const IPAddress server = WiFi.dnsIP(0);
+    if (!WiFi.isConnected() || static_cast<uint32_t>(server) == 0)
+    {
+        return false;
+    }
+
+    uint8_t buf[MAX_MESSAGE];
+    const uint16_t id = static_cast<uint16_t>(esp_random());
+    const size_t query_len = buildQuery(host, id, buf, sizeof(buf));
+    if (query_len == 0)
+    {
+        LOG_W("[DNS] %s is not a host name", host);
+        return false;
+    }
+
+    const int fd = lwip_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    timeval tv;
+    tv.tv_sec = QUERY_TIMEOUT_MS / 1000;
+    tv.tv_usec = (QUERY_TIMEOUT_MS % 1000) * 1000;
+    lwip_setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = server;
+    server_addr.sin_port = htons(DNS_PORT);
+
+    // the query goes out again if the first answer is lost, the server may drop it as well
+    bool answered = false;
+    uint8_t answer[MAX_MESSAGE];
+    for (uint8_t attempt = 0; attempt < QUERY_ATTEMPTS && !answered; ++attempt)
+    {
+        if (lwip_sendto(fd, buf, query_len, 0, reinterpret_cast<const sockaddr *>(&server_addr),
+                        sizeof(server_addr)) < 0)
+        {
+            break;
+        }
+
+        // answers to an earlier query that timed out are skipped by their id
+        int received;
+        while ((received = lwip_recvfrom(fd, answer, sizeof(answer), 0, nullptr, nullptr)) > 0)
+        {
+            if (parseAnswer(answer, received, id, ip, ttl))
+            {
+                answered = true;
+                break;
+            }
+        }
+    }
+
+    lwip_close(fd);
+    return answered;
+}
+
+void loadHosts()
+{
+    Preferences preferences;
+    if (!preferences.begin(NAMESPACE, true))
+    {
+        return;
+    }
+
+    StoredHost stored[MAX_HOSTS]{};
+    if (preferences.getUChar("version", 0) == FORMAT_VERSION &&
+        preferences.getBytes("hosts", stored, sizeof(stored)) == sizeof(stored))
+    {
+        TableLock lock;
+        for (size_t idx = 0; idx < MAX_HOSTS; ++idx)
+        {
+            stored[idx].host[HOST_LEN - 1] = '\0';
+            Entry *entry = stored[idx].ip ? add(stored[idx].host) : nullptr;
+            if (entry)
+            {
+                entry->ip = stored[idx].ip;
+                savedHosts[entry - entries] = stored[idx];
+            }
+        }
+    }
+    preferences.end();
+}
+
+// NVS is only written when an address changed
+void saveHosts()
+{
+    StoredHost stored[MAX_HOSTS]{};
+    bool changed = false;
+    {
+        TableLock lock;
+        for (size_t idx = 0; idx < entryCount; ++idx)
+        {
+            strcpy(stored[idx].host, entries[idx].host);
+            stored[idx].ip = entries[idx].ip;
+            // an evicted host is replaced in its slot
+            changed |= savedHosts[idx].ip != stored[idx].ip || strcmp(savedHosts[idx].host, stored[idx].host) != 0;
+            savedHosts[idx] = stored[idx];
+        }
+    }
+    if (!changed)
+    {
+        return;
+    }
+
+    Preferences preferences;
+    if (!preferences.begin(NAMESPACE, false))
+    {
+        LOG_W("[DNS] opening NVS failed");
+        return;
+    }
+
+    preferences.remove("version");
+    preferences.putBytes("hosts", stored, sizeof(stored));
+    preferences.putUChar("version", FORMAT_VERSION);
+    preferences.end();
+}
+
+// the addresses of DNS_FALLBACK, for hosts that have none from NVS
+void addFallbacks()
+{
+    const char *pairs = DNS_FALLBACK;
+
+    while (*pairs)
+    {
+        const char *end = strchr(pairs, ',');
+        const size_t len = end ? static_cast<size_t>(end - pairs) : strlen(pairs);
+
+        char pair[HOST_LEN + 16];
+        const char *equals = static_cast<const char *>(memchr(pairs, '=', len));
+        IPAddress address;
+        if (len < sizeof(pair) && equals)
+        {
+            memcpy(pair, pairs, len);
+            pair[len] = '\0';
+            pair[equals - pairs] = '\0';
+
+            TableLock lock;
+            Entry *entry = address.fromString(pair + (equals - pairs) + 1) ? add(pair) : nullptr;
+            if (entry && entry->ip == 0)
+            {
+                entry->ip = address;
+            }
+        }
+        else if (len > 0)
+        {
+            LOG_E("[DNS] DNS_FALLBACK %.*s is not host=address", static_cast<int>(len), pairs);
+        }
+
+        pairs += end ? len + 1 : len;
+    }
+}
+
+// the first entry that is due, copies its name, -1 if none is
+int nextDue(char *host)
+{
+    TableLock lock;
+    for (size_t idx = 0; idx < entryCount; ++idx)
+    {
+        if (due(entries[idx]))
+        {
+            strcpy(host, entries[idx].host);
+            return static_cast<int>(idx);
+        }
+    }
+    return -1;
+}
+
+uint32_t untilNextDueMs()
+{
+    TableLock lock;
+    uint32_t wait_ms = UINT32_MAX;
+    for (size_t idx = 0; idx < entryCount; ++idx)
+    {
+        wait_ms = std::min(wait_ms, entries[idx].refresh.remainingMs());
+    }
+    return wait_ms;
+}
+
+void resolverTask(void *)
+{
+    for (;;)
+    {
+        const uint32_t wait_ms = untilNextDueMs();
+        ulTaskNotifyTake(pdTRUE, wait_ms == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(wait_ms));
+
+        char host[HOST_LEN];
+        int idx;
+        bool resolved_any = false;
+        while ((idx = nextDue(host)) >= 0)
+        {
+            const int64_t start = Deadline::now();
+            uint32_t ip = 0;
+            uint32_t ttl = 0;
+            const bool resolved = query(host, ip, ttl);
+            const uint32_t elapsed_ms = Deadline::msSince(start);
+
+            ++queries;
+            maxQueryMs = std::max(maxQueryMs, elapsed_ms);
+            if (!resolved)
+            {
+                ++failedQueries;
+            }
+
+            TableLock lock;
+            Entry &entry = entries[idx];
+            if (strcmp(entry.host, host) != 0)
+            {
+                // evicted while the query ran
+                continue;
+            }
+            if (resolved)
+            {
+                entry.ip = ip;
+                entry.refresh.start(std::max(MIN_TTL_S, std::min(ttl, MAX_TTL_S)) * 1000);
+                resolved_any = true;
+            }
+            else
+            {
+                // the old address, if any, stays in use
+                entry.refresh.start(RETRY_MS);
+            }
+        }
+
+        if (resolved_any)
+        {
+            saveHosts();
+        }
+    }
+}
+} // namespace
+
+void dnsBegin()
+{
+    loadHosts();
+    addFallbacks();
+    xTaskCreate(resolverTask, "dns", TASK_STACK_SIZE, nullptr, tskIDLE_PRIORITY + 1, &resolverTaskHandle);
+}
+
+void dnsAddHost(const char *host)
+{
+    IPAddress literal;
+    if (literal.fromString(host))
+    {
+        return;
+    }
+
+    {
+        TableLock lock;
+        Entry *entry = add(host);
+        if (entry)
+        {
+            entry->lastUsed = Deadline::now();
+        }
+        else
+        {
+            LOG_W("[DNS] %s is too long to be cached", host);
+        }
+    }
+    wakeResolver();
+}
+
+void dnsPrewarm()
+{
+    {
+        TableLock lock;
+        for (size_t idx = 0; idx < entryCount; ++idx)
+        {
+            entries[idx].refresh.stop();
+        }
+    }
+    wakeResolver();
+}
+
+bool dnsResolve(const char *host, IPAddress &address)
+{
+    if (address.fromString(host))
+    {
+        return true;
+    }
+
+    bool known;
+    {
+        TableLock lock;
+        Entry *entry = add(host);
+        if (entry)
+        {
+            entry->lastUsed = Deadline::now();
+        }
+
+        if (!entry)
+        {
+            known = false;
+        }
+        else if (entry->ip)
+        {
+            // handed out even when the TTL ran out, the lookup runs meanwhile
+            address = entry->ip;
+            const bool stale = due(*entry);
+            (stale ? staleHits : freshHits).fetch_add(1, std::memory_order_relaxed);
+            if (stale)
+            {
+                wakeResolver();
+            }
+            return true;
+        }
+        else
+        {
+            known = true;
+            // a host without an address is looked up right away, even while a retry waits
+            entry->refresh.stop();
+        }
+    }
+
+    if (!known)
+    {
+        // the name is too long, this host gets no cache
+        blockingLookups.fetch_add(1, std::memory_order_relaxed);
+        return WiFi.hostByName(host, address);
+    }
+
+    waits.fetch_add(1, std::memory_order_relaxed);
+    wakeResolver();
+
+    for (uint32_t waited_ms = 0; waited_ms < DNS_WAIT_MS; waited_ms += WAIT_STEP_MS)
+    {
+        vTaskDelay(pdMS_TO_TICKS(WAIT_STEP_MS));
+
+        TableLock lock;
+        const Entry *entry = find(host);
+        if (entry && entry->ip)
+        {
+            address = entry->ip;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void dnsPrintStats()
+{
+    LOG_I("[DNS] %u fresh, %u stale, %u waited, %u blocking, %u evicted, %u queries (%u failed, %u ms at most)",
+          freshHits.load(), staleHits.load(), waits.load(), blockingLookups.load(), evictions.load(), queries,
+          failedQueries, maxQueryMs);
+}
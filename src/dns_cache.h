@@ -0,0 +1,31 @@
+#pragma once
+
+#include <Arduino.h>
+#include <IPAddress.h>
+
+// A resolver cache in front of the connects. lwIP resolves in the calling task and on the
+// train network that can block the loop for seconds, so the lookups run in a task of their
+// own, with a small DNS client that reads the TTL of the answers:
+//
+// - an entry is refreshed in the background once its TTL ran out, meanwhile the old address
+//   is still handed out (stale-while-revalidate)
+// - the hosts are looked up again right after the link comes up (dnsPrewarm), before the
+//   first request needs them
+// - the last address of every host is kept in NVS, and DNS_FALLBACK can name addresses for
+//   the very first boot, so a DNS server that does not answer does not cost a poll cycle
+//
+// Only a host that was never resolved makes dnsResolve() wait, for DNS_WAIT_MS at most.
+
+// starts the resolver task and loads the last known addresses
+void dnsBegin();
+
+// a host to keep resolved
+void dnsAddHost(const char *host);
+
+// looks all hosts up again, call it when the link came up
+void dnsPrewarm();
+
+// the address of host, false if there is none yet and none arrived within DNS_WAIT_MS
+bool dnsResolve(const char *host, IPAddress &address);
+
+void dnsPrintStats();
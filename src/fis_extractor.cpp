@@ -0,0 +1,407 @@
+#include "fis_extractor.h"
+
+#include "deadline.h"
+#include "logger.h"
+#include "metrics.h"
+
+namespace
+{
+bool isWhitespace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+bool isLiteralChar(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '-' || c == '+' || c == '.' || c == 'E';
+}
+} // namespace
+
+bool FisValue::operator==(const FisValue &other) const
+{
+    if (present != other.present)
+    {
+        return false;
+    }
+
+    return !present || (isString == other.isString && len == other.len && memcmp(text, other.text, len) == 0);
+}
+
+FisExtractor::FisExtractor(FisSnapshot &snapshot, Stream *forward) : snapshot{snapshot}, forward{forward}
+{
+    snapshot.clear();
+}
+
+size_t FisExtractor::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t FisExtractor::write(const uint8_t *buf, size_t size)
+{
+    const int64_t started = Deadline::now();
+    for (size_t idx = 0; idx < size; ++idx)
+    {
+        feed(static_cast<char>(buf[idx]));
+    }
+    countParsed(Parser::FIS, size, static_cast<uint32_t>(Deadline::now() - started));
+
+    if (forward && forward->write(buf, size) != size)
+    {
+        forward = nullptr;
+        forwardError = true;
+    }
+
+    // neither syntax errors nor a failed forward stream are a reason to abort the download,
+    // the result is just not complete(), or not forwarded
+    return size;
+}
+
+void FisExtractor::feed(char c)
+{
+    if (error)
+    {
+        return;
+    }
+
+    switch (lexeme)
+    {
+    case Lexeme::KEY_STRING:
+    case Lexeme::VALUE_STRING:
+    {
+        const bool is_key = lexeme == Lexeme::KEY_STRING;
+
+        if (!escaped && c == '"')
+        {
+            lexeme = Lexeme::NONE;
+
+            if (is_key)
+            {
+                matchedField = tracking() ? findField() : -1;
+                expect = Expect::COLON;
+            }
+            else
+            {
+                endValue();
+            }
+            return;
+        }
+
+        escaped = !escaped && c == '\\';
+
+        if (is_key)
+        {
+            if (tracking())
+            {
+                appendPath(c);
+            }
+        }
+        else
+        {
+            capture(c);
+        }
+        return;
+    }
+    case Lexeme::LITERAL:
+        if (isLiteralChar(c))
+        {
+            capture(c);
+            return;
+        }
+
+        // the literal ends with the next structural character, which still has to be handled
+        lexeme = Lexeme::NONE;
+        endValue();
+        break;
+    default:
+        break;
+    }
+
+    if (isWhitespace(c))
+    {
+        return;
+    }
+
+    if (done)
+    {
+        // only whitespace may follow the document
+        error = true;
+        return;
+    }
+
+    switch (expect)
+    {
+    case Expect::VALUE:
+        if (c == ']' && emptyContainer && levels[depth - 1].isArray)
+        {
+            closeContainer();
+        }
+        else
+        {
+            startValue(c);
+        }
+        break;
+    case Expect::KEY:
+        if (c == '"')
+        {
+            startKey();
+        }
+        else if (c == '}' && emptyContainer)
+        {
+            closeContainer();
+        }
+        else
+        {
+            error = true;
+        }
+        break;
+    case Expect::COLON:
+        if (c == ':')
+        {
+            expect = Expect::VALUE;
+        }
+        else
+        {
+            error = true;
+        }
+        break;
+    case Expect::SEPARATOR:
+        if (depth > 0 && c == ',')
+        {
+            nextElement();
+        }
+        else if (depth > 0 && c == (levels[depth - 1].isArray ? ']' : '}'))
+        {
+            closeContainer();
+        }
+        else
+        {
+            error = true;
+        }
+        break;
+    }
+}
+
+void FisExtractor::startValue(char c)
+{
+    emptyContainer = false;
+
+    target = nullptr;
+    targetOverflow = false;
+
+    if (matchedField >= 0 && !snapshot.values[matchedField].present)
+    {
+        // the first occurrence of a path wins
+        target = &snapshot.values[matchedField];
+        target->len = 0;
+        target->isString = c == '"';
+    }
+
+    if (c == '{' || c == '[')
+    {
+        // only scalars are extracted
+        target = nullptr;
+        openContainer(c == '[');
+    }
+    else if (c == '"')
+    {
+        lexeme = Lexeme::VALUE_STRING;
+        escaped = false;
+    }
+    else if (c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' || c == 'n')
+    {
+        lexeme = Lexeme::LITERAL;
+        capture(c);
+    }
+    else
+    {
+        error = true;
+    }
+}
+
+void FisExtractor::endValue()
+{
+    if (target && !targetOverflow)
+    {
+        target->text[target->len] = '\0';
+        target->present = true;
+    }
+
+    target = nullptr;
+    matchedField = -1;
+    expect = Expect::SEPARATOR;
+
+    if (depth == 0)
+    {
+        done = true;
+    }
+}
+
+void FisExtractor::openContainer(bool isArray)
+{
+    if (depth >= MAX_DEPTH)
+    {
+        LOG_W("[FIS] document nested too deeply");
+        error = true;
+        return;
+    }
+
+    const bool relevant = tracking() && leadsToField(isArray ? '[' : '.');
+    levels[depth++] = {isArray, 0, pathLen, relevant};
+    emptyContainer = true;
+    matchedField = -1;
+
+    if (isArray)
+    {
+        setArrayPath();
+        expect = Expect::VALUE;
+    }
+    else
+    {
+        expect = Expect::KEY;
+    }
+}
+
+void FisExtractor::closeContainer()
+{
+    const Level &level = levels[--depth];
+
+    // back to the path of the container itself, it is a finished value of its parent
+    pathLen = level.mark;
+    pathTruncated = false;
+    emptyContainer = false;
+
+    endValue();
+}
+
+void FisExtractor::nextElement()
+{
+    Level &level = levels[depth - 1];
+
+    if (level.isArray)
+    {
+        ++level.index;
+        setArrayPath();
+        expect = Expect::VALUE;
+    }
+    else
+    {
+        expect = Expect::KEY;
+    }
+}
+
+void FisExtractor::startKey()
+{
+    emptyContainer = false;
+    lexeme = Lexeme::KEY_STRING;
+    escaped = false;
+
+    if (!tracking())
+    {
+        return;
+    }
+
+    pathLen = levels[depth - 1].mark;
+    pathTruncated = false;
+
+    if (pathLen > 0)
+    {
+        appendPath('.');
+    }
+}
+
+void FisExtractor::setArrayPath()
+{
+    const Level &level = levels[depth - 1];
+
+    if (!level.relevant)
+    {
+        matchedField = -1;
+        return;
+    }
+
+    pathLen = level.mark;
+    pathTruncated = false;
+
+    char index[8];
+    const int len = snprintf(index, sizeof(index), "[%u]", level.index);
+    for (int idx = 0; idx < len; ++idx)
+    {
+        appendPath(index[idx]);
+    }
+
+    matchedField = findField();
+}
+
+void FisExtractor::appendPath(char c)
+{
+    if (static_cast<size_t>(pathLen) + 1 < MAX_PATH_LEN)
+    {
+        path[pathLen++] = c;
+    }
+    else
+    {
+        pathTruncated = true;
+    }
+}
+
+void FisExtractor::capture(char c)
+{
+    if (!target)
+    {
+        return;
+    }
+
+    if (static_cast<size_t>(target->len) + 1 < FisValue::CAPACITY)
+    {
+        target->text[target->len++] = c;
+    }
+    else
+    {
+        targetOverflow = true;
+    }
+}
+
+int8_t FisExtractor::findField() const
+{
+    if (pathTruncated)
+    {
+        return -1;
+    }
+
+    for (size_t idx = 0; idx < FIS_FIELD_COUNT; ++idx)
+    {
+        const char *field_path = FIS_FIELDS[idx].path;
+        if (strlen(field_path) == pathLen && memcmp(field_path, path, pathLen) == 0)
+        {
+            return static_cast<int8_t>(idx);
+        }
+    }
+
+    return -1;
+}
+
+// whether some field path continues the current path with separator, '.' for an object and '['
+// for an array
+bool FisExtractor::leadsToField(char separator) const
+{
+    if (pathLen == 0)
+    {
+        return true; // the document itself
+    }
+
+    if (pathTruncated)
+    {
+        return false;
+    }
+
+    for (const FisFieldSpec &field : FIS_FIELDS)
+    {
+        if (strncmp(field.path, path, pathLen) == 0 && field.path[pathLen] == separator)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
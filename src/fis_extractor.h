@@ -0,0 +1,143 @@
+#pragma once
+
+#include <array>
+
+#include <Arduino.h>
+
+// The fields of combined.json we care about. The name is what we send upstream, the path
+// addresses the value inside the document, objects are separated by '.', array elements
+// are addressed with [index]. The binary records send numbers with a scale as integers,
+// value * scale. The position in the list is the key in binary records, only append to it.
+struct FisFieldSpec
+{
+    const char *name;
+    const char *path;
+    uint32_t scale{0};
+};
+
+constexpr std::array<FisFieldSpec, 10> FIS_FIELDS{{
+    {"lat", "latitude", 1000000}, // microdegrees, about 10 cm
+    {"lon", "longitude", 1000000},
+    {"speed", "speed"},
+    {"delay", "delay"},
+    {"train", "trainType"},
+    {"trip", "tripNumber"},
+    {"dest", "destination.de"},
+    {"station", "currentStation.name.de"},
+    {"next", "nextStation.name.de"},
+    {"next_arrival", "nextStation.arrival.forecast"},
+}};
+
+constexpr size_t FIS_FIELD_COUNT = FIS_FIELDS.size();
+
+// A single extracted value, as it was written in the document. Strings keep their escapes
+// (but not their quotes), so they can be written out as JSON again without re-encoding.
+struct FisValue
+{
+    static constexpr size_t CAPACITY = 48;
+
+    char text[CAPACITY]{};
+    uint8_t len{0};
+    bool present{false};
+    bool isString{false};
+
+    bool operator==(const FisValue &other) const;
+    bool operator!=(const FisValue &other) const { return !(*this == other); }
+};
+
+struct FisSnapshot
+{
+    std::array<FisValue, FIS_FIELD_COUNT> values{};
+
+    void clear() { values.fill({}); }
+};
+
+// Incremental JSON tokenizer that picks the FIS_FIELDS out of combined.json while it is being
+// downloaded. It keeps no more state than the current path, so it does not care where the chunk
+// boundaries are and never needs the document in memory. Values that do not fit into a FisValue
+// are treated as missing. Containers no FIS field lies in are only tokenized, no paths are built
+// or compared inside them. Everything written can be passed on to a forward stream. If that
+// fails, e.g. an upload whose connection broke, the rest of the document is still extracted.
+class FisExtractor : public Stream
+{
+public:
+    static constexpr size_t MAX_DEPTH = 10;
+    static constexpr size_t MAX_PATH_LEN = 128;
+
+    explicit FisExtractor(FisSnapshot &snapshot, Stream *forward = nullptr);
+
+    // the document was closed properly and had no syntax errors
+    bool complete() const { return done && !error; }
+
+    // the forward stream did not take everything, it got nothing more after that
+    bool forwardFailed() const { return forwardError; }
+
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buf, size_t size) override;
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    void flush() override {}
+
+private:
+    enum class Expect : uint8_t
+    {
+        VALUE,
+        KEY,
+        COLON,
+        SEPARATOR // ',' or the end of the container
+    };
+
+    enum class Lexeme : uint8_t
+    {
+        NONE,
+        KEY_STRING,
+        VALUE_STRING,
+        LITERAL
+    };
+
+    struct Level
+    {
+        bool isArray;
+        uint16_t index;
+        uint8_t mark;  // path length of the container itself
+        bool relevant; // some FIS field lies inside, otherwise the path is not tracked
+    };
+
+    void feed(char c);
+    void startValue(char c);
+    void endValue();
+    void openContainer(bool isArray);
+    void closeContainer();
+    void nextElement();
+    void startKey();
+    void setArrayPath();
+    void appendPath(char c);
+    void capture(char c);
+    int8_t findField() const;
+    bool leadsToField(char separator) const;
+    bool tracking() const { return depth == 0 || levels[depth - 1].relevant; }
+
+    FisSnapshot &snapshot;
+    Stream *forward;
+    bool forwardError{false};
+
+    std::array<Level, MAX_DEPTH> levels{};
+    uint8_t depth{0};
+
+    char path[MAX_PATH_LEN]{};
+    uint8_t pathLen{0};
+    bool pathTruncated{false};
+
+    Expect expect{Expect::VALUE};
+    Lexeme lexeme{Lexeme::NONE};
+    bool escaped{false};
+    bool emptyContainer{false};
+
+    int8_t matchedField{-1};
+    FisValue *target{nullptr};
+    bool targetOverflow{false};
+
+    bool done{false};
+    bool error{false};
+};
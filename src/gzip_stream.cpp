@@ -0,0 +1,532 @@
+#include "gzip_stream.h"
+
+#include <esp_heap_caps.h>
+
+#include "logger.h"
+
+namespace
+{
+const uint32_t CRC_TABLE[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+
+// deflate length codes 257..285 and distance codes 0..29, RFC 1951 3.2.5
+const uint16_t LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27,
+                                  31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                  2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t DISTANCE_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+                                    193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+                                    6145, 8193, 12289, 16385, 24577};
+const uint8_t DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+constexpr uint16_t END_OF_BLOCK = 256;
+
+// ID1, ID2, CM = deflate, no flags, no mtime, no extra flags, OS unknown
+const uint8_t GZIP_HEADER[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+
+constexpr uint8_t FHCRC = 0x02;
+constexpr uint8_t FEXTRA = 0x04;
+constexpr uint8_t FNAME = 0x08;
+constexpr uint8_t FCOMMENT = 0x10;
+} // namespace
+
+uint32_t crc32Update(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    crc = ~crc;
+    for (size_t idx = 0; idx < len; ++idx)
+    {
+        crc ^= buf[idx];
+        crc = (crc >> 4) ^ CRC_TABLE[crc & 0x0f];
+        crc = (crc >> 4) ^ CRC_TABLE[crc & 0x0f];
+    }
+    return ~crc;
+}
+
+void GzipStream::begin(Stream *output)
+{
+    this->output = output;
+    failed = false;
+    pos = 0;
+    fill = 0;
+    memset(head, 0, sizeof(head));
+    memset(prev, 0, sizeof(prev));
+    bitBuffer = 0;
+    bitCount = 0;
+    outLen = 0;
+    crc = 0;
+    inputSize = 0;
+    outputSize = 0;
+
+    for (uint8_t byte : GZIP_HEADER)
+    {
+        putByte(byte);
+    }
+
+    // everything goes into one block with the fixed codes, BFINAL = 0, BTYPE = 01
+    putBits(0, 1);
+    putBits(1, 2);
+}
+
+size_t GzipStream::write(const uint8_t *buf, size_t size)
+{
+    if (!output || failed)
+    {
+        return 0;
+    }
+
+    crc = crc32Update(crc, buf, size);
+    inputSize += size;
+
+    size_t done = 0;
+    while (done < size)
+    {
+        if (fill == BUFFER_SIZE)
+        {
+            slide();
+        }
+
+        const size_t len = std::min(size - done, BUFFER_SIZE - fill);
+        memcpy(window + fill, buf + done, len);
+        fill += len;
+        done += len;
+
+        compress(false);
+    }
+
+    return failed ? 0 : size;
+}
+
+bool GzipStream::finish()
+{
+    if (!output)
+    {
+        return false;
+    }
+
+    compress(true);
+    putSymbol(END_OF_BLOCK);
+
+    // an empty final block, the first one could not know it was the last
+    putBits(1, 1);
+    putBits(1, 2);
+    putSymbol(END_OF_BLOCK);
+
+    if (bitCount > 0)
+    {
+        putBits(0, 8 - bitCount);
+    }
+
+    for (uint8_t shift = 0; shift < 32; shift += 8)
+    {
+        putByte(static_cast<uint8_t>(crc >> shift));
+    }
+    for (uint8_t shift = 0; shift < 32; shift += 8)
+    {
+        putByte(static_cast<uint8_t>(inputSize >> shift));
+    }
+    flushOutput();
+
+    output = nullptr;
+    return !failed;
+}
+
+// encodes until only MAX_MATCH bytes are left, so every match can be as long as possible,
+// or everything if there won't be more input
+void GzipStream::compress(bool final)
+{
+    while (pos < fill && (final || static_cast<size_t>(fill - pos) >= MAX_MATCH))
+    {
+        size_t distance = 0;
+        const size_t length = longestMatch(pos, distance);
+
+        if (length >= MIN_MATCH)
+        {
+            putMatch(length, distance);
+            for (size_t idx = 0; idx < length; ++idx)
+            {
+                insert(pos + idx);
+            }
+            pos += length;
+        }
+        else
+        {
+            putSymbol(window[pos]);
+            insert(pos);
+            ++pos;
+        }
+    }
+}
+
+// drops the oldest WINDOW_SIZE bytes, only called with pos beyond them
+void GzipStream::slide()
+{
+    memmove(window, window + WINDOW_SIZE, fill - WINDOW_SIZE);
+    pos -= WINDOW_SIZE;
+    fill -= WINDOW_SIZE;
+
+    for (uint16_t &entry : head)
+    {
+        entry = entry > WINDOW_SIZE ? entry - WINDOW_SIZE : 0;
+    }
+    for (uint16_t &entry : prev)
+    {
+        entry = entry > WINDOW_SIZE ? entry - WINDOW_SIZE : 0;
+    }
+}
+
+uint16_t GzipStream::hash(size_t at) const
+{
+    const uint32_t bytes = (window[at] << 16) | (window[at + 1] << 8) | window[at + 2];
+    return static_cast<uint16_t>((bytes * 2654435761u) >> (32 - HASH_BITS));
+}
+
+void GzipStream::insert(size_t at)
+{
+    if (at + MIN_MATCH > fill)
+    {
+        return;
+    }
+
+    const uint16_t h = hash(at);
+    prev[at & (WINDOW_SIZE - 1)] = head[h];
+    head[h] = static_cast<uint16_t>(at + 1);
+}
+
+size_t GzipStream::longestMatch(size_t at, size_t &distance) const
+{
+    if (at + MIN_MATCH > fill)
+    {
+        return 0;
+    }
+
+    const size_t max_len = std::min(MAX_MATCH, fill - at);
+    // older positions are outside the window, their prev entries were reused already
+    const size_t limit = at > WINDOW_SIZE ? at - WINDOW_SIZE : 0;
+
+    size_t best = 0;
+    uint16_t candidate = head[hash(at)];
+
+    for (uint8_t chain = 0; candidate != 0 && chain < MAX_CHAIN; ++chain)
+    {
+        const size_t from = candidate - 1u;
+        if (from < limit || from >= at)
+        {
+            break;
+        }
+
+        // a longer match has to differ from the best one at its last byte
+        if (window[from + best] == window[at + best])
+        {
+            size_t len = 0;
+            while (len < max_len && window[from + len] == window[at + len])
+            {
+                ++len;
+            }
+
+            if (len > best)
+            {
+                best = len;
+                distance = at - from;
+                if (len == max_len)
+                {
+                    break;
+                }
+            }
+        }
+
+        candidate = prev[from & (WINDOW_SIZE - 1)];
+        if (candidate - 1u >= from)
+        {
+            break; // the chain goes on in a part of the ring that was reused
+        }
+    }
+
+    return best >= MIN_MATCH ? best : 0;
+}
+
+// the fixed literal/length code, RFC 1951 3.2.6
+void GzipStream::putSymbol(uint16_t symbol)
+{
+    if (symbol < 144)
+    {
+        putCode(0x30 + symbol, 8);
+    }
+    else if (symbol < 256)
+    {
+        putCode(0x190 + symbol - 144, 9);
+    }
+    else if (symbol < 280)
+    {
+        putCode(symbol - 256, 7);
+    }
+    else
+    {
+        putCode(0xc0 + symbol - 280, 8);
+    }
+}
+
+void GzipStream::putMatch(size_t length, size_t distance)
+{
+    uint8_t code = 28;
+    while (LENGTH_BASE[code] > length)
+    {
+        --code;
+    }
+    putSymbol(257 + code);
+    putBits(length - LENGTH_BASE[code], LENGTH_EXTRA[code]);
+
+    code = 29;
+    while (DISTANCE_BASE[code] > distance)
+    {
+        --code;
+    }
+    // the fixed distance codes are all 5 bits long
+    putCode(code, 5);
+    putBits(distance - DISTANCE_BASE[code], DISTANCE_EXTRA[code]);
+}
+
+// Huffman codes go out starting with their most significant bit
+void GzipStream::putCode(uint16_t code, uint8_t len)
+{
+    uint16_t reversed = 0;
+    for (uint8_t idx = 0; idx < len; ++idx)
+    {
+        reversed = (reversed << 1) | ((code >> idx) & 1);
+    }
+    putBits(reversed, len);
+}
+
+void GzipStream::putBits(uint32_t bits, uint8_t count)
+{
+    bitBuffer |= bits << bitCount;
+    bitCount += count;
+
+    while (bitCount >= 8)
+    {
+        putByte(static_cast<uint8_t>(bitBuffer));
+        bitBuffer >>= 8;
+        bitCount -= 8;
+    }
+}
+
+void GzipStream::putByte(uint8_t byte)
+{
+    out[outLen++] = byte;
+    if (outLen == OUTPUT_SIZE)
+    {
+        flushOutput();
+    }
+}
+
+void GzipStream::flushOutput()
+{
+    if (outLen > 0 && !failed && output->write(out, outLen) != outLen)
+    {
+        failed = true;
+    }
+    outputSize += outLen;
+    outLen = 0;
+}
+
+GunzipStream::~GunzipStream()
+{
+    heap_caps_free(state);
+}
+
+bool GunzipStream::allocate()
+{
+    if (!state)
+    {
+        state = static_cast<State *>(heap_caps_malloc(sizeof(State), psramFound() ? MALLOC_CAP_SPIRAM : MALLOC_CAP_8BIT));
+    }
+
+    if (!state)
+    {
+        LOG_W("[GZIP] no memory for the inflater (%u bytes)", static_cast<unsigned>(sizeof(State)));
+    }
+    return state != nullptr;
+}
+
+void GunzipStream::begin(Stream *output)
+{
+    this->output = output;
+    stage = state ? Stage::HEADER : Stage::FAILED;
+    flags = 0;
+    headerCount = 0;
+    skipCount = 0;
+    dictionaryOffset = 0;
+
+    if (state)
+    {
+        tinfl_init(&state->inflator);
+    }
+}
+
+size_t GunzipStream::write(const uint8_t *buf, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+        if (stage == Stage::FAILED)
+        {
+            return 0;
+        }
+
+        if (stage == Stage::DONE)
+        {
+            // the trailer, and anything a broken server sends after it
+            break;
+        }
+
+        if (stage == Stage::DEFLATE)
+        {
+            size_t len = size - done;
+            if (!inflate(buf + done, len))
+            {
+                stage = Stage::FAILED;
+                return 0;
+            }
+            done += len;
+            continue;
+        }
+
+        if (!parseHeader(buf[done++]))
+        {
+            LOG_W("[GZIP] invalid gzip header");
+            stage = Stage::FAILED;
+            return 0;
+        }
+    }
+
+    return size;
+}
+
+bool GunzipStream::parseHeader(uint8_t byte)
+{
+    switch (stage)
+    {
+    case Stage::HEADER:
+        // ID1, ID2 and CM = deflate
+        if ((headerCount == 0 && byte != 0x1f) || (headerCount == 1 && byte != 0x8b) || (headerCount == 2 && byte != 8))
+        {
+            return false;
+        }
+        if (headerCount == 3)
+        {
+            flags = byte;
+        }
+        if (++headerCount == sizeof(GZIP_HEADER))
+        {
+            nextHeaderField();
+        }
+        return true;
+
+    case Stage::EXTRA_LEN:
+        skipCount |= byte << (8 * headerCount);
+        if (++headerCount == 2)
+        {
+            stage = Stage::SKIP;
+            if (skipCount == 0)
+            {
+                nextHeaderField();
+            }
+        }
+        return true;
+
+    case Stage::SKIP:
+        if (--skipCount == 0)
+        {
+            nextHeaderField();
+        }
+        return true;
+
+    case Stage::NAME:
+    case Stage::COMMENT:
+        if (byte == 0)
+        {
+            nextHeaderField();
+        }
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// the optional header fields come in this order, RFC 1952 2.3
+void GunzipStream::nextHeaderField()
+{
+    if (flags & FEXTRA)
+    {
+        flags &= ~FEXTRA;
+        stage = Stage::EXTRA_LEN;
+        headerCount = 0;
+        skipCount = 0;
+    }
+    else if (flags & FNAME)
+    {
+        flags &= ~FNAME;
+        stage = Stage::NAME;
+    }
+    else if (flags & FCOMMENT)
+    {
+        flags &= ~FCOMMENT;
+        stage = Stage::COMMENT;
+    }
+    else if (flags & FHCRC)
+    {
+        flags &= ~FHCRC;
+        stage = Stage::SKIP;
+        skipCount = 2;
+    }
+    else
+    {
+        stage = Stage::DEFLATE;
+    }
+}
+
+// feeds size bytes of deflate data to the inflater, size is set to what it took
+bool GunzipStream::inflate(const uint8_t *buf, size_t &size)
+{
+    const size_t available = size;
+    size = 0;
+
+    while (true)
+    {
+        size_t in_len = available - size;
+        size_t out_len = TINFL_LZ_DICT_SIZE - dictionaryOffset;
+        uint8_t *out = state->dictionary + dictionaryOffset;
+
+        // the dictionary doubles as the output buffer, it wraps around
+        const tinfl_status status = tinfl_decompress(&state->inflator, buf + size, &in_len,
+                                                     state->dictionary, out, &out_len,
+                                                     TINFL_FLAG_HAS_MORE_INPUT);
+        size += in_len;
+
+        if (out_len > 0 && output->write(out, out_len) != out_len)
+        {
+            return false;
+        }
+        dictionaryOffset = (dictionaryOffset + out_len) & (TINFL_LZ_DICT_SIZE - 1);
+
+        if (status == TINFL_STATUS_DONE)
+        {
+            stage = Stage::DONE;
+            return true;
+        }
+
+        if (status < TINFL_STATUS_DONE)
+        {
+            LOG_W("[GZIP] inflating failed: %d", static_cast<int>(status));
+            return false;
+        }
+
+        if (status == TINFL_STATUS_NEEDS_MORE_INPUT)
+        {
+            return true;
+        }
+    }
+}
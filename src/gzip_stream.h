@@ -0,0 +1,141 @@
+#pragma once
+
+#include <Arduino.h>
+#include <esp32/rom/miniz.h>
+
+// standard CRC-32 as used by gzip, crc is the result for the data before buf, 0 to start
+uint32_t crc32Update(uint32_t crc, const uint8_t *buf, size_t len);
+
+// Compresses everything written to it into a gzip member and passes that on to another stream.
+// LZ77 over a WINDOW_SIZE history with short hash chains, coded with the fixed Huffman codes of
+// deflate, so there are no block tables to collect and the output follows the input with at most
+// MAX_MATCH bytes of lookahead. All state is in the object (about 9 KB), nothing is allocated.
+// FIS JSON repeats its keys and the shape of its values over and over, a 2 KB window catches
+// most of that.
+class GzipStream : public Stream
+{
+public:
+    static constexpr size_t WINDOW_SIZE = 2048;
+
+    // starts a new gzip member that is written to output
+    void begin(Stream *output);
+
+    // compresses what is still buffered and writes the gzip trailer, false if writing to the
+    // output failed at some point
+    bool finish();
+
+    uint32_t bytesIn() const { return inputSize; }
+    uint32_t bytesOut() const { return outputSize; }
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *buf, size_t size) override;
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    void flush() override {}
+
+private:
+    static constexpr size_t MIN_MATCH = 3;
+    static constexpr size_t MAX_MATCH = 258;
+    static constexpr size_t BUFFER_SIZE = 2 * WINDOW_SIZE;
+    static constexpr size_t HASH_BITS = 9;
+    static constexpr uint8_t MAX_CHAIN = 8;
+    static constexpr size_t OUTPUT_SIZE = 64;
+
+    static_assert((WINDOW_SIZE & (WINDOW_SIZE - 1)) == 0, "the chain ring is indexed with a mask");
+    static_assert(BUFFER_SIZE - MAX_MATCH >= WINDOW_SIZE, "a full buffer has to be slidable");
+
+    void compress(bool final);
+    void slide();
+    uint16_t hash(size_t pos) const;
+    void insert(size_t pos);
+    size_t longestMatch(size_t pos, size_t &distance) const;
+
+    void putSymbol(uint16_t symbol);
+    void putMatch(size_t length, size_t distance);
+    void putCode(uint16_t code, uint8_t len);
+    void putBits(uint32_t bits, uint8_t count);
+    void putByte(uint8_t byte);
+    void flushOutput();
+
+    Stream *output{nullptr};
+    bool failed{false};
+
+    // the history and the lookahead, window[pos] is the next byte to encode
+    uint8_t window[BUFFER_SIZE];
+    uint16_t pos{0};
+    uint16_t fill{0};
+
+    // position + 1 of the latest string with a hash, and for every position the one before it
+    uint16_t head[1 << HASH_BITS];
+    uint16_t prev[WINDOW_SIZE];
+
+    uint32_t bitBuffer{0};
+    uint8_t bitCount{0};
+
+    uint8_t out[OUTPUT_SIZE];
+    uint8_t outLen{0};
+
+    uint32_t crc{0};
+    uint32_t inputSize{0};
+    uint32_t outputSize{0};
+};
+
+// Decompresses a gzip response body written to it and passes the result on to another stream.
+// The inflater is the one in the ESP32 ROM, it needs a 32 KB dictionary because the server may
+// refer back that far, so the state is only allocated if gzip is actually used. The gzip trailer
+// is not checked, TLS already protects the body.
+class GunzipStream : public Stream
+{
+public:
+    ~GunzipStream();
+
+    // allocates the inflater state, false if there is not enough memory
+    bool allocate();
+    bool allocated() const { return state != nullptr; }
+
+    // starts decompressing a new body into output
+    void begin(Stream *output);
+
+    // the end of the compressed data was reached
+    bool complete() const { return stage == Stage::DONE; }
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *buf, size_t size) override;
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    void flush() override {}
+
+private:
+    enum class Stage : uint8_t
+    {
+        HEADER,    // the fixed 10 bytes
+        EXTRA_LEN, // FEXTRA length
+        SKIP,      // FEXTRA data or FHCRC
+        NAME,      // zero terminated FNAME
+        COMMENT,   // zero terminated FCOMMENT
+        DEFLATE,
+        DONE,
+        FAILED
+    };
+
+    struct State
+    {
+        tinfl_decompressor inflator;
+        uint8_t dictionary[TINFL_LZ_DICT_SIZE];
+    };
+
+    bool parseHeader(uint8_t byte);
+    void nextHeaderField();
+    bool inflate(const uint8_t *buf, size_t &size);
+
+    State *state{nullptr};
+    Stream *output{nullptr};
+
+    Stage stage{Stage::HEADER};
+    uint8_t flags{0};
+    uint16_t headerCount{0};
+    uint16_t skipCount{0};
+    size_t dictionaryOffset{0};
+};
@@ -0,0 +1,97 @@
+#include "heap_watch.h"
+
+#include <atomic>
+
+#include <esp_heap_caps.h>
+
+#include "deadline.h"
+#include "logger.h"
+#include "tls_arena.h"
+
+// can be set from build_flags, e.g. -DSOAK_HOURS=72
+#ifndef SOAK_HOURS
+#define SOAK_HOURS 24
+#endif
+
+namespace
+{
+constexpr uint32_t SAMPLE_INTERVAL_MS = 1000;
+constexpr uint32_t HOUR_MS = 3600 * 1000;
+
+Deadline sampleDeadline;
+Deadline hourDeadline;
+
+// the lowest largest free block per hour, hourMin[hour % SOAK_HOURS], only the loop task
+uint32_t hourMin[SOAK_HOURS];
+uint32_t hour = 0;
+uint32_t currentMin = UINT32_MAX;
+
+// for the metrics, which are rendered by the uploader
+std::atomic<uint32_t> windowMin{UINT32_MAX};
+
+uint32_t lowestOfWindow(uint32_t &lowestHour)
+{
+    uint32_t lowest = currentMin;
+    lowestHour = hour;
+
+    const uint32_t hours = std::min<uint32_t>(hour, SOAK_HOURS - 1);
+    for (uint32_t back = 1; back <= hours; ++back)
+    {
+        const uint32_t past = hour - back;
+        if (hourMin[past % SOAK_HOURS] < lowest)
+        {
+            lowest = hourMin[past % SOAK_HOURS];
+            lowestHour = past;
+        }
+    }
+
+    return lowest;
+}
+
+void finishHour()
+{
+    uint32_t lowest_hour;
+    const uint32_t lowest = lowestOfWindow(lowest_hour);
+
+    LOG_I("[SOAK] hour %u: largest free block at least %u bytes, over the last %u h at least %u (hour %u), "
+          "%u bytes free at least",
+          hour, currentMin, std::min<uint32_t>(hour + 1, SOAK_HOURS), lowest, lowest_hour,
+          static_cast<unsigned>(heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT)));
+    tlsArenaPrintStats();
+
+    hourMin[hour % SOAK_HOURS] = currentMin;
+    ++hour;
+    currentMin = UINT32_MAX;
+}
+} // namespace
+
+void watchHeap()
+{
+    if (sampleDeadline.pending() && !sampleDeadline.expired())
+    {
+        return;
+    }
+    sampleDeadline.advance(SAMPLE_INTERVAL_MS);
+
+    if (!hourDeadline.pending())
+    {
+        hourDeadline.start(HOUR_MS);
+    }
+
+    const uint32_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    currentMin = std::min(currentMin, largest);
+
+    if (hourDeadline.expired())
+    {
+        hourDeadline.advance(HOUR_MS);
+        finishHour();
+    }
+
+    uint32_t lowest_hour;
+    windowMin.store(lowestOfWindow(lowest_hour), std::memory_order_relaxed);
+}
+
+uint32_t minLargestFreeBlock()
+{
+    return windowMin.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <Arduino.h>
+
+// A soak test that runs on every device: the largest free block of the heap is sampled every
+// second, and once an hour the lowest value of that hour is logged together with the lowest of
+// the last SOAK_HOURS hours. A largest block that keeps shrinking over a day means the heap
+// fragments, long before a handshake fails for it.
+//
+// call it from the loop, it only does work once a second
+void watchHeap();
+
+// the lowest largest free block of the last SOAK_HOURS hours, including the current one
+uint32_t minLargestFreeBlock();
@@ -0,0 +1,71 @@
+#include "host_connection.h"
+
+#include "logger.h"
+
+// Hack to access the auto-generated CA bundle from esp-idf
+extern const uint8_t x509_crt_imported_bundle_bin_start[] asm("_binary_x509_crt_bundle_start");
+
+HostConnection::HostConnection(const char *name) : name{name}
+{
+}
+
+void HostConnection::setup(bool verify, const char *spkiPins)
+{
+    if (!verify)
+    {
+        secureClient.setInsecure();
+    }
+    secureClient.setCACertBundle(x509_crt_imported_bundle_bin_start);
+    if (verify && !secureClient.setSpkiPins(spkiPins))
+    {
+        LOG_W("Connection %s: some pins are malformed, they are left out", name);
+    }
+}
+
+void HostConnection::drop()
+{
+    secureClient.stop();
+}
+
+void HostConnection::countRequest()
+{
+    ++connectionStats.requests;
+
+    if (secureClient.connected())
+    {
+        ++connectionStats.reused;
+    }
+    else
+    {
+        ++connectionStats.handshakes;
+    }
+}
+
+void HostConnection::countFailure()
+{
+    ++connectionStats.failures;
+    secureClient.stop();
+}
+
+ConnectionStats HostConnection::stats() const
+{
+    ConnectionStats current = connectionStats;
+    current.resumed = secureClient.resumedHandshakes();
+    return current;
+}
+
+void HostConnection::printStats() const
+{
+    const ConnectionStats current = stats();
+    LOG_I("Connection %s: %u requests, %u reused, %u handshakes (%u resumed, %u pinned, %u chain verified), "
+          "%u failures, %d bytes of heap",
+          name,
+          current.requests,
+          current.reused,
+          current.handshakes,
+          current.resumed,
+          secureClient.pinnedVerifications(),
+          secureClient.chainVerifications(),
+          current.failures,
+          secureClient.sessionHeapBytes());
+}
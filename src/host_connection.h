@@ -0,0 +1,44 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "tls_client.h"
+
+struct ConnectionStats
+{
+    uint32_t requests{0};
+    uint32_t reused{0};     // requests that went out on an already open connection
+    uint32_t handshakes{0}; // requests that needed a new connection (and TLS handshake)
+    uint32_t resumed{0};    // TLS handshakes that resumed the previous session
+    uint32_t failures{0};   // requests that failed and dropped the connection
+};
+
+// One long-lived keep-alive connection to a single host, requests go over client() with an
+// HttpRequest or an UploadStream. A connection is only dropped after an error or when the
+// server does not want to keep it open.
+class HostConnection
+{
+public:
+    explicit HostConnection(const char *name);
+
+    // verify makes the client check the server against the CA bundle and spkiPins (see
+    // TlsClient::setSpkiPins), otherwise any certificate is accepted
+    void setup(bool verify, const char *spkiPins);
+
+    TlsClient &client() { return secureClient; }
+
+    // closes the connection, for responses that were not read to the end
+    void drop();
+
+    // by the requests on client()
+    void countRequest();
+    void countFailure();
+
+    ConnectionStats stats() const;
+    void printStats() const;
+
+private:
+    const char *name;
+    TlsClient secureClient;
+    ConnectionStats connectionStats;
+};
@@ -0,0 +1,543 @@
+#include "http_request.h"
+
+#include <HTTPClient.h>
+
+#include "logger.h"
+#include "wall_clock.h"
+
+namespace
+{
+// the path a redirect leads to on the same host, nullptr if it leaves it
+const char *redirectPath(const UrlParts &current, const char *location)
+{
+    if (location[0] == '/')
+    {
+        return location;
+    }
+
+    UrlParts target;
+    if (!parseUrl(location, target) || target.scheme != current.scheme || target.port != current.port ||
+        strcasecmp(target.host, current.host) != 0)
+    {
+        return nullptr;
+    }
+
+    return target.path;
+}
+
+// the value of a header line that starts with name, nullptr otherwise
+const char *headerValue(const char *line, const char *name)
+{
+    const size_t name_len = strlen(name);
+    if (strncasecmp(line, name, name_len) != 0 || line[name_len] != ':')
+    {
+        return nullptr;
+    }
+
+    const char *value = line + name_len + 1;
+    while (*value == ' ' || *value == '\t')
+    {
+        ++value;
+    }
+    return value;
+}
+
+// values that do not fit are left empty rather than cut off
+void keepValue(const char *value, char *dest, size_t len)
+{
+    const size_t value_len = strlen(value);
+    if (value_len < len)
+    {
+        memcpy(dest, value, value_len + 1);
+    }
+}
+} // namespace
+
+HttpRequest::HttpRequest(HostConnection &connection, CookieStore *cookies)
+    : connection{connection}, client{connection.client()}, cookies{cookies}
+{
+}
+
+void HttpRequest::addHeader(const char *name, const char *value)
+{
+    if (headerCount < requestHeaders.size())
+    {
+        requestHeaders[headerCount++] = {name, value};
+    }
+    else
+    {
+        LOG_W("[HTTP] too many headers, dropping %s", name);
+    }
+}
+
+int HttpRequest::get(const char *url, bool followRedirects)
+{
+    return send("GET", url, nullptr, nullptr, 0, followRedirects);
+}
+
+int HttpRequest::post(const char *url, const char *contentType, const uint8_t *body, size_t len, bool followRedirects)
+{
+    return send("POST", url, contentType, body, len, followRedirects);
+}
+
+int HttpRequest::send(const char *method, const char *url, const char *contentType, const uint8_t *body, size_t len,
+                      bool followRedirects)
+{
+    UrlParts parts;
+    if (!parseUrl(url, parts) || parts.scheme != UrlScheme::HTTPS)
+    {
+        LOG_W("[HTTP] invalid url: %s", url);
+        headerCount = 0;
+        return HTTPC_ERROR_CONNECTION_REFUSED;
+    }
+
+    // the next response overwrites the location a redirect came with
+    char path[sizeof(ResponseHeaders::location)];
+    snprintf(path, sizeof(path), "%s", parts.path);
+
+    int code;
+    for (uint8_t redirects = 0;; ++redirects)
+    {
+        code = exchange(method, parts, path, contentType, body, len);
+
+        const bool same_method = code == HTTP_CODE_MOVED_PERMANENTLY || code == HTTP_CODE_TEMPORARY_REDIRECT ||
+                                 code == HTTP_CODE_PERMANENT_REDIRECT;
+        const bool to_get = code == HTTP_CODE_FOUND || code == HTTP_CODE_SEE_OTHER;
+        if (!followRedirects || redirects == MAX_REDIRECTS || !(to_get || (same_method && strcmp(method, "GET") == 0)) ||
+            responseHeaders.location[0] == '\0')
+        {
+            break;
+        }
+
+        const char *target = redirectPath(parts, responseHeaders.location);
+        if (!target)
+        {
+            LOG_W("[HTTP] not following the redirect to another host: %s", responseHeaders.location);
+            break;
+        }
+
+        snprintf(path, sizeof(path), "%s", target);
+        discard();
+        end();
+        LOG_D("[HTTP] redirected to %s", path);
+
+        if (to_get)
+        {
+            method = "GET";
+            contentType = nullptr;
+            body = nullptr;
+            len = 0;
+        }
+    }
+
+    headerCount = 0;
+    return code;
+}
+
+int HttpRequest::exchange(const char *method, const UrlParts &parts, const char *path, const char *contentType,
+                          const uint8_t *body, size_t len)
+{
+    responseHeaders = {};
+    keepAlive = false;
+    chunked = false;
+    bodyLength = -1;
+    remaining = 0;
+    bodyDone = true;
+    afterChunk = false;
+
+    size_t pos = 0;
+
+    const auto append = [&](const char *format, auto... args) -> void
+    {
+        if (pos < sizeof(requestHeader))
+        {
+            pos += snprintf(requestHeader + pos, sizeof(requestHeader) - pos, format, args...);
+        }
+    };
+
+    append("%s %s HTTP/1.1\r\n", method, path);
+    if (parts.defaultPort)
+    {
+        append("Host: %s\r\n", parts.host);
+    }
+    else
+    {
+        append("Host: %s:%u\r\n", parts.host, parts.port);
+    }
+    append("%s", "User-Agent: ESP32HTTPClient\r\nConnection: keep-alive\r\n");
+
+    for (uint8_t idx = 0; idx < headerCount; ++idx)
+    {
+        append("%s: %s\r\n", requestHeaders[idx].name, requestHeaders[idx].value);
+    }
+
+    if (cookies && cookies->size() > 0)
+    {
+        const size_t cookie_start = pos;
+        append("%s", "Cookie: ");
+        const size_t cookie_len =
+            pos < sizeof(requestHeader) ? cookies->header(path, unixTime(), requestHeader + pos, sizeof(requestHeader) - pos) : 0;
+        if (cookie_len > 0)
+        {
+            pos += cookie_len;
+            append("%s", "\r\n");
+        }
+        else
+        {
+            pos = std::min(cookie_start, pos);
+        }
+    }
+
+    if (contentType)
+    {
+        append("Content-Type: %s\r\n", contentType);
+    }
+    if (body || strcmp(method, "POST") == 0)
+    {
+        append("Content-Length: %u\r\n", static_cast<unsigned>(len));
+    }
+    append("%s", "\r\n");
+
+    if (pos >= sizeof(requestHeader))
+    {
+        LOG_W("[HTTP] request header too long");
+        return HTTPC_ERROR_TOO_LESS_RAM;
+    }
+
+    // a small body goes out in the same TLS record as the header
+    if (len > 0 && pos + len <= sizeof(requestHeader))
+    {
+        memcpy(requestHeader + pos, body, len);
+        pos += len;
+        len = 0;
+    }
+
+    bool stale = false;
+    int code = transmit(parts, pos, body, len, stale);
+    if (stale)
+    {
+        // the whole request is still here, it goes out once more on a new connection
+        LOG_I("[HTTP] kept-alive connection to %s was closed, sending again", parts.host);
+        connection.drop();
+        code = transmit(parts, pos, body, len, stale);
+    }
+    return code;
+}
+
+int HttpRequest::transmit(const UrlParts &parts, size_t headerLen, const uint8_t *body, size_t len, bool &stale)
+{
+    stale = false;
+    connection.countRequest();
+
+    const bool reused = client.connected();
+    if (!reused && !client.connect(parts.host, parts.port))
+    {
+        LOG_W("[HTTP] connecting to %s:%u failed", parts.host, parts.port);
+        connection.countFailure();
+        return HTTPC_ERROR_CONNECTION_REFUSED;
+    }
+
+    int code;
+    if (client.write(reinterpret_cast<const uint8_t *>(requestHeader), headerLen) != headerLen)
+    {
+        code = HTTPC_ERROR_SEND_HEADER_FAILED;
+    }
+    else if (len > 0 && client.write(body, len) != len)
+    {
+        code = HTTPC_ERROR_SEND_PAYLOAD_FAILED;
+    }
+    else if (!waitForData())
+    {
+        code = HTTPC_ERROR_READ_TIMEOUT;
+    }
+    else
+    {
+        return readResponseHeader();
+    }
+
+    // nothing of a response came. On a reused connection the server most likely closed it while
+    // it was idle, that is no failure of the host
+    stale = reused;
+    if (!stale)
+    {
+        connection.countFailure();
+    }
+    return code;
+}
+
+int HttpRequest::readResponseHeader()
+{
+    // status line looks like "HTTP/1.1 200 OK"
+    if (!readLine())
+    {
+        connection.countFailure();
+        return HTTPC_ERROR_READ_TIMEOUT;
+    }
+
+    int code = 0;
+    if (strncmp(line, "HTTP/1.", 7) == 0 && strlen(line) >= 12)
+    {
+        code = atoi(line + 9);
+    }
+
+    if (code <= 0)
+    {
+        connection.countFailure();
+        return HTTPC_ERROR_NO_HTTP_SERVER;
+    }
+
+    // HTTP/1.1 connections stay open unless the server says otherwise
+    keepAlive = line[7] == '1';
+
+    while (true)
+    {
+        if (!readLine())
+        {
+            connection.countFailure();
+            return HTTPC_ERROR_READ_TIMEOUT;
+        }
+
+        if (line[0] == '\0')
+        {
+            break;
+        }
+
+        if (lineOverflow)
+        {
+            LOG_D("[HTTP] header line too long, skipped: %.32s...", line);
+            continue;
+        }
+
+        keepHeader(line);
+    }
+
+    if (code < 200 || code == HTTP_CODE_NO_CONTENT || code == HTTP_CODE_NOT_MODIFIED)
+    {
+        bodyDone = true;
+    }
+    else if (chunked)
+    {
+        bodyDone = false;
+    }
+    else if (bodyLength >= 0)
+    {
+        remaining = bodyLength;
+        bodyDone = bodyLength == 0;
+    }
+    else
+    {
+        // the body ends when the server closes the connection
+        keepAlive = false;
+        bodyDone = false;
+    }
+
+    return code;
+}
+
+void HttpRequest::keepHeader(char *header)
+{
+    const char *value;
+
+    if ((value = headerValue(header, "Content-Length")))
+    {
+        bodyLength = atoi(value);
+    }
+    else if ((value = headerValue(header, "Transfer-Encoding")))
+    {
+        chunked = strcasestr(value, "chunked") != nullptr;
+    }
+    else if ((value = headerValue(header, "Connection")))
+    {
+        keepAlive = strcasestr(value, "close") == nullptr;
+    }
+    else if ((value = headerValue(header, "Set-Cookie")))
+    {
+        if (cookies)
+        {
+            cookies->set(value, unixTime());
+        }
+    }
+    else if ((value = headerValue(header, "Date")))
+    {
+        keepValue(value, responseHeaders.date, sizeof(responseHeaders.date));
+    }
+    else if ((value = headerValue(header, "ETag")))
+    {
+        keepValue(value, responseHeaders.etag, sizeof(responseHeaders.etag));
+    }
+    else if ((value = headerValue(header, "Last-Modified")))
+    {
+        keepValue(value, responseHeaders.lastModified, sizeof(responseHeaders.lastModified));
+    }
+    else if ((value = headerValue(header, "Location")))
+    {
+        keepValue(value, responseHeaders.location, sizeof(responseHeaders.location));
+    }
+    else if ((value = headerValue(header, "Content-Encoding")))
+    {
+        responseHeaders.gzip = strcasecmp(value, "gzip") == 0;
+    }
+}
+
+int HttpRequest::read(uint8_t *buf, size_t len)
+{
+    if (chunked && remaining == 0 && !bodyDone && !nextChunk())
+    {
+        keepAlive = false;
+        return HTTPC_ERROR_READ_TIMEOUT;
+    }
+
+    if (bodyDone)
+    {
+        return 0;
+    }
+
+    const bool counted = chunked || bodyLength >= 0;
+    if (counted)
+    {
+        len = std::min<size_t>(len, remaining);
+    }
+
+    const int read_len = waitForData() ? client.read(buf, len) : 0;
+    if (read_len <= 0)
+    {
+        if (!counted && !client.connected())
+        {
+            bodyDone = true;
+            return 0;
+        }
+
+        keepAlive = false;
+        return HTTPC_ERROR_READ_TIMEOUT;
+    }
+
+    if (counted)
+    {
+        remaining -= read_len;
+        bodyDone = !chunked && remaining == 0;
+    }
+
+    return read_len;
+}
+
+int HttpRequest::writeTo(Stream *out)
+{
+    int total = 0;
+
+    while (true)
+    {
+        const int read_len = read(bodyBuffer, sizeof(bodyBuffer));
+        if (read_len <= 0)
+        {
+            return read_len < 0 ? read_len : total;
+        }
+
+        if (out->write(bodyBuffer, read_len) != static_cast<size_t>(read_len))
+        {
+            return HTTPC_ERROR_STREAM_WRITE;
+        }
+        total += read_len;
+    }
+}
+
+bool HttpRequest::discard()
+{
+    int read_len;
+    while ((read_len = read(bodyBuffer, sizeof(bodyBuffer))) > 0)
+    {
+    }
+
+    return read_len == 0;
+}
+
+void HttpRequest::end()
+{
+    if (!bodyDone || !keepAlive)
+    {
+        connection.drop();
+    }
+
+    // a body that was not read is gone with the connection
+    bodyDone = true;
+}
+
+bool HttpRequest::nextChunk()
+{
+    // the data of the last chunk ends with an empty line
+    if (afterChunk && (!readLine() || line[0] != '\0'))
+    {
+        return false;
+    }
+    afterChunk = false;
+
+    if (!readLine())
+    {
+        return false;
+    }
+
+    remaining = strtoul(line, nullptr, 16);
+    if (remaining > 0)
+    {
+        afterChunk = true;
+        return true;
+    }
+
+    // skip trailers up to the final empty line
+    do
+    {
+        if (!readLine())
+        {
+            return false;
+        }
+    } while (line[0] != '\0');
+
+    bodyDone = true;
+    return true;
+}
+
+bool HttpRequest::readLine()
+{
+    size_t pos = 0;
+    lineOverflow = false;
+
+    while (true)
+    {
+        if (!waitForData())
+        {
+            return false;
+        }
+
+        const int c = client.read();
+        if (c < 0)
+        {
+            return false;
+        }
+
+        if (c == '\n')
+        {
+            break;
+        }
+
+        if (c == '\r')
+        {
+            continue;
+        }
+
+        if (pos + 1 < sizeof(line))
+        {
+            line[pos++] = c;
+        }
+        else
+        {
+            lineOverflow = true;
+        }
+    }
+
+    line[pos] = '\0';
+    return true;
+}
+
+bool HttpRequest::waitForData()
+{
+    return client.waitForData(responseTimeoutMs);
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <array>
+
+#include <Arduino.h>
+
+#include "cookie_store.h"
+#include "host_connection.h"
+#include "upload_stream.h"
+
+// The response headers a HttpRequest keeps, values that do not fit are left empty
+struct ResponseHeaders
+{
+    char date[40]{};
+    char etag[96]{};
+    char lastModified[40]{};
+    char location[160]{};
+    bool gzip{false}; // Content-Encoding: gzip
+};
+
+// GET and POST requests on the kept-alive connection of a HostConnection. This replaces
+// HTTPClient, which allocates a String for the url, every header line it reads and every
+// header it keeps, and a buffer for every body it writes to a stream. The object lives as
+// long as the connection, all its buffers are members, and each request starts over on them,
+// so a request cycle leaves nothing on the heap:
+//
+// - the request header is formatted into one buffer, with the cookies of the CookieStore
+// - the response header is read line by line into one buffer, only ResponseHeaders are kept,
+//   Set-Cookie goes to the CookieStore
+// - the body is read through the request, Content-Length, chunked or until the server closes
+//
+// A kept-alive connection that the server closed while it was idle only shows when a request
+// gets no response on it, then the request is sent once more on a new connection.
+//
+// Redirects are only followed to the same host, as one client only ever talks to one host (see
+// TlsClient). 301, 307 and 308 are followed by GET only, 302 and 303 turn the request into a GET,
+// like HTTPC_STRICT_FOLLOW_REDIRECTS. Errors are reported with the HTTPC_ERROR_* codes.
+class HttpRequest
+{
+public:
+    static constexpr size_t MAX_HEADERS = 4;
+    static constexpr uint8_t MAX_REDIRECTS = 5;
+    static constexpr size_t REQUEST_HEADER_CAPACITY = 512 + CookieStore::MAX_COOKIES * StoredCookie::VALUE_CAPACITY;
+    static constexpr size_t LINE_CAPACITY = 640; // a Set-Cookie with a session
+    static constexpr size_t BODY_BUFFER_SIZE = 512;
+    static constexpr uint32_t DEFAULT_TIMEOUT_MS = 5000; // the TCP timeout of HTTPClient
+
+    // cookies may be nullptr
+    HttpRequest(HostConnection &connection, CookieStore *cookies);
+
+    // for the next request only, name and value have to stay valid until it was sent
+    void addHeader(const char *name, const char *value);
+    // how long the response may stall, for the header and every read of the body
+    void setTimeout(uint32_t timeoutMs) { responseTimeoutMs = timeoutMs; }
+
+    // send the request and read the response header, return the status code
+    int get(const char *url, bool followRedirects = false);
+    int post(const char *url, const char *contentType, const uint8_t *body, size_t len, bool followRedirects = false);
+
+    const ResponseHeaders &headers() const { return responseHeaders; }
+
+    // the Content-Length of the body, -1 if the server sent none
+    int size() const { return chunked ? -1 : bodyLength; }
+
+    // reads up to len bytes of the body, returns 0 at its end and HTTPC_ERROR_READ_TIMEOUT
+    // if it stalls for the timeout
+    int read(uint8_t *buf, size_t len);
+
+    // writes the whole body to out, returns its length, HTTPC_ERROR_STREAM_WRITE if out did not
+    // take all of it
+    int writeTo(Stream *out);
+
+    // reads the rest of the body, so the connection can be kept
+    bool discard();
+
+    // the connection stays open if the body was read to its end and the server allows it
+    void end();
+
+private:
+    int send(const char *method, const char *url, const char *contentType, const uint8_t *body, size_t len,
+             bool followRedirects);
+    int exchange(const char *method, const UrlParts &parts, const char *path, const char *contentType,
+                 const uint8_t *body, size_t len);
+    // sends the formatted request, stale tells a reused connection that failed before the
+    // first byte of the response
+    int transmit(const UrlParts &parts, size_t headerLen, const uint8_t *body, size_t len, bool &stale);
+    int readResponseHeader();
+    void keepHeader(char *line);
+    bool nextChunk();
+    bool readLine();
+    bool waitForData();
+
+    HostConnection &connection;
+    TlsClient &client;
+    CookieStore *cookies;
+
+    struct Header
+    {
+        const char *name;
+        const char *value;
+    };
+    std::array<Header, MAX_HEADERS> requestHeaders{};
+    uint8_t headerCount{0};
+
+    uint32_t responseTimeoutMs{DEFAULT_TIMEOUT_MS};
+
+    // of the current response
+    ResponseHeaders responseHeaders;
+    bool keepAlive{false};
+    bool chunked{false};
+    int bodyLength{-1};  // -1 until the server closes the connection
+    uint32_t remaining{0}; // of the body or the current chunk
+    bool bodyDone{true};
+    bool afterChunk{false}; // the empty line behind the data of a chunk is still to come
+    bool lineOverflow{false};
+
+    char requestHeader[REQUEST_HEADER_CAPACITY];
+    char line[LINE_CAPACITY];
+    uint8_t bodyBuffer[BODY_BUFFER_SIZE];
+};
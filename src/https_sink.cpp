@@ -0,0 +1,62 @@
+#include "https_sink.h"
+
+#include <HTTPClient.h>
+
+#include "delta_encoder.h"
+#include "logger.h"
+#include "upload_stream.h"
+
+HttpsSink::HttpsSink(const char *url, const char *apiKey, bool verify)
+    : Sink{url, BATCH_MAX_SAMPLES, BATCH_MAX_AGE_MS, STACK_SIZE}, url{url}, apiKey{apiKey}, connection{url}
+{
+    connection.setup(verify, "");
+}
+
+bool HttpsSink::send(const FisSample *const *samples, size_t &count, FailureClass &failure)
+{
+    const size_t batch_count = count;
+    count = 0;
+
+    UploadStream upload(connection);
+    upload.addHeader("X-Api-Key", apiKey);
+    upload.addHeader("Content-Type", "application/json");
+
+    if (!upload.begin(url))
+    {
+        failure = classifyFailure(HTTPC_ERROR_CONNECTION_REFUSED, connection.client());
+        return false;
+    }
+
+    char record[DeltaEncoder::MAX_MESSAGE_LEN];
+    size_t written = 0;
+
+    upload.write('[');
+    for (size_t idx = 0; idx < batch_count; ++idx)
+    {
+        const size_t len = formatSample(*samples[idx], record, sizeof(record));
+        if (len == 0)
+        {
+            continue;
+        }
+
+        if (written > 0)
+        {
+            upload.write(',');
+        }
+        upload.write(reinterpret_cast<const uint8_t *>(record), len);
+        ++written;
+    }
+    upload.write(']');
+
+    const int postCode = upload.finish();
+    if (postCode != HTTP_CODE_OK)
+    {
+        LOG_W("[SINK] %s: POST of %u samples... failed: %d", url, static_cast<unsigned>(written), postCode);
+        failure = classifyFailure(postCode, connection.client());
+        return false;
+    }
+
+    LOG_D("[SINK] %s: POST of %u samples... code: %d", url, static_cast<unsigned>(written), postCode);
+    count = batch_count;
+    return true;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "host_connection.h"
+#include "sink.h"
+
+// POSTs the samples as a JSON array of {"ts":...,"fields":{...}} records to a URL of its own,
+// over a kept-alive connection of its own, e.g. the endpoint of a backup region. Every sink
+// is another TLS session, see TLS_ARENA_SESSIONS.
+class HttpsSink : public Sink
+{
+public:
+    static constexpr size_t BATCH_MAX_SAMPLES = 6;
+    static constexpr uint32_t BATCH_MAX_AGE_MS = 60000;
+    static constexpr uint32_t STACK_SIZE = 8192; // a TLS handshake
+
+    // url and apiKey have to stay valid
+    HttpsSink(const char *url, const char *apiKey, bool verify);
+
+protected:
+    bool send(const FisSample *const *samples, size_t &count, FailureClass &failure) override;
+
+private:
+    const char *url;
+    const char *apiKey;
+    HostConnection connection;
+};
@@ -0,0 +1,224 @@
+#include "logger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+
+#include <esp_log.h>
+
+// can be set from build_flags, e.g. -DLOG_SLOTS=64 (a power of two)
+#ifndef LOG_SLOTS
+#define LOG_SLOTS 32
+#endif
+#ifndef LOG_RATE_PER_S
+#define LOG_RATE_PER_S 50
+#endif
+#ifndef LOG_PAYLOAD_MAX
+#define LOG_PAYLOAD_MAX 64
+#endif
+#ifndef LOG_PAYLOAD_EVERY
+#define LOG_PAYLOAD_EVERY 10
+#endif
+
+namespace
+{
+static_assert((LOG_SLOTS & (LOG_SLOTS - 1)) == 0, "LOG_SLOTS has to be a power of two");
+
+constexpr size_t SLOT_TEXT = 160; // longer messages are cut
+constexpr uint32_t DRAIN_STACK_SIZE = 3072;
+
+// A bounded multi producer queue (Vyukov). A slot belongs to the producer that moved
+// enqueuePos past it, sequence tells the consumer when it is written and the producers
+// when it is free again.
+struct Slot
+{
+    std::atomic<uint32_t> sequence;
+    uint8_t len;
+    char text[SLOT_TEXT];
+};
+
+Slot slots[LOG_SLOTS];
+std::atomic<uint32_t> enqueuePos{0};
+uint32_t dequeuePos = 0; // only the drain task
+
+TaskHandle_t drainTaskHandle = nullptr;
+
+std::atomic<uint32_t> rateSecond{0};
+std::atomic<uint32_t> rateCount{0};
+std::atomic<uint32_t> droppedFull{0};
+std::atomic<uint32_t> droppedRate{0};
+std::atomic<uint32_t> payloadCount{0};
+uint32_t loggedCount = 0; // only the drain task
+
+// at static initialization, messages logged before logBegin() wait in the ring
+struct SlotInit
+{
+    SlotInit()
+    {
+        for (uint32_t idx = 0; idx < LOG_SLOTS; ++idx)
+        {
+            slots[idx].sequence.store(idx, std::memory_order_relaxed);
+        }
+    }
+} slotInit;
+
+// a free slot to write into, nullptr if the ring is full
+Slot *claim(uint32_t &pos)
+{
+    pos = enqueuePos.load(std::memory_order_relaxed);
+
+    for (;;)
+    {
+        Slot &slot = slots[pos & (LOG_SLOTS - 1)];
+        const int32_t diff = static_cast<int32_t>(slot.sequence.load(std::memory_order_acquire) - pos);
+
+        if (diff == 0)
+        {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                return &slot;
+            }
+        }
+        else if (diff < 0)
+        {
+            return nullptr;
+        }
+        else
+        {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void publish(Slot &slot, uint32_t pos)
+{
+    slot.sequence.store(pos + 1, std::memory_order_release);
+
+    if (drainTaskHandle)
+    {
+        xTaskNotifyGive(drainTaskHandle);
+    }
+}
+
+// false once more than LOG_RATE_PER_S messages came this second
+bool withinRate()
+{
+    const uint32_t second = millis() / 1000;
+
+    // a race between two producers only miscounts a message or two
+    if (rateSecond.load(std::memory_order_relaxed) != second)
+    {
+        rateSecond.store(second, std::memory_order_relaxed);
+        rateCount.store(0, std::memory_order_relaxed);
+    }
+    return rateCount.fetch_add(1, std::memory_order_relaxed) < LOG_RATE_PER_S;
+}
+
+void enqueue(bool newline, const char *format, va_list args)
+{
+    uint32_t pos;
+    Slot *slot = claim(pos);
+    if (!slot)
+    {
+        droppedFull.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    const size_t room = sizeof(slot->text) - (newline ? 1 : 0);
+    const int written = vsnprintf(slot->text, room, format, args);
+    size_t len = written < 0 ? 0 : std::min(static_cast<size_t>(written), room - 1);
+
+    if (newline)
+    {
+        slot->text[len++] = '\n';
+    }
+    slot->len = static_cast<uint8_t>(len);
+
+    publish(*slot, pos);
+}
+
+// the esp-idf log lines end in a newline already
+int idfLogVprintf(const char *format, va_list args)
+{
+    enqueue(false, format, args);
+    return 0;
+}
+
+void printDropped()
+{
+    const uint32_t full = droppedFull.exchange(0, std::memory_order_relaxed);
+    const uint32_t rate = droppedRate.exchange(0, std::memory_order_relaxed);
+
+    if (full || rate)
+    {
+        Serial.printf("[LOG] dropped %u messages, %u for the rate limit\n", full + rate, rate);
+    }
+}
+
+void drainTask(void *)
+{
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        for (;;)
+        {
+            Slot &slot = slots[dequeuePos & (LOG_SLOTS - 1)];
+            if (slot.sequence.load(std::memory_order_acquire) != dequeuePos + 1)
+            {
+                break;
+            }
+
+            // only this task blocks on the UART
+            Serial.write(reinterpret_cast<const uint8_t *>(slot.text), slot.len);
+            slot.sequence.store(dequeuePos + LOG_SLOTS, std::memory_order_release);
+            ++dequeuePos;
+            ++loggedCount;
+        }
+
+        printDropped();
+    }
+}
+} // namespace
+
+void logBegin()
+{
+    xTaskCreate(drainTask, "log", DRAIN_STACK_SIZE, nullptr, tskIDLE_PRIORITY, &drainTaskHandle);
+    esp_log_set_vprintf(idfLogVprintf);
+}
+
+void logWrite(uint8_t level, const char *format, ...)
+{
+    if (level > LOG_LEVEL_WARN && !withinRate())
+    {
+        droppedRate.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    enqueue(true, format, args);
+    va_end(args);
+}
+
+void logPayload(const char *label, const char *data, size_t len)
+{
+    if (payloadCount.fetch_add(1, std::memory_order_relaxed) % LOG_PAYLOAD_EVERY != 0)
+    {
+        return;
+    }
+
+    if (len > LOG_PAYLOAD_MAX)
+    {
+        logWrite(LOG_LEVEL_DEBUG, "%s: %.*s... (%u bytes)", label, LOG_PAYLOAD_MAX, data, static_cast<unsigned>(len));
+    }
+    else
+    {
+        logWrite(LOG_LEVEL_DEBUG, "%s: %.*s", label, static_cast<int>(len), data);
+    }
+}
+
+void logPrintStats()
+{
+    LOG_I("[LOG] %u messages written", loggedCount);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Logging that never blocks the caller on the UART. Messages are formatted into a slot of a
+// lock-free ring, a low priority task writes them to Serial. If the ring is full, or more than
+// LOG_RATE_PER_S messages below WARN come in one second, the message is dropped and counted.
+//
+// LOG_LEVEL is fixed at compile time, the macros of the levels above it compile to nothing,
+// their arguments are not even evaluated. A production build would use -DLOG_LEVEL=LOG_LEVEL_WARN.
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+// can be set from build_flags, e.g. -DLOG_LEVEL=LOG_LEVEL_WARN
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// still type checked when disabled, the compiler throws it away
+#define LOG_AT(level, ...)                      \
+    do                                          \
+    {                                           \
+        if (LOG_LEVEL >= (level))               \
+        {                                       \
+            logWrite((level), __VA_ARGS__);     \
+        }                                       \
+    } while (0)
+
+// printf style, the newline is added
+#define LOG_E(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_W(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_I(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_D(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// a body or message, see logPayload()
+#define LOG_PAYLOAD(label, data, len)                   \
+    do                                                  \
+    {                                                   \
+        if (LOG_LEVEL >= LOG_LEVEL_DEBUG)               \
+        {                                               \
+            logPayload((label), (data), (len));         \
+        }                                               \
+    } while (0)
+
+// starts the task that writes the ring to Serial, Serial has to be set up, also takes over the
+// output of the esp-idf log
+void logBegin();
+
+void logWrite(uint8_t level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// only every LOG_PAYLOAD_EVERY th payload is logged, and at most LOG_PAYLOAD_MAX bytes of it
+void logPayload(const char *label, const char *data, size_t len);
+
+void logPrintStats();
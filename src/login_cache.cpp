@@ -0,0 +1,171 @@
+#include "login_cache.h"
+
+#include <Preferences.h>
+
+#include "logger.h"
+#include "wall_clock.h"
+
+namespace
+{
+constexpr const char *const NAMESPACE = "login";
+constexpr uint8_t FORMAT_VERSION = 2; // 1 had the cookies of HTTPClient
+
+constexpr size_t COOKIE_FIELDS = 5;
+} // namespace
+
+bool LoginCache::load(const uint8_t *bssid, CookieStore &cookies, FormInformation &form)
+{
+    Preferences preferences;
+    if (!preferences.begin(NAMESPACE, true))
+    {
+        return false;
+    }
+
+    uint8_t saved_bssid[6]{};
+    const bool valid = preferences.getUChar("version", 0) == FORMAT_VERSION &&
+                       preferences.getBytes("bssid", saved_bssid, sizeof(saved_bssid)) == sizeof(saved_bssid) &&
+                       preferences.getBytesLength("form") == sizeof(FormInformation);
+
+    if (!valid || memcmp(saved_bssid, bssid, sizeof(saved_bssid)) != 0)
+    {
+        LOG_I("[LOGIN] no cached login for this access point");
+        preferences.end();
+        return false;
+    }
+
+    const time_t saved_at = preferences.getUInt("saved_at", 0);
+    const time_t now = time(nullptr);
+
+    if (saved_at != 0 && clockValid() && now - saved_at > static_cast<time_t>(TTL_S))
+    {
+        LOG_W("[LOGIN] cached login expired %ld s ago", static_cast<long>(now - saved_at - TTL_S));
+        preferences.end();
+        clear();
+        return false;
+    }
+
+    char cookie_data[MAX_COOKIE_DATA];
+    const size_t cookie_len = preferences.getBytes("cookies", cookie_data, sizeof(cookie_data) - 1);
+    cookie_data[cookie_len] = '\0';
+
+    FormInformation cached_form;
+    preferences.getBytes("form", &cached_form, sizeof(cached_form));
+    preferences.end();
+
+    if (!cached_form.complete())
+    {
+        return false;
+    }
+
+    form = cached_form;
+    deserializeCookies(cookie_data, cookies);
+
+    LOG_I("[LOGIN] restored cached login with %u cookies", static_cast<unsigned>(cookies.size()));
+    return true;
+}
+
+void LoginCache::save(const uint8_t *bssid, const CookieStore &cookies, const FormInformation &form, time_t savedAt)
+{
+    char cookie_data[MAX_COOKIE_DATA];
+    const size_t cookie_len = serializeCookies(cookies, cookie_data, sizeof(cookie_data));
+
+    Preferences preferences;
+    if (!preferences.begin(NAMESPACE, false))
+    {
+        LOG_W("[LOGIN] opening NVS failed");
+        return;
+    }
+
+    // the version goes last, an interrupted save leaves an entry that is not used
+    preferences.remove("version");
+    preferences.putBytes("bssid", bssid, 6);
+    preferences.putUInt("saved_at", static_cast<uint32_t>(savedAt));
+    preferences.putBytes("cookies", cookie_data, cookie_len);
+    preferences.putBytes("form", &form, sizeof(form));
+    preferences.putUChar("version", FORMAT_VERSION);
+    preferences.end();
+
+    LOG_I("[LOGIN] cached login with %u cookies", static_cast<unsigned>(cookies.size()));
+}
+
+void LoginCache::clear()
+{
+    Preferences preferences;
+    if (preferences.begin(NAMESPACE, false))
+    {
+        preferences.clear();
+        preferences.end();
+    }
+}
+
+// one cookie per line, the fields separated by tabs, neither can appear in a cookie
+size_t LoginCache::serializeCookies(const CookieStore &cookies, char *buf, size_t len)
+{
+    size_t pos = 0;
+
+    for (size_t idx = 0; idx < cookies.size(); ++idx)
+    {
+        const StoredCookie &cookie = cookies[idx];
+        const int written = snprintf(buf + pos, len - pos, "%s\t%s\t%s\t%lld\t%d\n",
+                                     cookie.name,
+                                     cookie.value,
+                                     cookie.path,
+                                     static_cast<long long>(cookie.expires),
+                                     cookie.secure);
+
+        if (written < 0 || pos + written >= len)
+        {
+            LOG_W("[LOGIN] cookies do not fit, caching only some of them");
+            break;
+        }
+
+        pos += written;
+    }
+
+    return pos;
+}
+
+void LoginCache::deserializeCookies(char *buf, CookieStore &cookies)
+{
+    cookies.clear();
+
+    char *line = buf;
+    while (*line != '\0')
+    {
+        char *line_end = strchr(line, '\n');
+        if (!line_end)
+        {
+            break;
+        }
+        *line_end = '\0';
+
+        const char *fields[COOKIE_FIELDS]{};
+        size_t field_count = 0;
+        for (char *field = line; field_count < COOKIE_FIELDS; ++field_count)
+        {
+            fields[field_count] = field;
+            char *tab = strchr(field, '\t');
+            if (!tab)
+            {
+                ++field_count;
+                break;
+            }
+            *tab = '\0';
+            field = tab + 1;
+        }
+
+        StoredCookie cookie;
+        if (field_count == COOKIE_FIELDS && strlen(fields[0]) < sizeof(cookie.name) &&
+            strlen(fields[1]) < sizeof(cookie.value) && strlen(fields[2]) < sizeof(cookie.path))
+        {
+            strcpy(cookie.name, fields[0]);
+            strcpy(cookie.value, fields[1]);
+            strcpy(cookie.path, fields[2]);
+            cookie.expires = atoll(fields[3]);
+            cookie.secure = atoi(fields[4]) != 0;
+            cookies.add(cookie);
+        }
+
+        line = line_end + 1;
+    }
+}
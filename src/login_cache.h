@@ -0,0 +1,30 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "cookie_store.h"
+#include "portal_parser.h"
+
+// Keeps the portal session (the cookies Railnet set and the login form that was posted) in NVS,
+// so after a reboot on the same access point the firmware can go straight to combined.json.
+// Whether the session is still valid is only known after the first request, the TTL just stops
+// us from trying a session that is certainly gone.
+class LoginCache
+{
+public:
+    static constexpr uint32_t TTL_S = 6 * 3600; // a long train ride
+    static constexpr size_t MAX_COOKIE_DATA = 1024;
+
+    // restores the cookies and form of the last login on this BSSID, false if there is none
+    // or it expired. If the clock is not set we can't tell and the entry is used.
+    bool load(const uint8_t *bssid, CookieStore &cookies, FormInformation &form);
+
+    // savedAt is the time of the login, 0 if unknown
+    void save(const uint8_t *bssid, const CookieStore &cookies, const FormInformation &form, time_t savedAt);
+
+    void clear();
+
+private:
+    static size_t serializeCookies(const CookieStore &cookies, char *buf, size_t len);
+    static void deserializeCookies(char *buf, CookieStore &cookies);
+};
@@ -1,5 +1,6 @@
-#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
 #include <esp_log.h>
+#include <algorithm>
+#include <atomic>
 #include <vector>
 #include <string>
 #include <string_view>
@@ -13,259 +14,886 @@
 
 #include <HTTPClient.h>
 
+#include <freertos/queue.h>
+
+#include "cbor_writer.h"
+#include "change_detector.h"
+#include "coap_sink.h"
+#include "deadline.h"
+#include "delta_encoder.h"
+#include "dns_cache.h"
+#include "fis_extractor.h"
+#include "gzip_stream.h"
+#include "heap_watch.h"
+#include "host_connection.h"
+#include "http_request.h"
+#include "https_sink.h"
+#include "logger.h"
+#include "login_cache.h"
+#include "metrics.h"
+#include "mqtt_sink.h"
+#include "poll_scheduler.h"
+#include "portal_parser.h"
+#include "power_save.h"
+#include "retry_policy.h"
+#include "roamer.h"
+#include "sample_store.h"
+#include "sink.h"
+#include "upload_stream.h"
+#include "wall_clock.h"
+#include "wifi_link.h"
+
 enum State : uint8_t
 {
     INIT,            // 0
     WIFI_CONNECTED,  // 1
     REQUEST_MADE,    // 2
     REQUEST_PARSED,  // 3
-    POST_SUCCEEDED,  // 4
-    ENDPOINT_REACHED // 5
+    POST_SUCCEEDED,      // 4
+    ENDPOINT_REACHED,    // 5
+    PROBING_CACHED_LOGIN // 6
 };
 
-State stateMachine = State::INIT;
+// the uploader task moves it from POST_SUCCEEDED to ENDPOINT_REACHED
+std::atomic<State> stateMachine{State::INIT};
 
-// Hack to access the auto-generated CA bundle from esp-idf
-extern const uint8_t x509_crt_imported_bundle_bin_start[] asm("_binary_x509_crt_bundle_start");
+constexpr const char *const WIFI_SSID = "OEBB";
 
-constexpr const char *const RAILNET_PORTAL_URL = "https://railnet.oebb.at/en/connecttoweb";
+// the state machine only runs while the link is up
+WifiLink wifiLink{WIFI_SSID};
+Roamer roamer{wifiLink, WIFI_SSID};
 
-constexpr const char *const SEARCH_STRING = "action=\"https://railnet.oebb.at/";
-constexpr const char *const TOKEN_FIELD_ID = "name=\"_token\"";
-constexpr const char *const CEID_FIELD_ID = "name=\"_ceid\"";
-constexpr const char *const CHECKIT_FIELD_ID = "name=\"checkit\"";
-constexpr const char *const FORMTYPE_FIELD_ID = "name=\"form_type\"";
+constexpr const char *const RAILNET_PORTAL_URL = "https://railnet.oebb.at/en/connecttoweb";
+constexpr const char *const FIS_URL = "https://railnet.oebb.at/assets/media/fis/combined.json";
+
+PortalFormParser portalParser;
+
+// can be set from build_flags, e.g. -DPORTAL_READ_BUFFER_SIZE=2048
+#ifndef PORTAL_READ_BUFFER_SIZE
+#define PORTAL_READ_BUFFER_SIZE 1024
+#endif
+char portalReadBuffer[PORTAL_READ_BUFFER_SIZE];
+constexpr uint32_t PORTAL_READ_TIMEOUT_MS = 10000;
+
+// check the certificates of both hosts, e.g. -DTLS_VERIFY=1, against the CA bundle and the
+// pin-sha256 of their keys, e.g. -DRAILNET_SPKI_PINS='"base64,base64"', see TlsClient
+#ifndef TLS_VERIFY
+#define TLS_VERIFY 0
+#endif
+#ifndef RAILNET_SPKI_PINS
+#define RAILNET_SPKI_PINS ""
+#endif
+#ifndef ENDPOINT_SPKI_PINS
+#define ENDPOINT_SPKI_PINS ""
+#endif
+
+// one kept-alive connection per host, the relay keeps both open at the same time
+HostConnection railnetConnection{"railnet"};
+HostConnection endpointConnection{"endpoint"};
+
+// the portal session, and the one request to Railnet the loop task has going at a time
+CookieStore railnetCookies;
+HttpRequest railnetRequest{railnetConnection, &railnetCookies};
+
+// combined.json is fetched between every POLL_MIN_MS and POLL_MAX_MS depending on how much it
+// changes, POLL_BUDGET_PER_HOUR requests on average at most, e.g. -DPOLL_MIN_MS=1000
+#ifndef POLL_MIN_MS
+#define POLL_MIN_MS 2000
+#endif
+#ifndef POLL_MAX_MS
+#define POLL_MAX_MS 60000
+#endif
+#ifndef POLL_BUDGET_PER_HOUR
+#define POLL_BUDGET_PER_HOUR 1200
+#endif
+constexpr uint32_t FIS_FETCH_INTERVAL_MS = 10000; // where the adaptation starts
+PollScheduler fisPollScheduler{POLL_MIN_MS, POLL_MAX_MS, FIS_FETCH_INTERVAL_MS, POLL_BUDGET_PER_HOUR};
+
+enum class UploadMode : uint8_t
+{
+    RELAY, // combined.json is passed on as it is
+    DELTA, // only the FIS_FIELDS that changed are sent, see DeltaEncoder
+    BATCH  // the samples are collected and sent as BATCH_MAX_SAMPLES at a time
+};
 
-constexpr const char *const VALUE_FIELD_BEGINNING = "value=\"";
-constexpr const size_t VALUE_FIELD_BEGINNING_LEN = 7;
+// can be set from build_flags, e.g. -DUPLOAD_MODE=DELTA
+#ifndef UPLOAD_MODE
+#define UPLOAD_MODE RELAY
+#endif
+constexpr UploadMode uploadMode = UploadMode::UPLOAD_MODE;
 
-std::array<std::string, 10> lineBuffer;
-std::string currentLine{};
-uint8_t bufferIndex{0};
-std::optional<uint8_t> form_start_line_idx;
+enum class BatchFormat : uint8_t
+{
+    JSON_ARRAY, // [{"ts":...,"fields":{...}},...]
+    NDJSON      // one {"ts":...,"fields":{...}} per line
+};
 
-struct FormInformation
+// how stored samples are sent, in BATCH mode and for the backlog of the other modes,
+// can be set from build_flags, e.g. -DBATCH_FORMAT=NDJSON
+#ifndef BATCH_FORMAT
+#define BATCH_FORMAT JSON_ARRAY
+#endif
+constexpr BatchFormat batchFormat = BatchFormat::BATCH_FORMAT;
+
+// BATCH mode sends once this many samples were collected or the oldest one is this old,
+// whichever comes first, e.g. -DBATCH_MAX_SAMPLES=30 -DBATCH_MAX_AGE_S=300
+#ifndef BATCH_MAX_SAMPLES
+#define BATCH_MAX_SAMPLES 12
+#endif
+#ifndef BATCH_MAX_AGE_S
+#define BATCH_MAX_AGE_S 120
+#endif
+constexpr uint32_t BATCH_MAX_AGE_MS = BATCH_MAX_AGE_S * 1000;
+
+// gzip the upload bodies, e.g. -DUPLOAD_GZIP=1, the endpoint has to understand Content-Encoding
+#ifndef UPLOAD_GZIP
+#define UPLOAD_GZIP 0
+#endif
+constexpr bool compressUploads = UPLOAD_GZIP;
+
+// ask Railnet for a gzipped combined.json, e.g. -DRAILNET_GZIP=1, costs about 43 KB of heap
+#ifndef RAILNET_GZIP
+#define RAILNET_GZIP 0
+#endif
+
+// while Railnet sends no validators the relay holds the upload body back until its hash is known,
+// larger bodies go out as they come and are aborted if they did not change, e.g. -DFIS_HOLD_SIZE=16384
+#ifndef FIS_HOLD_SIZE
+#define FIS_HOLD_SIZE 8192
+#endif
+uint8_t fisHoldBuffer[FIS_HOLD_SIZE];
+
+enum class UploadFormat : uint8_t
 {
-    std::optional<std::string> _token = std::nullopt;
-    std::optional<std::string> _ceid = std::nullopt;
-    std::optional<std::string> checkit = std::nullopt;
-    std::optional<std::string> form_type = std::nullopt;
+    JSON,
+    CBOR,
+    NEGOTIATE // JSON until the endpoint lists application/cbor in an Accept-Post response header
 };
 
-FormInformation formInformation;
+// how samples and delta messages are encoded, RELAY passes combined.json on as it is,
+// can be set from build_flags, e.g. -DUPLOAD_FORMAT=NEGOTIATE
+#ifndef UPLOAD_FORMAT
+#define UPLOAD_FORMAT JSON
+#endif
+constexpr UploadFormat uploadFormat = UploadFormat::UPLOAD_FORMAT;
+
+// belongs to whichever task does the uploads
+WireFormat wireFormat = uploadFormat == UploadFormat::CBOR ? WireFormat::CBOR : WireFormat::JSON;
+
+// only one upload runs at a time, they all go through endpointConnection
+GzipStream uploadCompressor;
+GunzipStream fisInflater;
+
+// both hosts back off on their own, the portal login and combined.json share railnetRetry
+RetryPolicy railnetRetry{"railnet"};
+RetryPolicy endpointRetry{"endpoint"};
+// running while the login waits for railnetRetry, the portal page is fetched again after it
+Deadline portalRetryDeadline;
+
+LoginCache loginCache;
+// the form being posted is the cached one, if it is rejected we go through the portal page
+bool postingCachedForm = false;
+
+ChangeDetector fisChangeDetector;
+// how long the last combined.json GET took until the response headers
+uint32_t fisLatencyMs = 0;
+
+// DELTA and BATCH mode: the loop task fetches snapshots into fisQueue, the uploader task on the
+// other core sends them. Everything below fisQueue belongs to the uploader task.
+// Samples that could not be uploaded (in BATCH mode all samples until they are sent), in PSRAM
+// if the board has it, in the samples partition otherwise. Owned by the uploader task in DELTA
+// and BATCH mode and by the loop task in RELAY mode.
+constexpr size_t PSRAM_SAMPLE_STORE_SIZE = 1024 * 1024;
+constexpr const char *const SAMPLE_PARTITION = "samples";
+constexpr size_t BACKLOG_BATCH_SIZE = 20;
+SampleStore sampleStore;
+
+// more destinations for the samples next to POST_ENDPOINT_URL, each with its own queue, batch
+// and back-off, e.g. -DSINK_URLS='"https://backup.example.com/fis,mqtts://example.com/fis"',
+// and how many samples each of them queues, see Sink
+#ifndef SINK_URLS
+#define SINK_URLS ""
+#endif
+#ifndef SINK_QUEUE_LENGTH
+#define SINK_QUEUE_LENGTH 8
+#endif
+// SINK_URLS split at the commas, the sinks point into it
+char sinkUrls[] = SINK_URLS;
+SinkFanOut sinkFanOut;
+
+constexpr UBaseType_t FIS_QUEUE_LENGTH = 4;
+constexpr uint32_t UPLOADER_STACK_SIZE = 8192; // a TLS handshake needs about as much as the loop task
+
+FisSnapshot fisSnapshot;
+QueueHandle_t fisQueue = nullptr;
+uint32_t droppedSnapshots = 0;
+
+FisSample uploadSample;
+DeltaEncoder deltaEncoder;
+char deltaMessage[DeltaEncoder::MAX_MESSAGE_LEN];
+
+constexpr uint32_t DEBUG_PRINT_INTERVAL_MS = 3000;
+Deadline debugPrintDeadline;
+
+// can be set from build_flags, e.g. -DMETRICS_INTERVAL_S=300, 0 turns the metrics uploads off
+#ifndef METRICS_INTERVAL_S
+#define METRICS_INTERVAL_S 60
+#endif
+constexpr uint32_t METRICS_INTERVAL_MS = METRICS_INTERVAL_S * 1000;
+// belongs to the task that uploads, like endpointConnection
+Deadline metricsDeadline;
+// how long the loop may sleep while the link is down, the link comes back through events
+constexpr uint32_t LINK_DOWN_IDLE_MS = 100;
+// the state the loop saw last, for counting the transitions
+State observedState = State::INIT;
+
+// keeps the sample for later if it could not be uploaded
+void storeSample(const FisSnapshot &snapshot)
+{
+    FisSample sample;
+    sample.time = unixTime();
+    sample.snapshot = snapshot;
+    sampleStore.push(sample);
+    LOG_I("Stored the sample for later, %u pending", sampleStore.pending());
+}
 
-void clearFormInformation()
+// switches to CBOR once the endpoint says it takes it, and back if it turns it down after all
+void negotiateWireFormat(const UploadStream &upload, int postCode)
 {
-    formInformation._token.reset();
-    formInformation._ceid.reset();
-    formInformation.checkit.reset();
-    formInformation.form_type.reset();
+    if (uploadFormat != UploadFormat::NEGOTIATE)
+    {
+        return;
+    }
+
+    if (wireFormat == WireFormat::CBOR && postCode == HTTP_CODE_UNSUPPORTED_MEDIA_TYPE)
+    {
+        LOG_I("[UPLOAD] endpoint refused CBOR, back to JSON");
+        wireFormat = WireFormat::JSON;
+    }
+    else if (wireFormat == WireFormat::JSON && postCode == HTTP_CODE_OK &&
+             strstr(upload.acceptPost(), "application/cbor") != nullptr)
+    {
+        LOG_I("[UPLOAD] endpoint takes CBOR, switching");
+        wireFormat = WireFormat::CBOR;
+    }
 }
 
-enum ParserState : uint8_t
-{
-    PARSER_INIT,          // 0
-    SEARCH_STRING_FOUND,  // 1
-    TOKEN_FIELD_FOUND,    // 2
-    TOKEN_VALUE_FOUND,    // 3
-    CEID_FIELD_FOUND,     // 4
-    CEID_VALUE_FOUND,     // 5
-    CHECKIT_FIELD_FOUND,  // 6
-    CHECKIT_VALUE_FOUND,  // 7
-    FORMTYPE_FIELD_FOUND, // 8
-    FORMTYPE_VALUE_FOUND, // 9
-    DONE                  // 10
-};
-ParserState parserState = ParserState::PARSER_INIT;
+const char *batchContentType()
+{
+    if (wireFormat == WireFormat::CBOR)
+    {
+        return batchFormat == BatchFormat::NDJSON ? "application/cbor-seq" : "application/cbor";
+    }
 
-WiFiClientSecure client;
+    return batchFormat == BatchFormat::NDJSON ? "application/x-ndjson" : "application/json";
+}
 
-uint32_t lastFisFetchMillis = 0;
-constexpr uint32_t FIS_FETCH_INTERVAL_MS = 10000; // 10 seconds
+void addUploadHeaders(UploadStream &upload, const char *contentType)
+{
+    upload.addHeader("X-Api-Key", SECRET);
+    upload.addHeader("Content-Type", contentType);
+    if (compressUploads)
+    {
+        upload.addHeader("Content-Encoding", "gzip");
+    }
+}
 
-std::optional<uint32_t> retryTimeout = std::nullopt;
+// the stream the body of upload is written to, the compressor with UPLOAD_GZIP
+Stream &uploadBody(UploadStream &upload)
+{
+    if (!compressUploads)
+    {
+        return upload;
+    }
 
-CookieJar cookieJar;
+    uploadCompressor.begin(&upload);
+    return uploadCompressor;
+}
 
-uint32_t lastDebugPrintMillis = 0;
+// tells endpointRetry how an upload went
+void recordUpload(int postCode)
+{
+    if (postCode == HTTP_CODE_OK)
+    {
+        endpointRetry.succeeded();
+    }
+    else
+    {
+        endpointRetry.failed(classifyFailure(postCode, endpointConnection.client()));
+    }
+}
 
-void checkLineBuffer()
+// sends the rest of the body written to uploadBody() and returns the HTTP code of the response
+int finishBody(UploadStream &upload)
 {
-    const std::string &current_line_in_buffer = lineBuffer[bufferIndex];
+    if (compressUploads)
+    {
+        uploadCompressor.finish();
+        LOG_I("[GZIP] compressed %u bytes to %u", uploadCompressor.bytesIn(), uploadCompressor.bytesOut());
+    }
 
-    ParserState previousParserState = parserState;
+    const int postCode = upload.finish();
+    observeLatency(Stage::POST, upload.elapsedMs());
+    return postCode;
+}
 
-    char c;
+// finishBody() for samples and delta messages, the response tells how to go on
+int finishUpload(UploadStream &upload)
+{
+    const int postCode = finishBody(upload);
+    negotiateWireFormat(upload, postCode);
+    recordUpload(postCode);
+    return postCode;
+}
 
-    const auto findValueField = [&](std::optional<std::string> &value_ref, ParserState newParserState) -> void
+// POSTs the metrics in the Prometheus text format every METRICS_INTERVAL_MS, from the task
+// that uploads. The answer does not go into endpointRetry, an endpoint that does not take
+// metrics must not hold back the samples.
+void uploadMetricsIfDue()
+{
+    if (!metricsDeadline.expired())
     {
-        const auto value_pos = current_line_in_buffer.find(VALUE_FIELD_BEGINNING);
-        if (value_pos != std::string::npos)
-        {
-            // now we need to parse until we get a '"'
-            size_t current_position = value_pos + VALUE_FIELD_BEGINNING_LEN;
-            std::string value{};
+        return;
+    }
+    metricsDeadline.advance(METRICS_INTERVAL_MS);
 
-            for (size_t idx = current_position; idx < current_line_in_buffer.size(); ++idx)
-            {
-                c = current_line_in_buffer[idx];
-                if (c == '"')
-                {
-                    break;
-                }
-                else
-                {
-                    value += c;
-                }
-            }
+    // while the endpoint is backed off this round is skipped
+    if (!endpointRetry.ready())
+    {
+        return;
+    }
 
-            Serial.printf("Found value: %s\n", value.c_str());
-            value_ref = value;
+    UploadStream upload(endpointConnection);
+    addUploadHeaders(upload, "text/plain; version=0.0.4");
 
-            parserState = newParserState;
+    if (!upload.begin(POST_ENDPOINT_URL))
+    {
+        return;
+    }
+
+    renderMetrics(uploadBody(upload));
+    const int postCode = finishBody(upload);
+
+    if (postCode == HTTP_CODE_OK)
+    {
+        LOG_I("[METRICS] uploaded");
+    }
+    else
+    {
+        LOG_W("[METRICS] upload failed: %d", postCode);
+    }
+}
+
+void acceptGzip(HttpRequest &request)
+{
+    if (fisInflater.allocated())
+    {
+        request.addHeader("Accept-Encoding", "gzip");
+    }
+}
+
+bool gzipped(const HttpRequest &request)
+{
+    return request.headers().gzip;
+}
+
+// the stream the combined.json body has to be written to, so sink gets it uncompressed
+Stream *fisBodySink(const HttpRequest &request, Stream *sink)
+{
+    if (!gzipped(request))
+    {
+        return sink;
+    }
+
+    fisInflater.begin(sink);
+    return &fisInflater;
+}
+
+// relays the body of the current combined.json response to our endpoint, chunk by chunk,
+// returns the HTTP code of the POST. With onlyIfChanged the body is read once all the same, the
+// POST is held back in fisHoldBuffer until the body hash tells whether it changed since the last
+// acknowledged upload, HTTP_CODE_NOT_MODIFIED if it did not. If the POST fails, or endpointRetry
+// does not allow one yet, the FIS_FIELDS go to the sample store.
+int relayFisResponse(HttpRequest &request, bool onlyIfChanged, uint64_t &bodyHash)
+{
+    UploadStream upload(endpointConnection);
+    addUploadHeaders(upload, "application/json");
+
+    // getSize() is -1 if Railnet did not send a Content-Length, then we send it chunked,
+    // as well as when the length changes on the way
+    const int body_length = compressUploads || gzipped(request) ? -1 : request.size();
+    const bool endpoint_ready = endpointRetry.ready();
+    if (endpoint_ready && onlyIfChanged)
+    {
+        upload.beginDeferred(POST_ENDPOINT_URL, fisHoldBuffer, sizeof(fisHoldBuffer));
+    }
+    else if (!endpoint_ready || !upload.begin(POST_ENDPOINT_URL, body_length))
+    {
+        if (endpoint_ready)
+        {
+            recordUpload(HTTPC_ERROR_CONNECTION_REFUSED);
+        }
+
+        // still read it, for the sample store
+        FisExtractor extractor(fisSnapshot);
+        HashingStream hasher(&extractor);
+        if (request.writeTo(fisBodySink(request, &hasher)) < 0)
+        {
+            railnetConnection.drop();
         }
-    };
+        else if (onlyIfChanged && fisChangeDetector.unchanged(hasher.hash()))
+        {
+            return HTTP_CODE_NOT_MODIFIED;
+        }
+        else if (extractor.complete())
+        {
+            fisPollScheduler.observe(fisSnapshot);
+            sinkFanOut.publish(unixTime(), fisSnapshot);
+            storeSample(fisSnapshot);
+        }
+        return HTTPC_ERROR_CONNECTION_REFUSED;
+    }
+
+    FisExtractor extractor(fisSnapshot, &uploadBody(upload));
+    HashingStream hasher(&extractor);
+    int relayed = request.writeTo(fisBodySink(request, &hasher));
+
+    // only Railnet fails the transfer, a failing endpoint is told by the extractor
+    if (relayed < 0)
+    {
+        LOG_W("[HTTP] relaying combined.json... failed, error: %s", HTTPClient::errorToString(relayed).c_str());
+        upload.abort();
+        railnetConnection.drop();
+        return relayed;
+    }
 
-    do
+    bodyHash = hasher.hash();
+    if (onlyIfChanged && fisChangeDetector.unchanged(bodyHash))
     {
-        if (previousParserState != parserState)
+        if (!upload.holding())
         {
-            Serial.printf("Parser state changed from %d to %d\n",
-                          static_cast<uint8_t>(previousParserState),
-                          static_cast<uint8_t>(parserState));
+            LOG_I("combined.json is larger than the hold buffer, aborting its POST");
         }
+        upload.abort();
+        return HTTP_CODE_NOT_MODIFIED;
+    }
 
-        previousParserState = parserState;
+    if (extractor.forwardFailed())
+    {
+        // the uplink went away on the way, combined.json was still read to its end, so the
+        // failed POST below puts the sample into the store
+        LOG_W("[HTTP] relaying combined.json... failed, the endpoint did not take it");
+    }
+    else
+    {
+        LOG_I("Relaying %d bytes of combined.json to endpoint: %s", relayed, POST_ENDPOINT_URL);
+    }
 
-        switch (parserState)
+    if (extractor.complete())
+    {
+        fisPollScheduler.observe(fisSnapshot);
+        sinkFanOut.publish(unixTime(), fisSnapshot);
+    }
+
+    int postCode = finishUpload(upload);
+
+    if (postCode > 0)
+    {
+        LOG_I("[HTTP] POST to endpoint... code: %d", postCode);
+    }
+    else
+    {
+        LOG_W("[HTTP] POST to endpoint... failed, error: %s", HTTPClient::errorToString(postCode).c_str());
+    }
+
+    if (postCode != HTTP_CODE_OK && extractor.complete())
+    {
+        storeSample(fisSnapshot);
+    }
+
+    return postCode;
+}
+
+// POSTs up to maxCount stored samples, oldest first, as one JSON array or NDJSON body of
+// {"ts":...,"fields":{...}} objects (see BATCH_FORMAT), or as a CBOR array or sequence of the
+// same records, and takes them out of the store once the endpoint accepted them. Returns false
+// if the endpoint could not be reached.
+bool uploadStoredSamples(size_t maxCount)
+{
+    if (sampleStore.pending() == 0)
+    {
+        return true;
+    }
+
+    UploadStream upload(endpointConnection);
+    addUploadHeaders(upload, batchContentType());
+
+    LOG_I("Uploading stored samples, %u pending", sampleStore.pending());
+
+    if (!upload.begin(POST_ENDPOINT_URL))
+    {
+        recordUpload(HTTPC_ERROR_CONNECTION_REFUSED);
+        return false;
+    }
+
+    Stream &body = uploadBody(upload);
+    const bool cbor = wireFormat == WireFormat::CBOR;
+    const bool array = batchFormat == BatchFormat::JSON_ARRAY;
+    uint8_t sample_data[DeltaEncoder::MAX_MESSAGE_LEN];
+    SampleStore::Cursor cursor = sampleStore.begin();
+    FisSample sample;
+    size_t count = 0;
+
+    if (array)
+    {
+        body.write(cbor ? CborWriter::ARRAY_START : '[');
+    }
+    while (count < maxCount && sampleStore.next(cursor, sample))
+    {
+        const size_t len = cbor ? formatSampleCbor(sample, sample_data, sizeof(sample_data))
+                                : formatSample(sample, reinterpret_cast<char *>(sample_data), sizeof(sample_data));
+        if (len == 0)
         {
-        case ParserState::PARSER_INIT:
-            if (current_line_in_buffer.find(SEARCH_STRING) != std::string::npos)
-            {
-                parserState = ParserState::SEARCH_STRING_FOUND;
-                Serial.printf("Found form beginning here: %s", current_line_in_buffer.c_str());
-            }
-            break;
-        case ParserState::SEARCH_STRING_FOUND:
-            if (current_line_in_buffer.find(TOKEN_FIELD_ID) != std::string::npos)
-            {
-                parserState = ParserState::TOKEN_FIELD_FOUND;
-                Serial.printf("Found token field here: %s", current_line_in_buffer.c_str());
-            }
-            break;
-        case ParserState::TOKEN_FIELD_FOUND:
+            continue;
+        }
+
+        // CBOR items need no separators, neither in an array nor in a sequence
+        if (!cbor && array && count > 0)
         {
-            findValueField(formInformation._token, ParserState::TOKEN_VALUE_FOUND);
-            break;
+            body.write(',');
         }
-        case ParserState::TOKEN_VALUE_FOUND:
-            if (current_line_in_buffer.find(CEID_FIELD_ID) != std::string::npos)
-            {
-                parserState = ParserState::CEID_FIELD_FOUND;
-                Serial.printf("Found ceid field here: %s", current_line_in_buffer.c_str());
-            }
-            break;
-        case ParserState::CEID_FIELD_FOUND:
+        body.write(sample_data, len);
+        if (!cbor && !array)
         {
-            findValueField(formInformation._ceid, ParserState::CEID_VALUE_FOUND);
-            break;
+            body.write('\n');
+        }
+        ++count;
+    }
+    if (array)
+    {
+        body.write(cbor ? CborWriter::BREAK : ']');
+    }
+
+    int postCode = finishUpload(upload);
+
+    if (postCode > 0)
+    {
+        LOG_I("[HTTP] POST of %u stored samples... code: %d", static_cast<unsigned>(count), postCode);
+    }
+    else
+    {
+        LOG_W("[HTTP] POST of stored samples... failed, error: %s", HTTPClient::errorToString(postCode).c_str());
+    }
+
+    if (postCode != HTTP_CODE_OK)
+    {
+        return false;
+    }
+
+    sampleStore.popUntil(cursor);
+    return true;
+}
+
+// extracts the FIS_FIELDS from the current combined.json response and hands them to the
+// uploader task, returns true if a complete snapshot was queued
+bool queueFisSnapshot(HttpRequest &request)
+{
+    FisExtractor extractor(fisSnapshot);
+    int read = request.writeTo(fisBodySink(request, &extractor));
+
+    if (read < 0)
+    {
+        LOG_W("[HTTP] GET combined.json... failed, error: %s", HTTPClient::errorToString(read).c_str());
+        railnetConnection.drop();
+        return false;
+    }
+
+    if (!extractor.complete())
+    {
+        LOG_W("combined.json could not be parsed");
+        return false;
+    }
+
+    fisPollScheduler.observe(fisSnapshot);
+
+    FisSample sample;
+    sample.time = unixTime();
+    sample.snapshot = fisSnapshot;
+    sinkFanOut.publish(sample.time, fisSnapshot);
+
+    if (xQueueSend(fisQueue, &sample, 0) != pdTRUE)
+    {
+        // the uploader is stuck, the oldest sample goes
+        FisSample dropped;
+        xQueueReceive(fisQueue, &dropped, 0);
+        xQueueSend(fisQueue, &sample, 0);
+        ++droppedSnapshots;
+        LOG_W("FIS queue full, dropped the oldest snapshot (%u so far)", droppedSnapshots);
+    }
+
+    return true;
+}
+
+// uploads the FIS_FIELDS of snapshot that changed, returns true if the endpoint is up to date
+// afterwards, runs in the uploader task
+bool uploadFisDelta(const FisSnapshot &snapshot)
+{
+    const bool cbor = wireFormat == WireFormat::CBOR;
+    const size_t len = cbor ? deltaEncoder.encodeCbor(snapshot, reinterpret_cast<uint8_t *>(deltaMessage), sizeof(deltaMessage))
+                            : deltaEncoder.encode(snapshot, deltaMessage, sizeof(deltaMessage));
+    if (len == 0)
+    {
+        LOG_I("No FIS field changed, skipping upload");
+        return true;
+    }
+
+    if (cbor)
+    {
+        LOG_D("Delta message: %u bytes of CBOR", static_cast<unsigned>(len));
+    }
+    else
+    {
+        LOG_PAYLOAD("Delta message", deltaMessage, len);
+    }
+
+    UploadStream upload(endpointConnection);
+    addUploadHeaders(upload, cbor ? "application/cbor" : "application/json");
+
+    LOG_I("Making POST request to endpoint: %s", POST_ENDPOINT_URL);
+
+    int postCode = HTTPC_ERROR_CONNECTION_REFUSED;
+    if (upload.begin(POST_ENDPOINT_URL, compressUploads ? -1 : static_cast<int>(len)))
+    {
+        uploadBody(upload).write(reinterpret_cast<const uint8_t *>(deltaMessage), len);
+        postCode = finishUpload(upload);
+    }
+    else
+    {
+        recordUpload(postCode);
+    }
+
+    if (postCode > 0)
+    {
+        LOG_I("[HTTP] POST to endpoint... code: %d", postCode);
+    }
+    else
+    {
+        LOG_W("[HTTP] POST to endpoint... failed, error: %s", HTTPClient::errorToString(postCode).c_str());
+    }
+
+    if (postCode != HTTP_CODE_OK)
+    {
+        deltaEncoder.reject();
+        return false;
+    }
+
+    deltaEncoder.acknowledge();
+
+    // only if nothing sent the login state machine elsewhere in the meantime
+    State expected = State::POST_SUCCEEDED;
+    stateMachine.compare_exchange_strong(expected, State::ENDPOINT_REACHED);
+    return true;
+}
+
+// The consumer half of the DELTA pipeline, the loop task fetches the snapshots. It keeps
+// uploading while the loop task keeps fetching on schedule, however slow the endpoint is.
+// Samples that can't be uploaded go to the sample store, which is drained whenever no live
+// sample is waiting. After a failed upload endpointRetry decides when the next one is made.
+void uploaderTask(void *)
+{
+    for (;;)
+    {
+        const bool backing_off = !endpointRetry.ready();
+
+        // until the metrics are due, or right away if there is a backlog to send
+        uint32_t wait_ms = metricsDeadline.remainingMs();
+        if (sampleStore.pending() > 0)
+        {
+            wait_ms = std::min(wait_ms, backing_off ? endpointRetry.remainingMs() : 0);
         }
-        case ParserState::CEID_VALUE_FOUND:
-            if (current_line_in_buffer.find(CHECKIT_FIELD_ID) != std::string::npos)
+        const TickType_t wait = wait_ms == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(wait_ms);
+
+        if (xQueueReceive(fisQueue, &uploadSample, wait) == pdTRUE)
+        {
+            if (backing_off || !uploadFisDelta(uploadSample.snapshot))
             {
-                parserState = ParserState::CHECKIT_FIELD_FOUND;
-                Serial.printf("Found checkit field here: %s", current_line_in_buffer.c_str());
+                sampleStore.push(uploadSample);
             }
-            break;
-        case ParserState::CHECKIT_FIELD_FOUND:
+        }
+        else if (!backing_off)
         {
-            findValueField(formInformation.checkit, ParserState::CHECKIT_VALUE_FOUND);
-            break;
+            uploadStoredSamples(BACKLOG_BATCH_SIZE);
         }
-        case ParserState::CHECKIT_VALUE_FOUND:
-            if (current_line_in_buffer.find(FORMTYPE_FIELD_ID) != std::string::npos)
+
+        uploadMetricsIfDue();
+    }
+}
+
+// The consumer half of the BATCH pipeline. Every sample goes to the sample store first and the
+// store is sent in one request once BATCH_MAX_SAMPLES were collected or the oldest of them is
+// BATCH_MAX_AGE_S old, so the TLS records and HTTP headers are paid once per batch. A backlog
+// from an outage goes out in back-to-back batches of the same size.
+void batchUploaderTask(void *)
+{
+    // BATCH_MAX_AGE_MS after the oldest pending sample was stored, samples left from before a
+    // reboot are due right away
+    Deadline batch_deadline;
+
+    for (;;)
+    {
+        const uint32_t pending = sampleStore.pending();
+        const bool backing_off = !endpointRetry.ready();
+        const bool due = pending >= BATCH_MAX_SAMPLES ||
+                         (pending > 0 && (!batch_deadline.pending() || batch_deadline.expired()));
+
+        if (due && !backing_off)
+        {
+            if (uploadStoredSamples(BATCH_MAX_SAMPLES))
             {
-                parserState = ParserState::FORMTYPE_FIELD_FOUND;
-                Serial.printf("Found form_type field here: %s", current_line_in_buffer.c_str());
+                State expected = State::POST_SUCCEEDED;
+                stateMachine.compare_exchange_strong(expected, State::ENDPOINT_REACHED);
             }
-            break;
-        case ParserState::FORMTYPE_FIELD_FOUND:
+            continue;
+        }
+
+        uploadMetricsIfDue();
+
+        // sleep until a sample arrives, the batch gets too old, the back-off is over or the
+        // metrics are due
+        uint32_t wait_ms = metricsDeadline.remainingMs();
+        if (pending > 0 && !due)
         {
-            findValueField(formInformation.form_type, ParserState::FORMTYPE_VALUE_FOUND);
-            break;
+            wait_ms = std::min(wait_ms, batch_deadline.remainingMs());
         }
-        case ParserState::FORMTYPE_VALUE_FOUND:
-            Serial.printf("All values were found\n");
-            break;
-        default:
-            break;
+        if (backing_off)
+        {
+            wait_ms = std::min(wait_ms, endpointRetry.remainingMs());
         }
-    } while (parserState != previousParserState);
+        const TickType_t wait = wait_ms == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(wait_ms);
 
-    if (formInformation._token && formInformation._ceid && formInformation.checkit && formInformation.form_type && parserState != ParserState::DONE)
-    {
-        parserState = ParserState::DONE;
-        Serial.printf("Form parsing done:\n_token: %s\n_ceid: %s\ncheckit: %s\nform_type: %s\n",
-                      formInformation._token->c_str(),
-                      formInformation._ceid->c_str(),
-                      formInformation.checkit->c_str(),
-                      formInformation.form_type->c_str());
-        stateMachine = State::REQUEST_PARSED;
+        if (xQueueReceive(fisQueue, &uploadSample, wait) == pdTRUE)
+        {
+            if (sampleStore.pending() == 0)
+            {
+                batch_deadline.start(BATCH_MAX_AGE_MS);
+            }
+            sampleStore.push(uploadSample);
+        }
     }
 }
 
-void parseResponseBufferIntoLineBuffer(char *buf, size_t len)
+// GETs combined.json and uploads it if it changed since the last upload,
+// returns the HTTP code of the GET
+int fetchAndUploadFis()
 {
-    char c;
+    fisChangeDetector.addRequestHeaders(railnetRequest);
+    acceptGzip(railnetRequest);
+
+    LOG_I("[HTTP] GET combined.json...");
+    const int64_t sent = Deadline::now();
+    // a redirect means the portal wants us to log in again, don't follow it
+    int httpCode = railnetRequest.get(FIS_URL);
+    fisLatencyMs = Deadline::msSince(sent);
+    observeLatency(Stage::FIRST_BYTE, fisLatencyMs);
+    if (httpCode <= 0)
+    {
+        LOG_W("[HTTP] GET combined.json... failed, error: %s", HTTPClient::errorToString(httpCode).c_str());
+        railnetRequest.end();
+        return httpCode;
+    }
 
-    for (size_t pos = 0; pos < len; ++pos)
+    LOG_I("[HTTP] GET... code: %d", httpCode);
+
+    if (httpCode == HTTP_CODE_NOT_MODIFIED)
     {
-        c = buf[pos];
-        if (c == '\n')
-        {
-            currentLine += c;
-            // Serial.printf("Parsed line: %s", currentLine.c_str());
+        LOG_I("combined.json not modified, skipping upload");
+        fisChangeDetector.countNotModified();
+        fisPollScheduler.observeUnchanged();
+        railnetRequest.end();
+        return httpCode;
+    }
 
-            lineBuffer[bufferIndex] = currentLine;
+    if (httpCode != HTTP_CODE_OK)
+    {
+        railnetRequest.discard();
+        railnetRequest.end();
+        return httpCode;
+    }
 
-            checkLineBuffer();
+    syncClock(railnetRequest.headers().date);
 
-            bufferIndex = (bufferIndex + 1) % lineBuffer.size();
+    const bool haveValidators = fisChangeDetector.takeValidators(railnetRequest.headers());
 
-            currentLine.clear();
-        }
-        else
+    if (uploadMode != UploadMode::RELAY)
+    {
+        // the uploader compares or collects the fields itself, no need for the body hash,
+        // and a failed upload is retried by the uploader, not by fetching again
+        if (queueFisSnapshot(railnetRequest))
         {
-            currentLine += c;
+            fisChangeDetector.acknowledge(0);
         }
+
+        railnetRequest.end();
+        return httpCode;
+    }
+
+    // Without validators we only find out at the end of the body whether it changed, the relay
+    // holds the upload back until then, a needless upload over the mobile uplink costs the most.
+    uint64_t bodyHash = 0;
+    const int postCode = relayFisResponse(railnetRequest, !haveValidators, bodyHash);
+    if (postCode == HTTP_CODE_NOT_MODIFIED)
+    {
+        LOG_I("combined.json unchanged, skipping upload");
+        fisChangeDetector.countUnchanged();
+        fisPollScheduler.observeUnchanged();
+    }
+
+    const bool relayed = postCode == HTTP_CODE_OK;
+    if (relayed)
+    {
+        stateMachine = State::ENDPOINT_REACHED;
+        fisChangeDetector.acknowledge(bodyHash);
+    }
+
+    railnetRequest.end();
+
+    // one batch of the backlog per cycle, so catching up never delays the next fetch by much
+    if (relayed)
+    {
+        uploadStoredSamples(BACKLOG_BATCH_SIZE);
     }
+
+    return httpCode;
+}
+
+// the responses Railnet sends when the portal session is gone
+bool loginRequired(int httpCode)
+{
+    return httpCode == HTTP_CODE_UNAUTHORIZED || httpCode == HTTP_CODE_FORBIDDEN ||
+           (httpCode >= 300 && httpCode < 400 && httpCode != HTTP_CODE_NOT_MODIFIED);
 }
 
 void setClock()
 {
     configTime(0, 0, "pool.ntp.org");
 
-    Serial.print(F("Waiting for NTP time sync: "));
+    LOG_I("Waiting for NTP time sync");
 
     time_t nowSecs = time(nullptr);
 
     while (nowSecs < 8 * 3600 * 2)
     {
         delay(500);
-        Serial.print(F("."));
         yield();
         nowSecs = time(nullptr);
     }
 
-    Serial.println();
-
     struct tm timeinfo;
     gmtime_r(&nowSecs, &timeinfo);
 
-    Serial.print(F("Current time: "));
-
+    // asctime ends in a newline
     char buf[26];
-    Serial.print(asctime_r(&timeinfo, buf));
+    LOG_I("Current time: %.24s", asctime_r(&timeinfo, buf));
 }
 
 
@@ -274,16 +902,53 @@ void readMacAddress()
   uint8_t baseMac[6];
   esp_err_t ret = esp_wifi_get_mac(WIFI_IF_STA, baseMac);
   if (ret == ESP_OK) {
-    Serial.printf("%02x:%02x:%02x:%02x:%02x:%02x\n",
-                  baseMac[0], baseMac[1], baseMac[2],
-                  baseMac[3], baseMac[4], baseMac[5]);
+    LOG_I("%02x:%02x:%02x:%02x:%02x:%02x",
+          baseMac[0], baseMac[1], baseMac[2],
+          baseMac[3], baseMac[4], baseMac[5]);
     baseMac[4] -= 1;
     esp_wifi_set_mac(WIFI_IF_STA, baseMac);
   } else {
-    Serial.println("Failed to read MAC address");
+    LOG_W("Failed to read MAC address");
   }
 }
 
+// one sink per entry of SINK_URLS, https:// ones POST like the endpoint, coap:// ones send
+// datagrams, mqtts:// ones publish to a broker. The sinks live as long as the firmware.
+void setupSinks()
+{
+    for (char *url = strtok(sinkUrls, ","); url; url = strtok(nullptr, ","))
+    {
+        UrlParts url_parts;
+        if (!parseUrl(url, url_parts) || url_parts.scheme == UrlScheme::HTTP)
+        {
+            LOG_W("[SINK] not a sink: %s", url);
+            continue;
+        }
+
+        Sink *sink = nullptr;
+        switch (url_parts.scheme)
+        {
+        case UrlScheme::COAP:
+            sink = new CoapSink(url);
+            break;
+        case UrlScheme::MQTTS:
+            sink = new MqttSink(url, SECRET, TLS_VERIFY);
+            break;
+        default:
+            sink = new HttpsSink(url, SECRET, TLS_VERIFY);
+            break;
+        }
+        if (!sinkFanOut.add(sink))
+        {
+            delete sink;
+            continue;
+        }
+        dnsAddHost(url_parts.host);
+    }
+
+    sinkFanOut.begin(SINK_QUEUE_LENGTH);
+}
+
 void setup()
 {
     esp_log_level_set("*", ESP_LOG_ERROR);
@@ -297,7 +962,10 @@ void setup()
         Serial.println();
     }
 
-    Serial.println("setup()");
+    // from here on nothing waits for the UART
+    logBegin();
+
+    LOG_I("setup()");
 
     delay(1000);
 
@@ -312,192 +980,342 @@ void setup()
         vTaskDelay(100 / portTICK_PERIOD_MS);
     }*/
 
-    // scan and print wifi list before connecting
-
-    WiFi.begin("OEBB");
     WiFi.mode(WIFI_STA);
-    WiFi.persistent(true);
-    WiFi.setAutoReconnect(true);
-    WiFi.setSleep(false);
+    powerBegin();
 
     // readMacAddress();
 
-    while (WiFi.status() != WL_CONNECTED)
+    // both hosts are looked up in the background from now on, and again on every reconnect
+    dnsBegin();
+    for (const char *url : {RAILNET_PORTAL_URL, POST_ENDPOINT_URL})
     {
-        Serial.print(".");
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        UrlParts url_parts;
+        if (parseUrl(url, url_parts))
+        {
+            dnsAddHost(url_parts.host);
+        }
     }
 
-    Serial.println(" connected");
-    Serial.printf("Connected to WiFi %s: %s\n", WiFi.SSID().c_str(), WiFi.localIP().toString().c_str());
+    setupSinks();
+
+    // the login starts from the loop once the link is up
+    wifiLink.begin();
 
     // setClock();
 
-    stateMachine = State::WIFI_CONNECTED;
+    railnetConnection.setup(TLS_VERIFY, RAILNET_SPKI_PINS);
 
-    client.setInsecure();
-    client.setCACertBundle(x509_crt_imported_bundle_bin_start);
-}
+    if (RAILNET_GZIP)
+    {
+        fisInflater.allocate();
+    }
 
-void loop()
-{
-    if (retryTimeout && millis() > *retryTimeout)
+    endpointConnection.setup(TLS_VERIFY, ENDPOINT_SPKI_PINS);
+
+    if (!(psramFound() && sampleStore.beginRam(PSRAM_SAMPLE_STORE_SIZE)))
     {
-        retryTimeout.reset();
-        Serial.println("Retrying now...");
-        stateMachine = State::WIFI_CONNECTED;
-        parserState = ParserState::PARSER_INIT;
+        sampleStore.beginFlash(SAMPLE_PARTITION);
     }
 
-    if (lastDebugPrintMillis == 0 || (millis() - lastDebugPrintMillis) > 3000)
+    if (uploadMode == UploadMode::BATCH && !sampleStore.ready())
     {
-        lastDebugPrintMillis = millis();
-        Serial.printf("Current state machine state: %d\n", static_cast<uint8_t>(stateMachine));
-        Serial.printf("Current parser state: %d\n", static_cast<uint8_t>(parserState));
+        LOG_W("[STORE] no sample store, nothing will be uploaded in BATCH mode");
     }
 
-    switch (stateMachine)
+    if (METRICS_INTERVAL_MS > 0)
     {
-    case State::WIFI_CONNECTED:
+        metricsDeadline.start(METRICS_INTERVAL_MS);
+    }
+
+    if (uploadMode != UploadMode::RELAY)
     {
-        lineBuffer.fill({});
-        currentLine.clear();
-        bufferIndex = 0;
-        form_start_line_idx.reset();
-        clearFormInformation();
+        // the uploader goes to the core the loop task does not run on
+        const BaseType_t uploader_core = xPortGetCoreID() == 0 ? 1 : 0;
 
-        parserState = ParserState::PARSER_INIT;
-        stateMachine = State::REQUEST_MADE;
+        fisQueue = xQueueCreate(FIS_QUEUE_LENGTH, sizeof(FisSample));
+        xTaskCreatePinnedToCore(uploadMode == UploadMode::BATCH ? batchUploaderTask : uploaderTask, "uploader",
+                                UPLOADER_STACK_SIZE, nullptr, 1, nullptr, uploader_core);
+    }
+}
 
-        HTTPClient https;
-        https.setCookieJar(&cookieJar);
+// starts the login once the link is up. After a reconnect the portal session usually still
+// works, even on another AP of the train, the first FIS fetch tells.
+void wifiUp()
+{
+    LOG_I("Connected to WiFi %s: %s", WiFi.SSID().c_str(), WiFi.localIP().toString().c_str());
+    dnsPrewarm();
 
-        https.setTimeout(10000);
-        https.setFollowRedirects(HTTPC_STRICT_FOLLOW_REDIRECTS);
+    const State state = stateMachine;
+    if (state == State::POST_SUCCEEDED || state == State::ENDPOINT_REACHED || state == State::PROBING_CACHED_LOGIN)
+    {
+        stateMachine = State::PROBING_CACHED_LOGIN;
+        return;
+    }
 
-        if (https.begin(client, RAILNET_PORTAL_URL))
-        {
-            Serial.print("[HTTP] GET...\n");
-            // start connection and send HTTP header
-            int httpCode = https.GET();
-            if (httpCode > 0)
-            {
-                // HTTP header has been send and Server response header has been handled
-                Serial.printf("[HTTP] GET... code: %d\n", httpCode);
+    stateMachine = State::WIFI_CONNECTED;
 
-                // file found at server
-                if (httpCode == HTTP_CODE_OK)
-                {
+    FormInformation cached_form;
+    if (loginCache.load(WiFi.BSSID(), railnetCookies, cached_form))
+    {
+        portalParser.restore(cached_form);
+        stateMachine = State::PROBING_CACHED_LOGIN;
+    }
+}
 
-                    // get length of document (is -1 when Server sends no Content-Length header)
-                    int len = https.getSize();
+// the state machine waits where it is until the link is back
+void wifiDown()
+{
+    portalRetryDeadline.stop();
+    // the socket went with the link
+    railnetConnection.drop();
+}
 
-                    // create buffer for read
-                    char buff[128] = {0};
+// until the loop has something to do again, 0 while a login is in progress
+uint32_t idleMs()
+{
+    uint32_t ms = std::min(debugPrintDeadline.remainingMs(), portalRetryDeadline.remainingMs());
 
-                    // get tcp stream
-                    WiFiClient *stream = https.getStreamPtr();
+    const State state = stateMachine;
+    if (state == State::POST_SUCCEEDED || state == State::ENDPOINT_REACHED)
+    {
+        ms = std::min(ms, std::max(railnetRetry.remainingMs(), fisPollScheduler.remainingMs()));
+    }
+    else if (!portalRetryDeadline.pending())
+    {
+        ms = 0;
+    }
 
-                    // read all data from server
-                    while (https.connected() && (len > 0 || len == -1))
-                    {
-                        // get available data size
-                        size_t size = stream->available();
+    return ms;
+}
 
-                        if (size)
-                        {
-                            // read up to 128 byte
-                            int c = stream->readBytes(buff, ((size > sizeof(buff)) ? sizeof(buff) : size));
+void loop()
+{
+    if (portalRetryDeadline.expired())
+    {
+        portalRetryDeadline.stop();
+        LOG_I("Retrying now...");
+        stateMachine = State::WIFI_CONNECTED;
+        portalParser.reset();
+    }
+
+    if (!debugPrintDeadline.pending() || debugPrintDeadline.expired())
+    {
+        debugPrintDeadline.advance(DEBUG_PRINT_INTERVAL_MS);
+        LOG_I("Current state machine state: %d", static_cast<uint8_t>(stateMachine));
+        LOG_I("Current parser state: %d", static_cast<uint8_t>(portalParser.state()));
+        railnetConnection.printStats();
+        endpointConnection.printStats();
+        fisChangeDetector.printStats();
+        fisPollScheduler.printStats();
+        wifiLink.printStats();
+        dnsPrintStats();
+        powerPrintStats();
+        sinkFanOut.printStats();
+        roamer.printStats();
+        railnetRetry.printStats();
+        endpointRetry.printStats();
+        sampleStore.printStats();
+        logPrintStats();
+        if (fisQueue)
+        {
+            LOG_I("FIS queue: %u waiting, %u dropped",
+                  static_cast<unsigned>(uxQueueMessagesWaiting(fisQueue)),
+                  droppedSnapshots);
+        }
+    }
+
+    watchHeap();
+
+    const State state = stateMachine;
+    if (state != observedState)
+    {
+        countStateTransition();
+        observedState = state;
+    }
 
-                            parseResponseBufferIntoLineBuffer(buff, c);
+    switch (wifiLink.poll())
+    {
+    case WifiLink::Event::UP:
+        wifiUp();
+        break;
+    case WifiLink::Event::DOWN:
+        wifiDown();
+        break;
+    default:
+        break;
+    }
+
+    if (!wifiLink.up())
+    {
+        powerIdle(LINK_DOWN_IDLE_MS);
+        return;
+    }
+
+    roamer.poll();
 
-                            if (stateMachine == State::REQUEST_PARSED)
-                            {
-                                https.end();
-                                break;
-                            }
+    switch (stateMachine)
+    {
+    case State::WIFI_CONNECTED:
+    {
+        portalParser.reset();
+        postingCachedForm = false;
+        stateMachine = State::REQUEST_MADE;
 
-                            // write it to Serial
-                            // Serial.write(buff, c);
+        LOG_I("[HTTP] GET...");
+        // start connection and send HTTP header, the portal page may take a while
+        railnetRequest.setTimeout(PORTAL_READ_TIMEOUT_MS);
+        const int portalCode = railnetRequest.get(RAILNET_PORTAL_URL, true);
+        if (portalCode > 0)
+        {
+            // HTTP header has been send and Server response header has been handled
+            LOG_I("[HTTP] GET... code: %d", portalCode);
 
-                            if (len > 0)
-                            {
-                                len -= c;
-                            }
+            // file found at server
+            if (portalCode == HTTP_CODE_OK)
+            {
+                // read until the form was parsed, the page ended or the portal stalled
+                while (true)
+                {
+                    const int c = railnetRequest.read(reinterpret_cast<uint8_t *>(portalReadBuffer), sizeof(portalReadBuffer));
+                    if (c <= 0)
+                    {
+                        if (c < 0)
+                        {
+                            LOG_W("[HTTP] portal page stalled");
                         }
-                        delay(1);
+                        break;
+                    }
+
+                    if (portalParser.parse(portalReadBuffer, c))
+                    {
+                        stateMachine = State::REQUEST_PARSED;
                     }
 
-                    Serial.println();
-                    Serial.print("[HTTP] connection closed or file end.\n");
+                    if (portalParser.finished())
+                    {
+                        break;
+                    }
                 }
+
+                LOG_I("[HTTP] connection closed or file end.");
             }
             else
             {
-                Serial.printf("[HTTP] GET... failed, error: %s\n", https.errorToString(httpCode).c_str());
-                retryTimeout = millis() + 5000;
-                Serial.println("Retrying in 5 seconds...");
+                railnetRequest.discard();
             }
-
-            https.end();
         }
+        else
+        {
+            LOG_W("[HTTP] GET... failed, error: %s", HTTPClient::errorToString(portalCode).c_str());
+        }
+
+        // the rest of the page is still on the wire, end() closes instead of draining it
+        railnetRequest.end();
+        railnetRequest.setTimeout(HttpRequest::DEFAULT_TIMEOUT_MS);
 
         if (stateMachine != State::REQUEST_PARSED)
         {
-            Serial.println("Form parsing did not complete successfully.");
-            retryTimeout = millis() + 5000;
-            Serial.println("Retrying in 5 seconds...");
+            // a page without the form counts as a bad response
+            LOG_W("Form parsing did not complete successfully.");
+            portalRetryDeadline.start(railnetRetry.failed(classifyFailure(portalCode, railnetConnection.client())));
         }
         break;
     }
     case State::REQUEST_PARSED:
     {
         // send POST request with form data
-        if (!formInformation._token || !formInformation._ceid || !formInformation.checkit || !formInformation.form_type)
+        const FormInformation &formInformation = portalParser.form();
+        if (!formInformation.complete())
         {
-            Serial.println("Form information incomplete, cannot send POST request");
+            LOG_W("Form information incomplete, cannot send POST request");
+            stateMachine = State::REQUEST_MADE;
+            portalRetryDeadline.start(railnetRetry.failed(FailureClass::BAD_RESPONSE));
             break;
         }
 
+        int postCode = HTTPC_ERROR_CONNECTION_REFUSED;
+
         {
-            HTTPClient https;
-            https.setCookieJar(&cookieJar);
+            LOG_I("Sending POST request with form data...");
+
+            char postData[4 * FormValue::CAPACITY + 64];
+            const int postDataLen = snprintf(postData, sizeof(postData), "_token=%s&_ceid=%s&checkit=%s&form_type=%s",
+                                             formInformation._token.c_str(),
+                                             formInformation._ceid.c_str(),
+                                             formInformation.checkit.c_str(),
+                                             formInformation.form_type.c_str());
 
-            Serial.println("Sending POST request with form data...");
+            LOG_D("POST data: %s", postData);
 
-            https.setTimeout(10000);
-            https.setFollowRedirects(HTTPC_STRICT_FOLLOW_REDIRECTS);
+            int httpCode = railnetRequest.post(RAILNET_PORTAL_URL, "application/x-www-form-urlencoded",
+                                               reinterpret_cast<uint8_t *>(postData), postDataLen, true);
+            postCode = httpCode;
 
-            if (https.begin(client, "https://railnet.oebb.at/en/connecttoweb"))
+            if (httpCode > 0)
             {
-                https.addHeader("Content-Type", "application/x-www-form-urlencoded");
+                LOG_I("[HTTP] POST... code: %d", httpCode);
 
-                String postData = "_token=" + String(formInformation._token->c_str()) +
-                                  "&_ceid=" + String(formInformation._ceid->c_str()) +
-                                  "&checkit=" + String(formInformation.checkit->c_str()) +
-                                  "&form_type=" + String(formInformation.form_type->c_str());
+                if (httpCode == HTTP_CODE_OK)
+                {
+                    stateMachine = State::POST_SUCCEEDED;
 
-                Serial.printf("POST data: %s\n", postData.c_str());
+                    const time_t login_time = syncClock(railnetRequest.headers().date);
+                    loginCache.save(WiFi.BSSID(), railnetCookies, formInformation, login_time);
+                }
 
-                int httpCode = https.POST(postData);
+                railnetRequest.discard();
+            }
+            else
+            {
+                LOG_W("[HTTP] POST... failed, error: %s", HTTPClient::errorToString(httpCode).c_str());
+            }
 
-                if (httpCode > 0)
-                {
-                    Serial.printf("[HTTP] POST... code: %d\n", httpCode);
+            railnetRequest.end();
+        }
 
-                    if (httpCode == HTTP_CODE_OK)
-                    {
-                        stateMachine = State::POST_SUCCEEDED;
-                    }
-                }
-                else
-                {
-                    Serial.printf("[HTTP] POST... failed, error: %s\n", https.errorToString(httpCode).c_str());
-                }
+        if (stateMachine == State::POST_SUCCEEDED)
+        {
+            railnetRetry.succeeded();
+        }
+        else if (postingCachedForm)
+        {
+            LOG_I("Cached login form rejected, going through the portal page");
+            loginCache.clear();
+            stateMachine = State::WIFI_CONNECTED;
+        }
+        else
+        {
+            // wait before starting over from the portal page, the form token may be stale by then
+            stateMachine = State::REQUEST_MADE;
+            portalRetryDeadline.start(railnetRetry.failed(classifyFailure(postCode, railnetConnection.client())));
+        }
+        break;
+    }
+    case State::PROBING_CACHED_LOGIN:
+    {
+        // the first FIS fetch tells whether the session of the cached login still works
+        fisPollScheduler.fetched();
+        const int httpCode = fetchAndUploadFis();
 
-                https.end();
+        if (httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_NOT_MODIFIED)
+        {
+            LOG_I("Cached login still valid");
+            if (stateMachine == State::PROBING_CACHED_LOGIN)
+            {
+                stateMachine = State::POST_SUCCEEDED;
             }
         }
+        else if (loginRequired(httpCode))
+        {
+            // the session is gone, posting the cached form again may still be accepted
+            LOG_I("Cached session expired, posting the cached login form");
+            postingCachedForm = true;
+            stateMachine = State::REQUEST_PARSED;
+        }
+        else
+        {
+            stateMachine = State::WIFI_CONNECTED;
+        }
         break;
     }
     case State::POST_SUCCEEDED:
@@ -505,65 +1323,45 @@ void loop()
         // now we can proceed with collecting data and sending it home
         // we fetch https://railnet.oebb.at/assets/media/fis/combined.json, and then POST it to our endpoint
 
-        if (lastFisFetchMillis == 0 || (millis() - lastFisFetchMillis) > FIS_FETCH_INTERVAL_MS)
+        if (railnetRetry.ready() && fisPollScheduler.due())
         {
-            HTTPClient https;
-
-            https.setTimeout(10000);
-            https.setFollowRedirects(HTTPC_STRICT_FOLLOW_REDIRECTS);
-            https.setCookieJar(&cookieJar);
-
-            lastFisFetchMillis = millis();
+            const uint32_t received = railnetConnection.client().bytesReceived();
+            const int64_t started = Deadline::now();
+            const int httpCode = fetchAndUploadFis();
 
-            if (https.begin(client, "https://railnet.oebb.at/assets/media/fis/combined.json"))
+            // in RELAY mode the transfer includes the upload the body is streamed into
+            if (httpCode > 0)
             {
-                Serial.print("[HTTP] GET combined.json...\n");
-                int httpCode = https.GET();
-                if (httpCode > 0)
-                {
-                    Serial.printf("[HTTP] GET... code: %d\n", httpCode);
-
-                    if (httpCode == HTTP_CODE_OK)
-                    {
-                        String payload = https.getString();
-                        Serial.printf("combined.json payload: %s\n", payload.c_str());
-
-                        // Now POST to our endpoint
-                        HTTPClient httpPost;
-                        httpPost.setFollowRedirects(HTTPC_STRICT_FOLLOW_REDIRECTS);
-                        httpPost.addHeader("X-Api-Key", String(SECRET));
+                const uint32_t elapsed_ms = Deadline::msSince(started);
+                const uint32_t transfer_ms = elapsed_ms - std::min(elapsed_ms, fisLatencyMs);
+                roamer.countRequest(fisLatencyMs, railnetConnection.client().bytesReceived() - received, transfer_ms);
+                observeLatency(Stage::BODY, transfer_ms);
+            }
 
-                        Serial.printf("Making POST request to endpoint: %s\n", POST_ENDPOINT_URL);
+            if (uploadMode == UploadMode::RELAY)
+            {
+                uploadMetricsIfDue();
+            }
 
-                        if (httpPost.begin(client, POST_ENDPOINT_URL))
-                        {
-                            httpPost.addHeader("Content-Type", "application/json");
-
-                            int postCode = httpPost.POST(payload);
-
-                            if (postCode > 0)
-                            {
-                                Serial.printf("[HTTP] POST to endpoint... code: %d\n", postCode);
-                                if (postCode == HTTP_CODE_OK)
-                                {
-                                    stateMachine = State::ENDPOINT_REACHED;
-                                }
-                            }
-                            else
-                            {
-                                Serial.printf("[HTTP] POST to endpoint... failed, error: %s\n", httpPost.errorToString(postCode).c_str());
-                            }
-
-                            httpPost.end();
-                        }
-                    }
-                }
-                else
-                {
-                    Serial.printf("[HTTP] GET combined.json... failed, error: %s\n", https.errorToString(httpCode).c_str());
-                }
+            if (loginRequired(httpCode))
+            {
+                LOG_I("Portal session expired, logging in again");
+                loginCache.clear();
+                stateMachine = State::WIFI_CONNECTED;
+            }
+            else if (httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_NOT_MODIFIED)
+            {
+                railnetRetry.succeeded();
+            }
+            else
+            {
+                railnetRetry.failed(classifyFailure(httpCode, railnetConnection.client()));
+            }
 
-                https.end();
+            // between two fetches a handover cuts off no request to Railnet
+            if (roamer.handover())
+            {
+                wifiDown();
             }
             break;
         }
@@ -571,5 +1369,5 @@ void loop()
         break;
     }
 
-    delay(10);
+    powerIdle(idleMs());
 }
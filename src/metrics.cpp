@@ -0,0 +1,142 @@
+#include "metrics.h"
+
+#include <esp_heap_caps.h>
+
+#include "deadline.h"
+#include "heap_watch.h"
+#include "power_save.h"
+
+namespace
+{
+constexpr const char *const LATENCY_NAME = "fis_stage_latency_ms";
+// by Stage
+constexpr const char *const STAGE_NAMES[] = {"dns", "connect", "tls", "first_byte", "body", "post"};
+static_assert(sizeof(STAGE_NAMES) / sizeof(STAGE_NAMES[0]) == static_cast<size_t>(Stage::COUNT),
+              "one name per stage");
+
+LatencyHistogram stageLatencies[static_cast<size_t>(Stage::COUNT)];
+
+// by Parser
+constexpr const char *const PARSER_NAMES[] = {"portal", "fis"};
+static_assert(sizeof(PARSER_NAMES) / sizeof(PARSER_NAMES[0]) == static_cast<size_t>(Parser::COUNT),
+              "one name per parser");
+
+std::atomic<uint32_t> parsedBytes[static_cast<size_t>(Parser::COUNT)]{};
+std::atomic<uint32_t> parseUs[static_cast<size_t>(Parser::COUNT)]{};
+
+std::atomic<uint32_t> bytesIn{0};
+std::atomic<uint32_t> bytesOut{0};
+std::atomic<uint32_t> retries{0};
+std::atomic<uint32_t> stateTransitions{0};
+
+void counter(Print &out, const char *name, const char *help, uint32_t value)
+{
+    out.printf("# HELP %s %s\n# TYPE %s counter\n%s %u\n", name, help, name, name, value);
+}
+
+void gauge(Print &out, const char *name, const char *help, uint32_t value)
+{
+    out.printf("# HELP %s %s\n# TYPE %s gauge\n%s %u\n", name, help, name, name, value);
+}
+
+void parserCounter(Print &out, const char *name, const char *help, const std::atomic<uint32_t> *values)
+{
+    out.printf("# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (size_t parser = 0; parser < static_cast<size_t>(Parser::COUNT); ++parser)
+    {
+        out.printf("%s{parser=\"%s\"} %u\n", name, PARSER_NAMES[parser], values[parser].load());
+    }
+}
+} // namespace
+
+void LatencyHistogram::observe(uint32_t ms)
+{
+    size_t bucket = 0;
+    while (bucket < BUCKETS - 1 && ms > BOUNDS_MS[bucket])
+    {
+        ++bucket;
+    }
+
+    counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    sumMs.fetch_add(ms, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::render(Print &out, const char *name, const char *stage) const
+{
+    uint32_t cumulative = 0;
+
+    for (size_t bucket = 0; bucket < BUCKETS; ++bucket)
+    {
+        cumulative += counts[bucket].load(std::memory_order_relaxed);
+        if (bucket < BUCKETS - 1)
+        {
+            out.printf("%s_bucket{stage=\"%s\",le=\"%u\"} %u\n", name, stage, BOUNDS_MS[bucket], cumulative);
+        }
+        else
+        {
+            out.printf("%s_bucket{stage=\"%s\",le=\"+Inf\"} %u\n", name, stage, cumulative);
+        }
+    }
+
+    out.printf("%s_sum{stage=\"%s\"} %u\n", name, stage, sumMs.load(std::memory_order_relaxed));
+    out.printf("%s_count{stage=\"%s\"} %u\n", name, stage, cumulative);
+}
+
+void observeLatency(Stage stage, uint32_t ms)
+{
+    stageLatencies[static_cast<size_t>(stage)].observe(ms);
+}
+
+void countBytesIn(uint32_t bytes)
+{
+    bytesIn.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void countBytesOut(uint32_t bytes)
+{
+    bytesOut.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void countRetry()
+{
+    retries.fetch_add(1, std::memory_order_relaxed);
+}
+
+void countStateTransition()
+{
+    stateTransitions.fetch_add(1, std::memory_order_relaxed);
+}
+
+void countParsed(Parser parser, uint32_t bytes, uint32_t us)
+{
+    parsedBytes[static_cast<size_t>(parser)].fetch_add(bytes, std::memory_order_relaxed);
+    parseUs[static_cast<size_t>(parser)].fetch_add(us, std::memory_order_relaxed);
+}
+
+void renderMetrics(Print &out)
+{
+    out.printf("# HELP %s How long the stages of the requests took.\n# TYPE %s histogram\n", LATENCY_NAME,
+               LATENCY_NAME);
+    for (size_t stage = 0; stage < static_cast<size_t>(Stage::COUNT); ++stage)
+    {
+        stageLatencies[stage].render(out, LATENCY_NAME, STAGE_NAMES[stage]);
+    }
+
+    counter(out, "fis_received_bytes_total", "Bytes received from all hosts, over TLS and UDP.", bytesIn.load());
+    counter(out, "fis_sent_bytes_total", "Bytes sent to all hosts, over TLS and UDP.", bytesOut.load());
+    counter(out, "fis_retries_total", "Failed requests that were retried later.", retries.load());
+    parserCounter(out, "fis_parsed_bytes_total", "Bytes the parsers looked at.", parsedBytes);
+    parserCounter(out, "fis_parse_microseconds_total", "CPU time the parsers took for them.", parseUs);
+    counter(out, "fis_state_transitions_total", "Changes of the login state machine.", stateTransitions.load());
+
+    gauge(out, "fis_heap_free_bytes", "Free heap.", heap_caps_get_free_size(MALLOC_CAP_8BIT));
+    gauge(out, "fis_heap_min_free_bytes", "The least free heap since boot.",
+          heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+    gauge(out, "fis_heap_largest_block_bytes", "The largest block that can be allocated.",
+          heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+    gauge(out, "fis_heap_min_largest_block_bytes", "The smallest largest block of the soak window.",
+          minLargestFreeBlock());
+    gauge(out, "fis_loop_awake_permille", "The share of the last stats interval the loop was awake.",
+          powerAwakePermille());
+    gauge(out, "fis_uptime_seconds", "Time since boot.", static_cast<uint32_t>(Deadline::now() / 1000000));
+}
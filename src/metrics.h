@@ -0,0 +1,54 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <atomic>
+
+// The stages a request goes through, each has a latency histogram
+enum class Stage : uint8_t
+{
+    DNS,        // resolving the host name
+    CONNECT,    // the TCP connect
+    TLS,        // the handshake
+    FIRST_BYTE, // combined.json, from the GET to the response headers
+    BODY,       // combined.json, reading the body
+    POST,       // an upload to the endpoint, from connecting to the response
+    COUNT
+};
+
+// The parsers that look at every byte of a response, each counts its bytes and its CPU time
+enum class Parser : uint8_t
+{
+    PORTAL, // the login form on the captive portal page
+    FIS,    // the FIS_FIELDS in combined.json
+    COUNT
+};
+
+// Counts latencies into fixed buckets, Prometheus style. Safe to use from several tasks.
+class LatencyHistogram
+{
+public:
+    static constexpr uint32_t BOUNDS_MS[] = {10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000};
+    static constexpr size_t BUCKETS = sizeof(BOUNDS_MS) / sizeof(BOUNDS_MS[0]) + 1; // the last is +Inf
+
+    void observe(uint32_t ms);
+
+    // the _bucket, _sum and _count lines
+    void render(Print &out, const char *name, const char *stage) const;
+
+private:
+    std::atomic<uint32_t> counts[BUCKETS]{}; // per bucket, rendered cumulative
+    std::atomic<uint32_t> sumMs{0};
+};
+
+// The metrics of the device, rendered in the Prometheus text format (version 0.0.4) and
+// uploaded every METRICS_INTERVAL_S, so it can be told which wagon falls behind and why.
+void observeLatency(Stage stage, uint32_t ms);
+void countBytesIn(uint32_t bytes);
+void countBytesOut(uint32_t bytes);
+void countRetry();
+void countStateTransition();
+// bytes scanned by a parser and the microseconds it took, without the streams it forwards to
+void countParsed(Parser parser, uint32_t bytes, uint32_t us);
+
+void renderMetrics(Print &out);
@@ -0,0 +1,628 @@
+#include "mqtt_sink.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <HTTPClient.h>
+#include <esp_mac.h>
+
+#include "logger.h"
+
+namespace
+{
+constexpr uint8_t PROTOCOL_VERSION = 5;
+
+// the packet types, in the upper half of the first byte
+constexpr uint8_t TYPE_CONNECT = 1;
+constexpr uint8_t TYPE_CONNACK = 2;
+constexpr uint8_t TYPE_PUBLISH = 3;
+constexpr uint8_t TYPE_PUBACK = 4;
+constexpr uint8_t TYPE_PINGREQ = 12;
+constexpr uint8_t TYPE_PINGRESP = 13;
+constexpr uint8_t TYPE_DISCONNECT = 14;
+
+constexpr uint8_t PUBLISH_DUP = 0x08;
+constexpr uint8_t PUBLISH_QOS1 = 0x02;
+
+constexpr uint8_t CONNECT_USERNAME = 0x80;
+constexpr uint8_t CONNECT_PASSWORD = 0x40;
+
+constexpr uint8_t PROPERTY_SESSION_EXPIRY = 0x11;
+constexpr uint8_t PROPERTY_SERVER_KEEP_ALIVE = 0x13;
+constexpr uint8_t PROPERTY_RECEIVE_MAXIMUM = 0x21;
+constexpr uint8_t PROPERTY_TOPIC_ALIAS_MAXIMUM = 0x22;
+constexpr uint8_t PROPERTY_TOPIC_ALIAS = 0x23;
+constexpr uint8_t PROPERTY_MAXIMUM_PACKET_SIZE = 0x27;
+
+constexpr uint16_t TOPIC_ALIAS = 1;
+constexpr uint8_t REASON_ERROR = 0x80; // reason codes from here on are failures
+
+// in front of the body of a packet, the fixed header: the type and up to 4 bytes of length
+constexpr size_t HEADER_ROOM = 5;
+constexpr size_t MAX_TOPIC_LEN = 128;
+constexpr size_t MAX_PASSWORD_LEN = 128;
+
+size_t putU16(uint8_t *buf, uint16_t value)
+{
+    buf[0] = value >> 8;
+    buf[1] = value & 0xff;
+    return 2;
+}
+
+size_t putU32(uint8_t *buf, uint32_t value)
+{
+    putU16(buf, value >> 16);
+    putU16(buf + 2, value & 0xffff);
+    return 4;
+}
+
+size_t putString(uint8_t *buf, const char *text, size_t len)
+{
+    putU16(buf, len);
+    memcpy(buf + 2, text, len);
+    return 2 + len;
+}
+
+uint16_t getU16(const uint8_t *buf)
+{
+    return buf[0] << 8 | buf[1];
+}
+
+uint32_t getU32(const uint8_t *buf)
+{
+    return static_cast<uint32_t>(getU16(buf)) << 16 | getU16(buf + 2);
+}
+
+bool getVarint(const uint8_t *buf, size_t len, size_t &pos, uint32_t &value)
+{
+    value = 0;
+    for (uint8_t shift = 0; shift <= 21 && pos < len; shift += 7)
+    {
+        const uint8_t byte = buf[pos++];
+        value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the properties by the type of their value
+constexpr uint8_t BYTE_PROPERTIES[] = {0x01, 0x17, 0x19, 0x24, 0x25, 0x28, 0x29, 0x2a};
+constexpr uint8_t U16_PROPERTIES[] = {0x13, 0x21, 0x22, 0x23};
+constexpr uint8_t U32_PROPERTIES[] = {0x02, 0x11, 0x18, 0x27};
+constexpr uint8_t VARINT_PROPERTIES[] = {0x0b};
+constexpr uint8_t STRING_PROPERTIES[] = {0x03, 0x08, 0x09, 0x12, 0x15, 0x16, 0x1a, 0x1c, 0x1f}; // and binary data
+constexpr uint8_t STRING_PAIR_PROPERTY = 0x26;
+
+template <size_t N>
+bool isOneOf(uint8_t id, const uint8_t (&ids)[N])
+{
+    return std::find(ids, ids + N, id) != ids + N;
+}
+
+// moves pos behind the value of property id, false for an id this client does not know
+bool skipProperty(uint8_t id, const uint8_t *buf, size_t len, size_t &pos)
+{
+    const auto skip_string = [&]()
+    {
+        pos += pos + 2 <= len ? 2 + getU16(buf + pos) : 2;
+    };
+
+    if (isOneOf(id, BYTE_PROPERTIES))
+    {
+        pos += 1;
+    }
+    else if (isOneOf(id, U16_PROPERTIES))
+    {
+        pos += 2;
+    }
+    else if (isOneOf(id, U32_PROPERTIES))
+    {
+        pos += 4;
+    }
+    else if (isOneOf(id, VARINT_PROPERTIES))
+    {
+        uint32_t ignored;
+        return getVarint(buf, len, pos, ignored);
+    }
+    else if (isOneOf(id, STRING_PROPERTIES))
+    {
+        skip_string();
+    }
+    else if (id == STRING_PAIR_PROPERTY)
+    {
+        skip_string();
+        skip_string();
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+} // namespace
+
+MqttSink::MqttSink(const char *url, const char *password, bool verify)
+    : Sink{url, BATCH_MAX_SAMPLES, BATCH_MAX_AGE_MS, STACK_SIZE}, url{url}, password{password}, connection{url}
+{
+    valid = parseUrl(url, parts) && parts.scheme == UrlScheme::MQTTS && parts.path[0] == '/' && parts.path[1] != '\0' &&
+            strlen(parts.path + 1) <= MAX_TOPIC_LEN && strlen(password) <= MAX_PASSWORD_LEN;
+    if (!valid)
+    {
+        LOG_W("[MQTT] invalid url or password: %s", url);
+    }
+    topic = parts.path + 1;
+
+    uint8_t mac[6];
+    esp_efuse_mac_get_default(mac);
+    snprintf(clientId, sizeof(clientId), "fis-%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4],
+             mac[5]);
+
+    connection.setup(verify, "");
+}
+
+bool MqttSink::send(const FisSample *const *samples, size_t &count, FailureClass &failure)
+{
+    const size_t batch_count = std::min(count, Sink::MAX_BATCH);
+    count = 0;
+    failure = FailureClass::BAD_RESPONSE;
+    if (!valid)
+    {
+        return false;
+    }
+
+    connection.countRequest();
+    if (!connected && !connect(failure))
+    {
+        return false;
+    }
+
+    uint16_t ids[Sink::MAX_BATCH];
+    bool acked[Sink::MAX_BATCH]{};
+    size_t published = 0;
+    size_t in_flight = 0;
+    bool ok = true;
+    bool refused = false;
+
+    while (ok && (published < batch_count || in_flight > 0))
+    {
+        // the window is filled up before an acknowledgement is waited for
+        while (published < batch_count && in_flight < window)
+        {
+            bool dup;
+            ids[published] = packetIdFor(samples[published], dup);
+            const Published result = publish(*samples[published], ids[published], dup);
+            if (result == Published::FAILED)
+            {
+                failure = FailureClass::CONNECT;
+                ok = false;
+                break;
+            }
+            if (result == Published::TOO_LARGE)
+            {
+                // never fits, it would block the sink forever, done with like an acknowledged one
+                acked[published] = true;
+                ids[published] = 0;
+                ++published;
+                continue;
+            }
+            ++published;
+            ++in_flight;
+        }
+        if (!ok)
+        {
+            break;
+        }
+        if (in_flight == 0)
+        {
+            // the rest was dropped, nothing to wait for
+            continue;
+        }
+
+        uint8_t header;
+        uint8_t body[8];
+        size_t len;
+        if (!readPacket(header, body, sizeof(body), len, ACK_TIMEOUT_MS))
+        {
+            failure = connection.client().connected() ? FailureClass::TIMEOUT : FailureClass::CONNECT;
+            ok = false;
+            break;
+        }
+
+        const uint8_t type = header >> 4;
+        if (type == TYPE_DISCONNECT)
+        {
+            LOG_W("[MQTT] %s: disconnected by the broker, reason 0x%02x", url, len > 0 ? body[0] : 0);
+            ok = false;
+            break;
+        }
+        if (type != TYPE_PUBACK || len < 2)
+        {
+            continue;
+        }
+
+        const uint16_t packet_id = getU16(body);
+        const uint8_t reason = len > 2 ? body[2] : 0;
+        for (size_t idx = 0; idx < published; ++idx)
+        {
+            if (ids[idx] == packet_id && !acked[idx])
+            {
+                // a refused one is done with as well, but is sent again after the back-off
+                acked[idx] = reason < REASON_ERROR;
+                ids[idx] = 0;
+                --in_flight;
+                break;
+            }
+        }
+        if (reason >= REASON_ERROR)
+        {
+            LOG_W("[MQTT] %s: publish refused, reason 0x%02x", url, reason);
+            failure = FailureClass::HTTP_4XX;
+            refused = true;
+        }
+    }
+
+    // the acknowledged ones from the start are done, the rest goes out again
+    while (count < published && acked[count])
+    {
+        ++count;
+    }
+
+    // what the broker may hold for the session, ids of acknowledged ones were cleared
+    unackedCount = 0;
+    if (!ok)
+    {
+        for (size_t idx = count; idx < published; ++idx)
+        {
+            if (ids[idx] != 0)
+            {
+                unacked[unackedCount++] = {samples[idx], ids[idx]};
+            }
+        }
+        disconnect();
+    }
+
+    return ok && !refused;
+}
+
+uint16_t MqttSink::packetIdFor(const FisSample *sample, bool &dup)
+{
+    dup = false;
+    if (sessionPresent)
+    {
+        for (size_t idx = 0; idx < unackedCount; ++idx)
+        {
+            if (unacked[idx].sample == sample)
+            {
+                dup = true;
+                return unacked[idx].packetId;
+            }
+        }
+    }
+
+    // 0 is no packet id, the ids still unacknowledged are far behind
+    const uint16_t packet_id = nextPacketId;
+    nextPacketId = nextPacketId == UINT16_MAX ? 1 : nextPacketId + 1;
+    return packet_id;
+}
+
+bool MqttSink::connect(FailureClass &failure)
+{
+    TlsClient &client = connection.client();
+    if (!client.connect(parts.host, parts.port))
+    {
+        failure = classifyFailure(HTTPC_ERROR_CONNECTION_REFUSED, client);
+        return false;
+    }
+
+    const bool with_password = password[0] != '\0';
+    uint8_t packet[HEADER_ROOM + 32 + 2 * sizeof(clientId) + MAX_PASSWORD_LEN];
+    uint8_t *body = packet + HEADER_ROOM;
+    size_t pos = 0;
+
+    pos += putString(body + pos, "MQTT", 4);
+    body[pos++] = PROTOCOL_VERSION;
+    // Clean Start stays 0, the broker keeps the session for SESSION_EXPIRY_S
+    body[pos++] = with_password ? CONNECT_USERNAME | CONNECT_PASSWORD : 0;
+    pos += putU16(body + pos, KEEP_ALIVE_S);
+    body[pos++] = 5;
+    body[pos++] = PROPERTY_SESSION_EXPIRY;
+    pos += putU32(body + pos, SESSION_EXPIRY_S);
+
+    pos += putString(body + pos, clientId, strlen(clientId));
+    if (with_password)
+    {
+        pos += putString(body + pos, clientId, strlen(clientId));
+        pos += putString(body + pos, password, strlen(password));
+    }
+
+    uint8_t header;
+    uint8_t answer[64];
+    size_t len;
+    if (!writePacket(TYPE_CONNECT << 4, packet, pos) || !readPacket(header, answer, sizeof(answer), len, ACK_TIMEOUT_MS))
+    {
+        failure = client.connected() ? FailureClass::TIMEOUT : FailureClass::CONNECT;
+        connection.countFailure();
+        return false;
+    }
+
+    if (header >> 4 != TYPE_CONNACK || len < 2 || answer[1] != 0)
+    {
+        const uint8_t reason = len >= 2 ? answer[1] : 0;
+        LOG_W("[MQTT] %s: connect refused, reason 0x%02x", url, reason);
+        // not authorized, a bad user name or password or a banned client are not going to change
+        // soon, a server that is busy or unavailable may
+        failure = reason == 0x87 || reason == 0x86 || reason == 0x8a || reason == 0x85 ? FailureClass::HTTP_4XX
+                  : reason == 0x88 || reason == 0x89                                     ? FailureClass::HTTP_5XX
+                                                                                         : FailureClass::BAD_RESPONSE;
+        connection.countFailure();
+        return false;
+    }
+
+    sessionPresent = answer[0] & 0x01;
+    window = MAX_IN_FLIGHT;
+    useAlias = false;
+    aliasSet = false;
+    maxPacketSize = UINT32_MAX;
+    keepAliveS = KEEP_ALIVE_S;
+
+    size_t prop_pos = 2;
+    uint32_t props_len;
+    if (getVarint(answer, len, prop_pos, props_len))
+    {
+        const size_t end = std::min(len, prop_pos + props_len);
+        while (prop_pos < end)
+        {
+            const uint8_t id = answer[prop_pos++];
+            const bool fits_u16 = prop_pos + 2 <= end;
+            const bool fits_u32 = prop_pos + 4 <= end;
+            if (id == PROPERTY_RECEIVE_MAXIMUM && fits_u16)
+            {
+                window = std::max<uint16_t>(std::min(MAX_IN_FLIGHT, getU16(answer + prop_pos)), 1);
+            }
+            else if (id == PROPERTY_TOPIC_ALIAS_MAXIMUM && fits_u16)
+            {
+                useAlias = getU16(answer + prop_pos) >= TOPIC_ALIAS;
+            }
+            else if (id == PROPERTY_SERVER_KEEP_ALIVE && fits_u16)
+            {
+                keepAliveS = getU16(answer + prop_pos);
+            }
+            else if (id == PROPERTY_MAXIMUM_PACKET_SIZE && fits_u32)
+            {
+                maxPacketSize = getU32(answer + prop_pos);
+            }
+
+            if (!skipProperty(id, answer, end, prop_pos))
+            {
+                break;
+            }
+        }
+    }
+
+    // without the session the broker has no publishes to complete
+    if (!sessionPresent)
+    {
+        unackedCount = 0;
+    }
+
+    connected = true;
+    if (keepAliveS > 0)
+    {
+        pingDeadline.start(keepAliveS * 500);
+    }
+    else
+    {
+        pingDeadline.stop();
+    }
+
+    LOG_I("[MQTT] %s: connected as %s, session %s, %u in flight, topic alias %s, %u to complete", url, clientId,
+          sessionPresent ? "resumed" : "new", window, useAlias ? "on" : "off", static_cast<unsigned>(unackedCount));
+    return true;
+}
+
+void MqttSink::disconnect()
+{
+    if (connected)
+    {
+        connected = false;
+        connection.countFailure();
+    }
+}
+
+MqttSink::Published MqttSink::publish(const FisSample &sample, uint16_t packetId, bool dup)
+{
+    uint8_t packet[HEADER_ROOM + MAX_PACKET];
+    uint8_t *body = packet + HEADER_ROOM;
+    size_t pos = 0;
+
+    // the topic once per connection, after that the alias stands in for it
+    const bool alias_only = useAlias && aliasSet;
+    pos += putString(body, topic, alias_only ? 0 : strlen(topic));
+    pos += putU16(body + pos, packetId);
+    if (useAlias)
+    {
+        body[pos++] = 3;
+        body[pos++] = PROPERTY_TOPIC_ALIAS;
+        pos += putU16(body + pos, TOPIC_ALIAS);
+    }
+    else
+    {
+        body[pos++] = 0;
+    }
+
+    const size_t len = formatSampleCbor(sample, body + pos, MAX_PACKET - pos);
+    if (len == 0 || pos + len + HEADER_ROOM > maxPacketSize)
+    {
+        LOG_W("[MQTT] %s: a sample does not fit into a packet, dropped", url);
+        return Published::TOO_LARGE;
+    }
+    pos += len;
+
+    if (!writePacket(TYPE_PUBLISH << 4 | PUBLISH_QOS1 | (dup ? PUBLISH_DUP : 0), packet, pos))
+    {
+        return Published::FAILED;
+    }
+
+    aliasSet = useAlias;
+    if (keepAliveS > 0)
+    {
+        pingDeadline.start(keepAliveS * 500);
+    }
+    return Published::SENT;
+}
+
+bool MqttSink::writePacket(uint8_t header, uint8_t *packet, size_t len)
+{
+    // the fixed header goes right in front of the body, so the packet is one TLS record
+    uint8_t length[4];
+    size_t length_len = 0;
+    size_t remaining = len;
+    do
+    {
+        length[length_len] = remaining & 0x7f;
+        remaining >>= 7;
+        if (remaining > 0)
+        {
+            length[length_len] |= 0x80;
+        }
+        ++length_len;
+    } while (remaining > 0 && length_len < sizeof(length));
+
+    uint8_t *start = packet + HEADER_ROOM - 1 - length_len;
+    start[0] = header;
+    memcpy(start + 1, length, length_len);
+
+    const size_t total = 1 + length_len + len;
+    return connection.client().write(start, total) == total;
+}
+
+bool MqttSink::readPacket(uint8_t &header, uint8_t *body, size_t capacity, size_t &len, uint32_t timeoutMs)
+{
+    Deadline deadline;
+    deadline.start(timeoutMs);
+
+    if (!readBytes(&header, 1, deadline))
+    {
+        return false;
+    }
+
+    uint32_t remaining = 0;
+    for (uint8_t shift = 0;; shift += 7)
+    {
+        uint8_t byte;
+        if (shift > 21 || !readBytes(&byte, 1, deadline))
+        {
+            return false;
+        }
+        remaining |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            break;
+        }
+    }
+
+    len = std::min<size_t>(remaining, capacity);
+    if (!readBytes(body, len, deadline))
+    {
+        return false;
+    }
+
+    // what does not fit is not needed
+    for (uint32_t skipped = len; skipped < remaining; ++skipped)
+    {
+        uint8_t byte;
+        if (!readBytes(&byte, 1, deadline))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool MqttSink::readBytes(uint8_t *buf, size_t len, const Deadline &deadline)
+{
+    TlsClient &client = connection.client();
+    size_t got = 0;
+    while (got < len)
+    {
+        if (client.available() <= 0 && !client.waitForData(deadline.remainingMs()))
+        {
+            return false;
+        }
+
+        const int read = client.read(buf + got, len - got);
+        if (read <= 0)
+        {
+            return false;
+        }
+        got += read;
+    }
+
+    return true;
+}
+
+uint32_t MqttSink::maintenanceMs() const
+{
+    return connected ? pingDeadline.remainingMs() : UINT32_MAX;
+}
+
+void MqttSink::maintain()
+{
+    if (!connected)
+    {
+        return;
+    }
+
+    TlsClient &client = connection.client();
+    if (!client.connected())
+    {
+        LOG_I("[MQTT] %s: connection closed", url);
+        disconnect();
+        return;
+    }
+
+    // nothing comes unasked but a DISCONNECT of the broker
+    uint8_t header;
+    uint8_t body[8];
+    size_t len;
+    if (client.available() > 0)
+    {
+        if (!readPacket(header, body, sizeof(body), len, ACK_TIMEOUT_MS) || header >> 4 == TYPE_DISCONNECT)
+        {
+            LOG_W("[MQTT] %s: disconnected by the broker", url);
+            disconnect();
+            return;
+        }
+    }
+
+    if (!pingDeadline.expired())
+    {
+        return;
+    }
+
+    const int64_t sent = Deadline::now();
+    uint8_t ping[HEADER_ROOM];
+    if (!writePacket(TYPE_PINGREQ << 4, ping, 0))
+    {
+        disconnect();
+        return;
+    }
+
+    do
+    {
+        if (!readPacket(header, body, sizeof(body), len, ACK_TIMEOUT_MS) || header >> 4 == TYPE_DISCONNECT)
+        {
+            LOG_W("[MQTT] %s: no answer to the ping", url);
+            disconnect();
+            return;
+        }
+    } while (header >> 4 != TYPE_PINGRESP);
+
+    LOG_D("[MQTT] %s: ping %u ms", url, Deadline::msSince(sent));
+    pingDeadline.start(keepAliveS * 500);
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "deadline.h"
+#include "host_connection.h"
+#include "sink.h"
+#include "upload_stream.h"
+
+// Publishes every sample to an MQTT 5 broker, mqtts://host[:port]/topic, as a QoS 1 PUBLISH of
+// its formatSampleCbor() record, over one TLS connection that stays open. Instead of an HTTP
+// request and response, a sample costs its record and about ten bytes of framing:
+//
+// - the topic goes over the wire once per connection, then a topic alias stands in for it, if
+//   the broker allows aliases (Topic Alias Maximum)
+// - up to MAX_IN_FLIGHT publishes wait for their PUBACK at a time, at most as many as the
+//   Receive Maximum of the broker
+// - the client connects with Clean Start 0 and a session expiry, so after a reconnect the broker
+//   still knows which publishes it acknowledged. The unacknowledged ones go out again with DUP
+//   and their packet ids, as the protocol asks. The TLS session is resumed as well, see
+//   TlsClient.
+// - a PINGREQ keeps the connection open while no sample comes
+//
+// The client id is derived from the MAC, the password is the API key of the endpoint.
+class MqttSink : public Sink
+{
+public:
+    static constexpr size_t BATCH_MAX_SAMPLES = Sink::MAX_BATCH; // a backlog goes out in windows
+    static constexpr uint32_t BATCH_MAX_AGE_MS = 0;                // a sample right away
+    static constexpr uint32_t STACK_SIZE = 8192;                   // a TLS handshake
+
+    static constexpr uint16_t KEEP_ALIVE_S = 120;
+    static constexpr uint32_t SESSION_EXPIRY_S = 3600;
+    static constexpr uint16_t MAX_IN_FLIGHT = 4;
+    static constexpr uint32_t ACK_TIMEOUT_MS = 5000;
+    static constexpr size_t MAX_PACKET = 928; // the largest record, a topic of 128 bytes and the rest of the PUBLISH
+
+    // url and password have to stay valid
+    MqttSink(const char *url, const char *password, bool verify);
+
+protected:
+    bool send(const FisSample *const *samples, size_t &count, FailureClass &failure) override;
+    uint32_t maintenanceMs() const override;
+    void maintain() override;
+
+private:
+    // a publish of an earlier connection the broker did not acknowledge
+    struct Unacked
+    {
+        const FisSample *sample;
+        uint16_t packetId;
+    };
+
+    enum class Published
+    {
+        SENT,
+        TOO_LARGE, // for MAX_PACKET or the Maximum Packet Size of the broker, nothing was sent
+        FAILED,
+    };
+
+    bool connect(FailureClass &failure);
+    void disconnect();
+    Published publish(const FisSample &sample, uint16_t packetId, bool dup);
+    uint16_t packetIdFor(const FisSample *sample, bool &dup);
+    // packet starts with room for the fixed header, the len bytes of the body follow it
+    bool writePacket(uint8_t header, uint8_t *packet, size_t len);
+    // the next packet, bodies longer than capacity are cut off, false on a timeout
+    bool readPacket(uint8_t &header, uint8_t *body, size_t capacity, size_t &len, uint32_t timeoutMs);
+    bool readBytes(uint8_t *buf, size_t len, const Deadline &deadline);
+
+    const char *url;
+    const char *password;
+    UrlParts parts;
+    const char *topic{""};
+    bool valid{false};
+    char clientId[24]{};
+    HostConnection connection;
+
+    // of the current connection
+    bool connected{false};
+    bool sessionPresent{false};
+    uint16_t window{MAX_IN_FLIGHT};
+    bool useAlias{false};
+    bool aliasSet{false};
+    uint32_t maxPacketSize{UINT32_MAX};
+    uint16_t keepAliveS{KEEP_ALIVE_S};
+    Deadline pingDeadline;
+
+    uint16_t nextPacketId{1};
+    Unacked unacked[Sink::MAX_BATCH]{};
+    size_t unackedCount{0};
+};
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <array>
+#include <string_view>
+
+#include <Arduino.h>
+
+// Aho-Corasick automaton over a fixed set of patterns, built at compile time. step() feeds one
+// byte and reports the pattern that ends with it, so a text is searched for all patterns at once
+// by looking at every byte exactly once. The input is mapped to classes first, one per distinct
+// byte of the patterns plus one for all other bytes, which keeps the transition table small
+// enough for flash.
+//
+// No pattern may be a suffix of another one, only the longest match ending at a byte is reported.
+template <size_t PATTERNS, size_t STATES, size_t CLASSES>
+class MultiPatternMatcher
+{
+public:
+    static_assert(STATES <= 256, "a state has to fit into a uint8_t");
+    static_assert(CLASSES <= 256, "a class has to fit into a uint8_t");
+    static_assert(PATTERNS <= 127, "a pattern index has to fit into an int8_t");
+
+    static constexpr int8_t NO_MATCH = -1;
+
+    constexpr explicit MultiPatternMatcher(const std::array<std::string_view, PATTERNS> &patterns)
+    {
+        uint8_t class_count = 1;
+        for (const std::string_view &pattern : patterns)
+        {
+            for (const char c : pattern)
+            {
+                uint8_t &byte_class = classes[static_cast<uint8_t>(c)];
+                if (byte_class == 0)
+                {
+                    byte_class = class_count++;
+                }
+            }
+        }
+
+        for (int8_t &state_output : output)
+        {
+            state_output = NO_MATCH;
+        }
+
+        // the trie, a transition to state 0 means there is none yet
+        uint8_t state_count = 1;
+        for (size_t idx = 0; idx < PATTERNS; ++idx)
+        {
+            uint8_t state = 0;
+            for (const char c : patterns[idx])
+            {
+                uint8_t &child = next[state][classes[static_cast<uint8_t>(c)]];
+                if (child == 0)
+                {
+                    child = state_count++;
+                }
+                state = child;
+            }
+            output[state] = static_cast<int8_t>(idx);
+        }
+
+        // breadth first, the missing transitions of a state are those of its failure state
+        std::array<uint8_t, STATES> fail{};
+        std::array<uint8_t, STATES> queue{};
+        size_t head = 0;
+        size_t tail = 0;
+        queue[tail++] = 0;
+
+        while (head < tail)
+        {
+            const uint8_t state = queue[head++];
+
+            for (size_t byte_class = 0; byte_class < CLASSES; ++byte_class)
+            {
+                const uint8_t child = next[state][byte_class];
+                const uint8_t fallback = state == 0 ? 0 : next[fail[state]][byte_class];
+
+                if (child == 0)
+                {
+                    next[state][byte_class] = fallback;
+                    continue;
+                }
+
+                fail[child] = fallback;
+                if (output[child] == NO_MATCH)
+                {
+                    output[child] = output[fallback];
+                }
+                queue[tail++] = child;
+            }
+        }
+    }
+
+    // advances state by c, returns the index of the pattern that ends with c or NO_MATCH
+    int8_t step(uint8_t &state, char c) const
+    {
+        state = next[state][classes[static_cast<uint8_t>(c)]];
+        return output[state];
+    }
+
+private:
+    std::array<uint8_t, 256> classes{};
+    std::array<std::array<uint8_t, CLASSES>, STATES> next{};
+    std::array<int8_t, STATES> output{};
+};
+
+// a state per pattern byte plus the root
+template <size_t PATTERNS>
+constexpr size_t matcherStates(const std::array<std::string_view, PATTERNS> &patterns)
+{
+    size_t states = 1;
+    for (const std::string_view &pattern : patterns)
+    {
+        states += pattern.size();
+    }
+    return states;
+}
+
+// a class per distinct pattern byte plus the one for all other bytes
+template <size_t PATTERNS>
+constexpr size_t matcherClasses(const std::array<std::string_view, PATTERNS> &patterns)
+{
+    std::array<bool, 256> seen{};
+    size_t classes = 1;
+    for (const std::string_view &pattern : patterns)
+    {
+        for (const char c : pattern)
+        {
+            bool &byte_seen = seen[static_cast<uint8_t>(c)];
+            if (!byte_seen)
+            {
+                byte_seen = true;
+                ++classes;
+            }
+        }
+    }
+    return classes;
+}
@@ -0,0 +1,141 @@
+#include "poll_scheduler.h"
+
+#include "logger.h"
+
+namespace
+{
+uint32_t toMs(int64_t us)
+{
+    return us > 0 ? static_cast<uint32_t>((us + 999) / 1000) : 0;
+}
+} // namespace
+
+PollScheduler::PollScheduler(uint32_t minMs, uint32_t maxMs, uint32_t startMs, uint32_t budgetPerHour)
+    : minMs{minMs},
+      maxMs{maxMs},
+      budgetPerHour{std::max<uint32_t>(budgetPerHour, 1)},
+      bucketCapacity{std::max<uint32_t>(budgetPerHour / 10, 1) * TOKEN},
+      intervalMs{std::min(std::max(startMs, minMs), maxMs)},
+      tokens{bucketCapacity}
+{
+}
+
+bool PollScheduler::due()
+{
+    const int64_t now = Deadline::now();
+    const int64_t interval = static_cast<int64_t>(intervalMs) * 1000;
+    refill(now);
+
+    int64_t at = now;
+    if (started)
+    {
+        at = lastDue + interval;
+        if (now < at)
+        {
+            return false;
+        }
+    }
+
+    if (tokens < TOKEN)
+    {
+        if (!throttled)
+        {
+            throttled = true;
+            ++throttledCount;
+        }
+        return false;
+    }
+
+    tokens -= TOKEN;
+    throttled = false;
+    ++fetchCount;
+
+    // keep the cadence, but don't try to catch up after a stall
+    lastDue = started && now - at < interval ? at : now;
+    started = true;
+    return true;
+}
+
+uint32_t PollScheduler::remainingMs() const
+{
+    const int64_t now = Deadline::now();
+
+    // an empty bucket holds the fetch back until the next whole request has been refilled,
+    // counted from lastRefill, like refill() does
+    int64_t remaining = 0;
+    if (tokens < TOKEN)
+    {
+        const int64_t refill_us = (static_cast<int64_t>(TOKEN - tokens) * US_PER_TOKEN_HOUR + budgetPerHour - 1) /
+                                  budgetPerHour;
+        remaining = lastRefill + refill_us - now;
+    }
+
+    if (started)
+    {
+        remaining = std::max(remaining, lastDue + static_cast<int64_t>(intervalMs) * 1000 - now);
+    }
+
+    return toMs(remaining);
+}
+
+void PollScheduler::fetched()
+{
+    const int64_t now = Deadline::now();
+    refill(now);
+    tokens -= std::min(tokens, TOKEN);
+    ++fetchCount;
+
+    lastDue = now;
+    started = true;
+}
+
+void PollScheduler::observe(const FisSnapshot &snapshot)
+{
+    if (haveSnapshot)
+    {
+        uint8_t changed = 0;
+        for (size_t idx = 0; idx < FIS_FIELD_COUNT; ++idx)
+        {
+            changed += snapshot.values[idx] != lastSnapshot.values[idx];
+        }
+        adapt(changed);
+    }
+
+    lastSnapshot = snapshot;
+    haveSnapshot = true;
+}
+
+void PollScheduler::adapt(uint8_t changedFields)
+{
+    if (changedFields >= FAST_CHANGES)
+    {
+        intervalMs = std::max(minMs, intervalMs / 2);
+    }
+    else if (changedFields == 0)
+    {
+        intervalMs = std::min(maxMs, intervalMs + intervalMs / 2);
+    }
+}
+
+void PollScheduler::refill(int64_t now)
+{
+    const uint64_t amount = (now - lastRefill) * budgetPerHour / US_PER_TOKEN_HOUR;
+    if (amount == 0)
+    {
+        return;
+    }
+
+    // only the time that was turned into tokens, the rest counts towards the next ones
+    lastRefill += amount * US_PER_TOKEN_HOUR / budgetPerHour;
+    tokens = static_cast<uint32_t>(std::min<uint64_t>(bucketCapacity, tokens + amount));
+}
+
+void PollScheduler::printStats() const
+{
+    LOG_I("[POLL] interval %u ms, %u fetches, %u times over budget, %u.%u requests in the bucket",
+          intervalMs,
+          fetchCount,
+          throttledCount,
+          tokens / TOKEN,
+          (tokens % TOKEN) / 100);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "deadline.h"
+#include "fis_extractor.h"
+
+// Decides when combined.json is fetched next. The interval halves while the snapshots keep
+// changing (the train is moving, the position changes with every fetch) and grows by half while
+// nothing changes, between minMs and maxMs. A token bucket holds the average to budgetPerHour
+// requests, with bursts of up to a tenth of that.
+//
+// The deadlines are absolute, on the Deadline clock: the next one is the last one plus the
+// interval, no matter how long the fetch took, so the samples stay evenly spaced.
+class PollScheduler
+{
+public:
+    // this many changed fields count as moving
+    static constexpr uint8_t FAST_CHANGES = 2;
+
+    PollScheduler(uint32_t minMs, uint32_t maxMs, uint32_t startMs, uint32_t budgetPerHour);
+
+    // true if a fetch is due now, it is counted as made
+    bool due();
+
+    // until the next fetch is due and the budget allows it, 0 if it is now
+    uint32_t remainingMs() const;
+
+    // a fetch was made now without asking due(), the next one is planned from it
+    void fetched();
+
+    // the snapshot a fetch returned
+    void observe(const FisSnapshot &snapshot);
+
+    // the fetch found combined.json unchanged
+    void observeUnchanged() { adapt(0); }
+
+    uint32_t interval() const { return intervalMs; }
+
+    void printStats() const;
+
+private:
+    static constexpr uint32_t TOKEN = 1000; // one request
+    // a thousandth of a request takes this long to refill at budgetPerHour 1
+    static constexpr int64_t US_PER_TOKEN_HOUR = 3600LL * 1000 * 1000 / TOKEN;
+
+    void adapt(uint8_t changedFields);
+    void refill(int64_t now);
+
+    const uint32_t minMs;
+    const uint32_t maxMs;
+    const uint32_t budgetPerHour;
+    const uint32_t bucketCapacity; // in thousandths of a request
+
+    uint32_t intervalMs;
+    int64_t lastDue{0}; // when the last fetch was due, the next one is intervalMs later
+    bool started{false};
+    bool throttled{false};
+
+    uint32_t tokens;
+    int64_t lastRefill{0};
+
+    FisSnapshot lastSnapshot;
+    bool haveSnapshot{false};
+
+    uint32_t fetchCount{0};
+    uint32_t throttledCount{0};
+};
@@ -0,0 +1,196 @@
+#include "portal_parser.h"
+
+#include "deadline.h"
+#include "logger.h"
+#include "metrics.h"
+#include "multi_pattern_matcher.h"
+
+namespace
+{
+enum Pattern : int8_t
+{
+    SEARCH_STRING,
+    TOKEN_FIELD_ID,
+    CEID_FIELD_ID,
+    CHECKIT_FIELD_ID,
+    FORMTYPE_FIELD_ID,
+    VALUE_FIELD_BEGINNING,
+    FORM_END
+};
+
+// in the order of Pattern
+constexpr std::array<std::string_view, 7> PORTAL_PATTERNS{{
+    "action=\"https://railnet.oebb.at/",
+    "name=\"_token\"",
+    "name=\"_ceid\"",
+    "name=\"checkit\"",
+    "name=\"form_type\"",
+    "value=\"",
+    "</form>",
+}};
+
+constexpr MultiPatternMatcher<PORTAL_PATTERNS.size(),
+                              matcherStates(PORTAL_PATTERNS),
+                              matcherClasses(PORTAL_PATTERNS)>
+    PORTAL_MATCHER{PORTAL_PATTERNS};
+} // namespace
+
+void PortalFormParser::reset()
+{
+    parserState = ParserState::PARSER_INIT;
+    formInformation.clear();
+    matcherState = 0;
+    tagField = nullptr;
+    tagValue = {};
+    capturing = false;
+    valueOverflow = false;
+}
+
+void PortalFormParser::restore(const FormInformation &form)
+{
+    reset();
+    formInformation = form;
+    parserState = ParserState::DONE;
+}
+
+bool PortalFormParser::parse(const char *buf, size_t len)
+{
+    const int64_t started = Deadline::now();
+
+    size_t pos = 0;
+    for (; pos < len && !finished(); ++pos)
+    {
+        const char c = buf[pos];
+
+        if (capturing)
+        {
+            captureValue(c);
+            continue;
+        }
+
+        if (c == '<')
+        {
+            // a new tag, whatever the last one had does not belong to it
+            tagField = nullptr;
+            tagValue = {};
+        }
+        else if (c == '>')
+        {
+            endTag();
+        }
+
+        const int8_t pattern = PORTAL_MATCHER.step(matcherState, c);
+        if (pattern != PORTAL_MATCHER.NO_MATCH)
+        {
+            onPattern(pattern);
+        }
+    }
+
+    countParsed(Parser::PORTAL, pos, static_cast<uint32_t>(Deadline::now() - started));
+    return parserState == ParserState::DONE;
+}
+
+void PortalFormParser::onPattern(int8_t pattern)
+{
+    switch (pattern)
+    {
+    case Pattern::SEARCH_STRING:
+        if (parserState == ParserState::PARSER_INIT)
+        {
+            LOG_D("Found form beginning");
+            setState(ParserState::FORM_FOUND);
+        }
+        break;
+    case Pattern::TOKEN_FIELD_ID:
+        tagField = &formInformation._token;
+        break;
+    case Pattern::CEID_FIELD_ID:
+        tagField = &formInformation._ceid;
+        break;
+    case Pattern::CHECKIT_FIELD_ID:
+        tagField = &formInformation.checkit;
+        break;
+    case Pattern::FORMTYPE_FIELD_ID:
+        tagField = &formInformation.form_type;
+        break;
+    case Pattern::VALUE_FIELD_BEGINNING:
+        tagValue = {};
+        capturing = true;
+        valueOverflow = false;
+        break;
+    case Pattern::FORM_END:
+        if (parserState == ParserState::FORM_FOUND)
+        {
+            LOG_W("Form ended before all values were found");
+            setState(ParserState::FORM_ENDED);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void PortalFormParser::captureValue(char c)
+{
+    if (c != '"')
+    {
+        if (static_cast<size_t>(tagValue.len) + 1 < FormValue::CAPACITY)
+        {
+            tagValue.text[tagValue.len++] = c;
+        }
+        else
+        {
+            valueOverflow = true;
+        }
+        return;
+    }
+
+    capturing = false;
+    // the matcher restarts behind the value, nothing inside the quotes can end a pattern
+    matcherState = 0;
+
+    if (valueOverflow)
+    {
+        // a cut off value would only get the login rejected, leave it missing
+        LOG_W("Form value too long, ignoring it");
+        tagValue = {};
+        return;
+    }
+
+    tagValue.text[tagValue.len] = '\0';
+    tagValue.present = true;
+}
+
+void PortalFormParser::endTag()
+{
+    FormValue *field = tagField;
+    tagField = nullptr;
+
+    // fields before the login form belong to some other form, the first value of a field wins
+    if (parserState != ParserState::FORM_FOUND || !field || field->present || !tagValue.present)
+    {
+        return;
+    }
+
+    *field = tagValue;
+    LOG_D("Found value: %s", field->text);
+
+    if (formInformation.complete())
+    {
+        setState(ParserState::DONE);
+        LOG_D("Form parsing done:\n_token: %s\n_ceid: %s\ncheckit: %s\nform_type: %s",
+              formInformation._token.c_str(),
+              formInformation._ceid.c_str(),
+              formInformation.checkit.c_str(),
+              formInformation.form_type.c_str());
+    }
+}
+
+void PortalFormParser::setState(ParserState newParserState)
+{
+    LOG_D("Parser state changed from %d to %d",
+          static_cast<uint8_t>(parserState),
+          static_cast<uint8_t>(newParserState));
+
+    parserState = newParserState;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <Arduino.h>
+
+enum ParserState : uint8_t
+{
+    PARSER_INIT, // 0, looking for the login form
+    FORM_FOUND,  // 1, collecting the field values
+    DONE,        // 2
+    FORM_ENDED   // 3, the form was closed before all values were found
+};
+
+// A form field value as it appears in the value="..." attribute.
+struct FormValue
+{
+    static constexpr size_t CAPACITY = 96;
+
+    char text[CAPACITY]{};
+    uint8_t len{0};
+    bool present{false};
+
+    const char *c_str() const { return text; }
+};
+
+struct FormInformation
+{
+    FormValue _token;
+    FormValue _ceid;
+    FormValue checkit;
+    FormValue form_type;
+
+    bool complete() const { return _token.present && _ceid.present && checkit.present && form_type.present; }
+    void clear() { *this = {}; }
+};
+
+// Finds the login form on the captive portal page and picks the values of its hidden fields.
+// All field IDs are searched for at once by a MultiPatternMatcher, every byte of the page is
+// looked at exactly once and the matcher state simply carries over from one chunk to the next.
+// A value="..." is assigned to the field named in the same tag, whichever attribute comes first.
+// Nothing is allocated.
+class PortalFormParser
+{
+public:
+    void reset();
+
+    // takes the values of an earlier login instead of parsing the page
+    void restore(const FormInformation &form);
+
+    // scans the next chunk of the page, returns true once all form values were found
+    bool parse(const char *buf, size_t len);
+
+    // nothing more can be found on the rest of the page
+    bool finished() const { return parserState == ParserState::DONE || parserState == ParserState::FORM_ENDED; }
+
+    ParserState state() const { return parserState; }
+    const FormInformation &form() const { return formInformation; }
+
+private:
+    void onPattern(int8_t pattern);
+    void captureValue(char c);
+    void endTag();
+    void setState(ParserState newParserState);
+
+    ParserState parserState{ParserState::PARSER_INIT};
+    FormInformation formInformation;
+
+    uint8_t matcherState{0};
+
+    // what was seen inside the current tag so far
+    FormValue *tagField{nullptr};
+    FormValue tagValue;
+    bool capturing{false};
+    bool valueOverflow{false};
+};
@@ -0,0 +1,103 @@
+#include "power_save.h"
+
+#include <atomic>
+
+#include <WiFi.h>
+#include <esp_pm.h>
+
+#include "deadline.h"
+#include "logger.h"
+
+namespace
+{
+// what the loop always waited, and still does without POWER_SAVE
+constexpr uint32_t POLL_MS = 10;
+// the longest sleep, the roamer, the heap soak and the link events are polled from the loop
+constexpr uint32_t MAX_IDLE_MS = 1000;
+
+#if POWER_SAVE
+// the APB clock of the Wi-Fi driver needs the full speed only while it holds its lock
+constexpr int MAX_CPU_MHZ = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
+constexpr int MIN_CPU_MHZ = 40; // the crystal
+#endif
+
+// only the loop task writes them
+int64_t wokeAt = 0;
+uint64_t awakeUs = 0;
+uint64_t idleUs = 0;
+uint64_t totalAwakeUs = 0;
+uint64_t totalIdleUs = 0;
+int64_t windowStart = 0;
+
+// for the metrics, which are rendered by the uploader
+std::atomic<uint32_t> lastAwakePermille{1000};
+
+bool lightSleep = false;
+
+uint32_t permille(uint64_t part, uint64_t whole)
+{
+    return whole > 0 ? static_cast<uint32_t>(part * 1000 / whole) : 1000;
+}
+} // namespace
+
+void powerBegin()
+{
+    wokeAt = Deadline::now();
+    windowStart = wokeAt;
+
+#if POWER_SAVE
+    // woken by every DTIM beacon, the AP buffers what arrives in between
+    WiFi.setSleep(WIFI_PS_MIN_MODEM);
+
+    esp_pm_config_esp32_t config = {};
+    config.max_freq_mhz = MAX_CPU_MHZ;
+    config.min_freq_mhz = MIN_CPU_MHZ;
+    config.light_sleep_enable = true;
+    const esp_err_t err = esp_pm_configure(&config);
+    if (err != ESP_OK)
+    {
+        // without CONFIG_PM_ENABLE, the modem sleep still works
+        LOG_W("[POWER] no light sleep: %s", esp_err_to_name(err));
+        return;
+    }
+
+    lightSleep = true;
+    LOG_I("[POWER] modem sleep, light sleep and %d to %d MHz", MIN_CPU_MHZ, MAX_CPU_MHZ);
+#else
+    WiFi.setSleep(false);
+#endif
+}
+
+void powerIdle(uint32_t ms)
+{
+    const int64_t now = Deadline::now();
+    awakeUs += now - wokeAt;
+
+    delay(POWER_SAVE ? std::min(std::max(ms, POLL_MS), MAX_IDLE_MS) : POLL_MS);
+
+    wokeAt = Deadline::now();
+    idleUs += wokeAt - now;
+}
+
+uint32_t powerAwakePermille()
+{
+    return lastAwakePermille.load(std::memory_order_relaxed);
+}
+
+void powerPrintStats()
+{
+    const uint32_t window_ms = Deadline::msSince(windowStart);
+    const uint32_t awake = permille(awakeUs, awakeUs + idleUs);
+    lastAwakePermille.store(awake, std::memory_order_relaxed);
+
+    totalAwakeUs += awakeUs;
+    totalIdleUs += idleUs;
+    const uint32_t total_awake = permille(totalAwakeUs, totalAwakeUs + totalIdleUs);
+
+    LOG_I("[POWER] loop awake %u.%u%% of the last %u ms, %u.%u%% since boot, %s", awake / 10, awake % 10, window_ms,
+          total_awake / 10, total_awake % 10, lightSleep ? "light sleep" : "no light sleep");
+
+    awakeUs = 0;
+    idleUs = 0;
+    windowStart = Deadline::now();
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <Arduino.h>
+
+// can be set from build_flags, e.g. -DPOWER_SAVE=1, see below
+#ifndef POWER_SAVE
+#define POWER_SAVE 0
+#endif
+
+// Between two fetches of combined.json the loop has nothing to do for seconds, but it used to
+// spin on a 10 ms delay with the modem sleep of the driver turned off, so radio and CPU never
+// left full power.
+//
+// With POWER_SAVE the modem sleeps between the DTIM beacons of the AP (WIFI_PS_MIN_MODEM),
+// the CPU clock drops to the crystal whenever no driver holds a lock, and the idle task goes
+// into automatic light sleep (CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE in
+// sdkconfig.esp32dev). powerIdle() then waits until the next deadline of the loop instead of
+// 10 ms, so the tick does not wake the chip for nothing.
+//
+// Without POWER_SAVE everything stays as it was. Either way the share of the time the loop
+// was awake is measured and reported as its duty cycle.
+
+// sets up the power management, after WiFi.mode()
+void powerBegin();
+
+// the loop has nothing to do for up to ms, returns once it may have again
+void powerIdle(uint32_t ms);
+
+// the share of the time the loop was awake, in permille, since the last powerPrintStats()
+uint32_t powerAwakePermille();
+
+void powerPrintStats();
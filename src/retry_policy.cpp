@@ -0,0 +1,138 @@
+#include "retry_policy.h"
+
+#include <algorithm>
+
+#include <HTTPClient.h>
+#include <esp_system.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+namespace
+{
+struct Backoff
+{
+    uint32_t baseMs;
+    uint32_t maxMs;
+};
+
+// by FailureClass
+constexpr Backoff BACKOFFS[] = {
+    {2000, 60000},   // DNS
+    {1000, 30000},   // CONNECT
+    {5000, 120000},  // TLS
+    {2000, 60000},   // TIMEOUT
+    {30000, 600000}, // HTTP_4XX
+    {5000, 300000},  // HTTP_5XX
+    {5000, 120000},  // BAD_RESPONSE
+};
+static_assert(sizeof(BACKOFFS) / sizeof(BACKOFFS[0]) == static_cast<size_t>(FailureClass::COUNT),
+              "one back-off per failure class");
+
+constexpr const char *const FAILURE_NAMES[] = {"dns", "connect", "tls", "timeout", "4xx", "5xx", "response"};
+
+// more doublings than that hit every maximum anyway
+constexpr uint8_t MAX_DOUBLINGS = 16;
+} // namespace
+
+FailureClass classifyFailure(int httpCode, const TlsClient &client)
+{
+    if (httpCode >= 500)
+    {
+        return FailureClass::HTTP_5XX;
+    }
+    if (httpCode >= 400)
+    {
+        return FailureClass::HTTP_4XX;
+    }
+    if (httpCode > 0)
+    {
+        return FailureClass::BAD_RESPONSE;
+    }
+    if (httpCode == HTTPC_ERROR_READ_TIMEOUT)
+    {
+        return FailureClass::TIMEOUT;
+    }
+
+    if (httpCode == HTTPC_ERROR_CONNECTION_REFUSED)
+    {
+        switch (client.connectFailure())
+        {
+        case TlsClient::ConnectFailure::DNS:
+            return FailureClass::DNS;
+        case TlsClient::ConnectFailure::TLS:
+            return FailureClass::TLS;
+        default:
+            break;
+        }
+    }
+    return FailureClass::CONNECT;
+}
+
+uint32_t RetryPolicy::failed(FailureClass failure)
+{
+    const size_t index = static_cast<size_t>(failure);
+    if (classFailures[index] < MAX_DOUBLINGS + 1)
+    {
+        ++classFailures[index];
+    }
+    ++failureCounts[index];
+    ++consecutiveFailures;
+    countRetry();
+
+    uint32_t delay_ms = backoffMs(failure);
+
+    if (consecutiveFailures >= BREAKER_THRESHOLD)
+    {
+        delay_ms = std::max(delay_ms, breakerOpenMs);
+        ++breakerTrips;
+        LOG_W("[RETRY] %s: %u failures in a row, circuit breaker open for %u s", name,
+              consecutiveFailures, delay_ms / 1000);
+        breakerOpenMs = std::min(breakerOpenMs * 2, BREAKER_MAX_OPEN_MS);
+    }
+    else
+    {
+        LOG_W("[RETRY] %s: %s failure, retrying in %u ms", name, FAILURE_NAMES[index], delay_ms);
+    }
+
+    retryDeadline.start(delay_ms);
+    return delay_ms;
+}
+
+void RetryPolicy::succeeded()
+{
+    if (consecutiveFailures >= BREAKER_THRESHOLD)
+    {
+        LOG_I("[RETRY] %s: reachable again, circuit breaker closed", name);
+    }
+
+    memset(classFailures, 0, sizeof(classFailures));
+    consecutiveFailures = 0;
+    breakerOpenMs = BREAKER_OPEN_MS;
+    retryDeadline.stop();
+}
+
+void RetryPolicy::printStats() const
+{
+    char counts[96];
+    size_t len = 0;
+    for (size_t idx = 0; idx < static_cast<size_t>(FailureClass::COUNT) && len < sizeof(counts); ++idx)
+    {
+        len += snprintf(counts + len, sizeof(counts) - len, " %s %u", FAILURE_NAMES[idx], failureCounts[idx]);
+    }
+
+    LOG_I("[RETRY] %s: %u failures in a row, breaker %s, tripped %u times, failures:%s", name,
+          consecutiveFailures, breakerOpen() ? "open" : "closed", breakerTrips, counts);
+}
+
+// the capped exponential delay, with a random part of up to half of it taken off
+uint32_t RetryPolicy::backoffMs(FailureClass failure) const
+{
+    const Backoff &backoff = BACKOFFS[static_cast<size_t>(failure)];
+    const uint8_t doublings = classFailures[static_cast<size_t>(failure)] - 1;
+
+    const uint64_t exponential = static_cast<uint64_t>(backoff.baseMs) << doublings;
+    const uint32_t capped = static_cast<uint32_t>(std::min<uint64_t>(exponential, backoff.maxMs));
+
+    return capped - esp_random() % (capped / 2 + 1);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "deadline.h"
+#include "tls_client.h"
+
+// why a request failed, each kind of failure backs off at its own pace
+enum class FailureClass : uint8_t
+{
+    DNS,          // the host name did not resolve, usually the uplink is not there yet
+    CONNECT,      // no TCP connection, or it broke during the request
+    TLS,          // the handshake failed
+    TIMEOUT,      // the server did not answer in time
+    HTTP_4XX,     // the server refused the request, sending it again soon rarely helps
+    HTTP_5XX,     // the server is in trouble
+    BAD_RESPONSE, // an answer, but not the one expected, like a portal page without the form
+    COUNT
+};
+
+// the failure class of the HTTP code or HTTPClient error a request to client ended with
+FailureClass classifyFailure(int httpCode, const TlsClient &client);
+
+// When the next request to one endpoint may be made. After the nth failure in a row of a class
+// the next attempt waits for the base delay of the class times 2^(n-1), capped at the maximum of
+// the class, of which a random half is taken off again, so devices that lost the same uplink
+// together do not all come back at the same moment.
+//
+// After BREAKER_THRESHOLD failures in a row, of any class, the circuit breaker opens and no
+// request is made for BREAKER_OPEN_MS. Then one request may go through. If it fails the
+// breaker opens again for twice as long, up to BREAKER_MAX_OPEN_MS, if it succeeds everything
+// is back to normal.
+class RetryPolicy
+{
+public:
+    static constexpr uint8_t BREAKER_THRESHOLD = 5;
+    static constexpr uint32_t BREAKER_OPEN_MS = 30000;
+    static constexpr uint32_t BREAKER_MAX_OPEN_MS = 600000;
+
+    explicit RetryPolicy(const char *name) : name{name} {}
+
+    // true if a request may be made now
+    bool ready() const { return !retryDeadline.pending() || retryDeadline.expired(); }
+
+    // until a request may be made, 0 if now
+    uint32_t remainingMs() const { return ready() ? 0 : retryDeadline.remainingMs(); }
+
+    // the request failed, returns how long to wait before the next one
+    uint32_t failed(FailureClass failure);
+
+    // the request succeeded, back-off and breaker are reset
+    void succeeded();
+
+    bool breakerOpen() const { return consecutiveFailures >= BREAKER_THRESHOLD && !ready(); }
+
+    void printStats() const;
+
+private:
+    uint32_t backoffMs(FailureClass failure) const;
+
+    const char *name;
+    Deadline retryDeadline;
+
+    uint8_t classFailures[static_cast<size_t>(FailureClass::COUNT)]{}; // in a row, per class
+    uint32_t consecutiveFailures{0};
+    uint32_t breakerOpenMs{BREAKER_OPEN_MS}; // how long the breaker opens for the next time
+
+    uint32_t failureCounts[static_cast<size_t>(FailureClass::COUNT)]{};
+    uint32_t breakerTrips{0};
+};
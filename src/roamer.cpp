@@ -0,0 +1,172 @@
+#include "roamer.h"
+
+#include <WiFi.h>
+
+#include "logger.h"
+
+void Roamer::poll()
+{
+    if (!link.up())
+    {
+        return;
+    }
+
+    if (scanning)
+    {
+        const int16_t found = WiFi.scanComplete();
+        if (found == WIFI_SCAN_RUNNING)
+        {
+            return;
+        }
+
+        scanning = false;
+        if (found >= 0)
+        {
+            pickCandidate(found);
+        }
+        WiFi.scanDelete();
+        return;
+    }
+
+    if (checkDeadline.pending() && !checkDeadline.expired())
+    {
+        return;
+    }
+    checkDeadline.advance(CHECK_INTERVAL_MS);
+
+    const int8_t rssi = WiFi.RSSI();
+    stats(WiFi.BSSID()).rssi = rssi;
+
+    if (rssi < RSSI_THRESHOLD_DBM && (!scanDeadline.pending() || scanDeadline.expired()))
+    {
+        startScan(rssi);
+    }
+}
+
+bool Roamer::handover()
+{
+    if (!candidateDeadline.pending() || !link.up())
+    {
+        return false;
+    }
+
+    const bool stale = candidateDeadline.expired();
+    candidateDeadline.stop();
+    if (stale)
+    {
+        return false;
+    }
+
+    LOG_I("[ROAM] handing over to %02x:%02x:%02x:%02x:%02x:%02x on channel %u, %d dBm", candidateBssid[0],
+          candidateBssid[1], candidateBssid[2], candidateBssid[3], candidateBssid[4], candidateBssid[5],
+          candidateChannel, candidateRssi);
+    ++handoverCount;
+    link.handover(candidateBssid, candidateChannel);
+    return true;
+}
+
+void Roamer::countRequest(uint32_t latencyMs, uint32_t bytes, uint32_t transferMs)
+{
+    if (!link.up())
+    {
+        return;
+    }
+
+    ApStats &ap = stats(WiFi.BSSID());
+    ++ap.requests;
+    ap.latencyMs += latencyMs;
+    ap.bytes += bytes;
+    ap.transferMs += transferMs;
+}
+
+void Roamer::printStats() const
+{
+    LOG_I("[ROAM] %u scans, %u handovers", scanCount, handoverCount);
+
+    for (size_t idx = 0; idx < apCount; ++idx)
+    {
+        const ApStats &ap = aps[idx];
+        const uint32_t latency_ms = ap.requests ? static_cast<uint32_t>(ap.latencyMs / ap.requests) : 0;
+        // bytes per ms are kB/s
+        const uint32_t throughput = ap.transferMs ? static_cast<uint32_t>(ap.bytes / ap.transferMs) : 0;
+        LOG_I("[ROAM] %02x:%02x:%02x:%02x:%02x:%02x: %d dBm, %u requests, %u ms latency, %u kB/s",
+              ap.bssid[0], ap.bssid[1], ap.bssid[2], ap.bssid[3], ap.bssid[4], ap.bssid[5], ap.rssi,
+              ap.requests, latency_ms, throughput);
+    }
+}
+
+void Roamer::startScan(int8_t rssi)
+{
+    scanDeadline.start(SCAN_INTERVAL_MS);
+
+    // only the channels of our SSID are of interest, the scan leaves the channel of the AP for
+    // SCAN_MS_PER_CHANNEL at a time, traffic waits meanwhile
+    if (WiFi.scanNetworks(true, false, false, SCAN_MS_PER_CHANNEL, 0, ssid) != WIFI_SCAN_RUNNING)
+    {
+        LOG_W("[ROAM] scan could not be started");
+        return;
+    }
+
+    LOG_I("[ROAM] RSSI %d dBm, scanning for a stronger access point", rssi);
+    scanning = true;
+    ++scanCount;
+}
+
+void Roamer::pickCandidate(int16_t found)
+{
+    const uint8_t *current = WiFi.BSSID();
+    const int8_t current_rssi = WiFi.RSSI();
+    int best = -1;
+
+    for (int16_t idx = 0; idx < found; ++idx)
+    {
+        const uint8_t *bssid = WiFi.BSSID(idx);
+        if (!WiFi.SSID(idx).equals(ssid) || memcmp(bssid, current, sizeof(candidateBssid)) == 0)
+        {
+            continue;
+        }
+
+        const int8_t rssi = WiFi.RSSI(idx);
+        stats(bssid).rssi = rssi;
+        if (best < 0 || rssi > WiFi.RSSI(best))
+        {
+            best = idx;
+        }
+    }
+
+    if (best < 0 || WiFi.RSSI(best) < current_rssi + HYSTERESIS_DB)
+    {
+        LOG_I("[ROAM] no access point stronger than %d dBm", current_rssi);
+        return;
+    }
+
+    memcpy(candidateBssid, WiFi.BSSID(best), sizeof(candidateBssid));
+    candidateChannel = WiFi.channel(best);
+    candidateRssi = WiFi.RSSI(best);
+    candidateDeadline.start(CANDIDATE_TTL_MS);
+}
+
+// the entry of bssid, a new one replaces the least recently used
+ApStats &Roamer::stats(const uint8_t *bssid)
+{
+    ApStats *oldest = &aps[0];
+
+    for (size_t idx = 0; idx < apCount; ++idx)
+    {
+        if (memcmp(aps[idx].bssid, bssid, sizeof(aps[idx].bssid)) == 0)
+        {
+            aps[idx].lastUsed = Deadline::now();
+            return aps[idx];
+        }
+        if (aps[idx].lastUsed < oldest->lastUsed)
+        {
+            oldest = &aps[idx];
+        }
+    }
+
+    ApStats &entry = apCount < MAX_APS ? aps[apCount++] : *oldest;
+    entry = ApStats{};
+    memcpy(entry.bssid, bssid, sizeof(entry.bssid));
+    entry.lastUsed = Deadline::now();
+    return entry;
+}
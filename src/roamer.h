@@ -0,0 +1,74 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "deadline.h"
+#include "wifi_link.h"
+
+// how the requests to Railnet went on one AP
+struct ApStats
+{
+    uint8_t bssid[6];
+    int8_t rssi;            // last seen, dBm
+    uint32_t requests;
+    uint64_t latencyMs;     // summed up, until the response headers
+    uint64_t bytes;         // received
+    uint64_t transferMs;    // the time the bytes took
+    int64_t lastUsed;       // on the Deadline clock, the least recently used entry makes room
+};
+
+// Moves the station to a stronger AP of the same SSID. The driver sticks with the AP it
+// joined, even when the wagon it is in is far away by now. While the RSSI is below
+// RSSI_THRESHOLD_DBM the SSID is scanned for in the background, at most every SCAN_INTERVAL_MS.
+// An AP that is HYSTERESIS_DB stronger than the current one becomes the candidate, and
+// handover() moves to it, between two poll cycles so no request is cut off.
+//
+// Latency and throughput of the requests are kept for the last MAX_APS APs.
+class Roamer
+{
+public:
+    static constexpr int8_t RSSI_THRESHOLD_DBM = -72;
+    static constexpr int8_t HYSTERESIS_DB = 8;
+    static constexpr uint32_t CHECK_INTERVAL_MS = 5000;
+    static constexpr uint32_t SCAN_INTERVAL_MS = 30000;
+    static constexpr uint32_t SCAN_MS_PER_CHANNEL = 120;
+    static constexpr uint32_t CANDIDATE_TTL_MS = 20000; // a scan result does not stay right for long
+    static constexpr size_t MAX_APS = 8;
+
+    Roamer(WifiLink &link, const char *ssid) : link{link}, ssid{ssid} {}
+
+    // call it from the loop while the link is up, checks the RSSI and runs the scans
+    void poll();
+
+    // moves to a better AP if a scan found one, returns true if the link is going down for it
+    bool handover();
+
+    // a request on the current AP took latencyMs until the response, and bytes more took
+    // transferMs
+    void countRequest(uint32_t latencyMs, uint32_t bytes, uint32_t transferMs);
+
+    void printStats() const;
+
+private:
+    void startScan(int8_t rssi);
+    void pickCandidate(int16_t found);
+    ApStats &stats(const uint8_t *bssid);
+
+    WifiLink &link;
+    const char *ssid;
+
+    Deadline checkDeadline;
+    Deadline scanDeadline; // until the next scan may start
+    bool scanning{false};
+
+    uint8_t candidateBssid[6]{};
+    uint8_t candidateChannel{0};
+    int8_t candidateRssi{0};
+    Deadline candidateDeadline; // running while there is a candidate
+
+    ApStats aps[MAX_APS]{};
+    size_t apCount{0};
+
+    uint32_t scanCount{0};
+    uint32_t handoverCount{0};
+};
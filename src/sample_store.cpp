@@ -0,0 +1,528 @@
+#include "sample_store.h"
+
+#include <algorithm>
+
+#include <esp_heap_caps.h>
+
+#include "cbor_writer.h"
+#include "logger.h"
+
+namespace
+{
+constexpr uint32_t SECTOR_MAGIC = 0x31534946; // "FIS1"
+constexpr uint16_t FIRST_RECORD = 8;          // behind the magic and the sequence number
+
+constexpr uint16_t RECORD_FREE = 0xFFFF;
+constexpr uint8_t RECORD_PENDING = 0xFF;
+constexpr uint8_t RECORD_UPLOADED = 0x00;
+
+// time, present and string masks, then a length byte and the text of every present value
+constexpr size_t MAX_PAYLOAD = 8 + FIS_FIELD_COUNT * FisValue::CAPACITY;
+
+static_assert(FIS_FIELD_COUNT <= 16, "the field masks are 16 bit");
+
+uint16_t recordSize(uint16_t payloadLen)
+{
+    // records stay 4 byte aligned
+    return (4 + payloadLen + 3) & ~3;
+}
+
+uint8_t checksum(const uint8_t *buf, size_t len)
+{
+    uint8_t check = 0x5A;
+    for (size_t idx = 0; idx < len; ++idx)
+    {
+        check = static_cast<uint8_t>((check << 1) | (check >> 7)) ^ buf[idx];
+    }
+    return check;
+}
+
+size_t encodeSample(const FisSample &sample, uint8_t *buf)
+{
+    uint16_t present = 0;
+    uint16_t strings = 0;
+    size_t pos = 8;
+
+    for (size_t idx = 0; idx < FIS_FIELD_COUNT; ++idx)
+    {
+        const FisValue &value = sample.snapshot.values[idx];
+        if (!value.present)
+        {
+            continue;
+        }
+
+        present |= 1 << idx;
+        if (value.isString)
+        {
+            strings |= 1 << idx;
+        }
+
+        buf[pos++] = value.len;
+        memcpy(buf + pos, value.text, value.len);
+        pos += value.len;
+    }
+
+    memcpy(buf, &sample.time, 4);
+    memcpy(buf + 4, &present, 2);
+    memcpy(buf + 6, &strings, 2);
+
+    return pos;
+}
+
+bool decodeSample(const uint8_t *buf, size_t len, FisSample &sample)
+{
+    if (len < 8)
+    {
+        return false;
+    }
+
+    uint16_t present;
+    uint16_t strings;
+    memcpy(&sample.time, buf, 4);
+    memcpy(&present, buf + 4, 2);
+    memcpy(&strings, buf + 6, 2);
+
+    sample.snapshot.clear();
+    size_t pos = 8;
+
+    for (size_t idx = 0; idx < FIS_FIELD_COUNT; ++idx)
+    {
+        if (!(present & (1 << idx)))
+        {
+            continue;
+        }
+
+        if (pos >= len || buf[pos] >= FisValue::CAPACITY || pos + 1 + buf[pos] > len)
+        {
+            return false;
+        }
+
+        FisValue &value = sample.snapshot.values[idx];
+        value.len = buf[pos++];
+        memcpy(value.text, buf + pos, value.len);
+        value.text[value.len] = '\0';
+        value.present = true;
+        value.isString = strings & (1 << idx);
+        pos += value.len;
+    }
+
+    return pos == len;
+}
+} // namespace
+
+size_t formatSample(const FisSample &sample, char *buf, size_t len)
+{
+    size_t pos = 0;
+    const auto append = [&](const char *format, auto... args) -> void
+    {
+        if (pos < len)
+        {
+            pos += snprintf(buf + pos, len - pos, format, args...);
+        }
+    };
+
+    if (sample.time != 0)
+    {
+        append("{\"ts\":%u,\"fields\":{", sample.time);
+    }
+    else
+    {
+        append("%s", "{\"ts\":null,\"fields\":{");
+    }
+
+    uint8_t field_count = 0;
+
+    for (size_t idx = 0; idx < FIS_FIELD_COUNT; ++idx)
+    {
+        const FisValue &value = sample.snapshot.values[idx];
+        if (!value.present)
+        {
+            continue;
+        }
+
+        append(value.isString ? "%s\"%s\":\"%s\"" : "%s\"%s\":%s",
+               field_count > 0 ? "," : "",
+               FIS_FIELDS[idx].name,
+               value.text);
+
+        ++field_count;
+    }
+
+    append("%s", "}}");
+
+    return pos < len ? pos : 0;
+}
+
+size_t formatSampleCbor(const FisSample &sample, uint8_t *buf, size_t len)
+{
+    CborWriter cbor(buf, len);
+
+    size_t field_count = 0;
+    for (const FisValue &value : sample.snapshot.values)
+    {
+        field_count += value.present;
+    }
+
+    cbor.map(2);
+    cbor.unsignedInt(KEY_TS);
+    if (sample.time != 0)
+    {
+        cbor.unsignedInt(sample.time);
+    }
+    else
+    {
+        cbor.null();
+    }
+
+    cbor.unsignedInt(KEY_FIELDS);
+    cbor.map(field_count);
+    for (size_t idx = 0; idx < FIS_FIELD_COUNT; ++idx)
+    {
+        const FisValue &value = sample.snapshot.values[idx];
+        if (value.present)
+        {
+            cbor.unsignedInt(idx);
+            cbor.fisValue(FIS_FIELDS[idx], value);
+        }
+    }
+
+    return cbor.overflow() ? 0 : cbor.size();
+}
+
+bool SampleStore::beginFlash(const char *partitionLabel)
+{
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partitionLabel);
+    if (!partition)
+    {
+        LOG_W("[STORE] partition %s not found", partitionLabel);
+        return false;
+    }
+
+    sectorCount = std::min<size_t>(partition->size / SECTOR_SIZE, UINT16_MAX);
+    if (sectorCount < 2)
+    {
+        sectorCount = 0;
+        return false;
+    }
+
+    mount();
+    return true;
+}
+
+bool SampleStore::beginRam(size_t size)
+{
+    ram = static_cast<uint8_t *>(heap_caps_malloc(size, MALLOC_CAP_SPIRAM));
+    if (!ram)
+    {
+        LOG_W("[STORE] allocating PSRAM failed");
+        return false;
+    }
+
+    sectorCount = std::min<size_t>(size / SECTOR_SIZE, UINT16_MAX);
+    if (sectorCount < 2)
+    {
+        heap_caps_free(ram);
+        ram = nullptr;
+        sectorCount = 0;
+        return false;
+    }
+
+    memset(ram, 0xFF, static_cast<size_t>(sectorCount) * SECTOR_SIZE);
+
+    mount();
+    return true;
+}
+
+void SampleStore::push(const FisSample &sample)
+{
+    if (!ready())
+    {
+        return;
+    }
+
+    uint8_t record[4 + MAX_PAYLOAD];
+    const size_t payload_len = encodeSample(sample, record + 4);
+    const RecordHeader header{static_cast<uint16_t>(payload_len), RECORD_PENDING, checksum(record + 4, payload_len)};
+    memcpy(record, &header, sizeof(header));
+
+    const uint16_t size = recordSize(payload_len);
+
+    if (writeCursor.offset + size > SECTOR_SIZE)
+    {
+        const uint16_t sector = nextSector(writeCursor.sector);
+
+        // the ring is full, the oldest sector goes whether it was uploaded or not
+        const uint32_t lost = countPending(sector, readCursor.sector == sector ? readCursor.offset : FIRST_RECORD);
+        if (lost > 0)
+        {
+            LOG_W("[STORE] full, evicting %u samples", lost);
+            evictedCount += lost;
+            pendingCount -= lost;
+        }
+
+        if (readCursor.sector == sector)
+        {
+            readCursor = {nextSector(sector), FIRST_RECORD};
+        }
+
+        if (!eraseSector(sector, writeSequence + 1))
+        {
+            return;
+        }
+
+        writeCursor = {sector, FIRST_RECORD};
+        ++writeSequence;
+    }
+
+    // the header goes first, if the payload is torn the checksum tells
+    if (!write(static_cast<size_t>(writeCursor.sector) * SECTOR_SIZE + writeCursor.offset, record, 4 + payload_len))
+    {
+        return;
+    }
+
+    writeCursor.offset += size;
+    ++pendingCount;
+}
+
+bool SampleStore::next(Cursor &cursor, FisSample &sample) const
+{
+    uint8_t payload[MAX_PAYLOAD];
+    RecordHeader header;
+
+    while (seek(cursor, header))
+    {
+        const size_t address = static_cast<size_t>(cursor.sector) * SECTOR_SIZE + cursor.offset;
+        cursor.offset += recordSize(header.len);
+
+        if (header.state != RECORD_PENDING || header.len > MAX_PAYLOAD)
+        {
+            continue;
+        }
+
+        if (read(address + 4, payload, header.len) &&
+            checksum(payload, header.len) == header.check &&
+            decodeSample(payload, header.len, sample))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void SampleStore::popUntil(const Cursor &cursor)
+{
+    RecordHeader header;
+
+    Cursor target = cursor;
+    seek(target, header);
+
+    Cursor current = readCursor;
+    while (seek(current, header) && (current.sector != target.sector || current.offset != target.offset))
+    {
+        if (header.state == RECORD_PENDING)
+        {
+            const uint8_t uploaded = RECORD_UPLOADED;
+            write(static_cast<size_t>(current.sector) * SECTOR_SIZE + current.offset + 2, &uploaded, 1);
+            if (pendingCount > 0)
+            {
+                --pendingCount;
+            }
+        }
+
+        current.offset += recordSize(header.len);
+    }
+
+    readCursor = target;
+}
+
+void SampleStore::printStats() const
+{
+    LOG_I("[STORE] %u samples pending, %u evicted, %u sectors in %s",
+          pendingCount,
+          evictedCount,
+          sectorCount,
+          ram ? "PSRAM" : "flash");
+}
+
+bool SampleStore::read(size_t address, void *buf, size_t len) const
+{
+    if (ram)
+    {
+        memcpy(buf, ram + address, len);
+        return true;
+    }
+
+    return esp_partition_read(partition, address, buf, len) == ESP_OK;
+}
+
+bool SampleStore::write(size_t address, const void *buf, size_t len)
+{
+    if (ram)
+    {
+        memcpy(ram + address, buf, len);
+        return true;
+    }
+
+    const esp_err_t err = esp_partition_write(partition, address, buf, len);
+    if (err != ESP_OK)
+    {
+        LOG_W("[STORE] write failed: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    return true;
+}
+
+bool SampleStore::eraseSector(uint16_t sector, uint32_t sequence)
+{
+    const size_t address = static_cast<size_t>(sector) * SECTOR_SIZE;
+
+    if (ram)
+    {
+        memset(ram + address, 0xFF, SECTOR_SIZE);
+    }
+    else
+    {
+        const esp_err_t err = esp_partition_erase_range(partition, address, SECTOR_SIZE);
+        if (err != ESP_OK)
+        {
+            LOG_W("[STORE] erase failed: %s", esp_err_to_name(err));
+            return false;
+        }
+    }
+
+    const uint32_t sector_header[2] = {SECTOR_MAGIC, sequence};
+    return write(address, sector_header, sizeof(sector_header));
+}
+
+// 0 if the sector was never written
+uint32_t SampleStore::sectorSequence(uint16_t sector) const
+{
+    uint32_t sector_header[2];
+    if (!read(static_cast<size_t>(sector) * SECTOR_SIZE, sector_header, sizeof(sector_header)) ||
+        sector_header[0] != SECTOR_MAGIC)
+    {
+        return 0;
+    }
+
+    return sector_header[1];
+}
+
+bool SampleStore::readRecord(uint16_t sector, uint16_t offset, RecordHeader &header) const
+{
+    if (offset + sizeof(RecordHeader) > SECTOR_SIZE ||
+        !read(static_cast<size_t>(sector) * SECTOR_SIZE + offset, &header, sizeof(header)))
+    {
+        return false;
+    }
+
+    return header.len != RECORD_FREE && offset + recordSize(header.len) <= SECTOR_SIZE;
+}
+
+// moves cursor to the record at or behind it, false (and cursor at the end) if there is none
+bool SampleStore::seek(Cursor &cursor, RecordHeader &header) const
+{
+    while (true)
+    {
+        if (cursor.sector == writeCursor.sector && cursor.offset >= writeCursor.offset)
+        {
+            cursor = writeCursor;
+            return false;
+        }
+
+        if (readRecord(cursor.sector, cursor.offset, header))
+        {
+            return true;
+        }
+
+        // the rest of the sector is empty
+        cursor = {nextSector(cursor.sector), FIRST_RECORD};
+    }
+}
+
+uint32_t SampleStore::countPending(uint16_t sector, uint16_t fromOffset) const
+{
+    uint32_t count = 0;
+    RecordHeader header;
+
+    for (uint16_t offset = fromOffset; readRecord(sector, offset, header); offset += recordSize(header.len))
+    {
+        if (header.state == RECORD_PENDING)
+        {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+// finds the newest sector to write to and the oldest sample that was not uploaded
+void SampleStore::mount()
+{
+    uint16_t newest = 0;
+    uint16_t oldest = 0;
+    uint32_t newest_sequence = 0;
+    uint32_t oldest_sequence = UINT32_MAX;
+
+    for (uint16_t sector = 0; sector < sectorCount; ++sector)
+    {
+        const uint32_t sequence = sectorSequence(sector);
+        if (sequence == 0)
+        {
+            continue;
+        }
+
+        if (sequence > newest_sequence)
+        {
+            newest_sequence = sequence;
+            newest = sector;
+        }
+
+        if (sequence < oldest_sequence)
+        {
+            oldest_sequence = sequence;
+            oldest = sector;
+        }
+    }
+
+    pendingCount = 0;
+
+    if (newest_sequence == 0)
+    {
+        eraseSector(0, 1);
+        writeSequence = 1;
+        writeCursor = {0, FIRST_RECORD};
+        readCursor = writeCursor;
+        printStats();
+        return;
+    }
+
+    writeSequence = newest_sequence;
+
+    RecordHeader header;
+    uint16_t offset = FIRST_RECORD;
+    while (readRecord(newest, offset, header))
+    {
+        offset += recordSize(header.len);
+    }
+    writeCursor = {newest, offset};
+
+    // skip what was uploaded before the reboot
+    readCursor = {oldest, FIRST_RECORD};
+    while (seek(readCursor, header) && header.state != RECORD_PENDING)
+    {
+        readCursor.offset += recordSize(header.len);
+    }
+
+    for (uint16_t sector = readCursor.sector;; sector = nextSector(sector))
+    {
+        pendingCount += countPending(sector, sector == readCursor.sector ? readCursor.offset : FIRST_RECORD);
+        if (sector == writeCursor.sector)
+        {
+            break;
+        }
+    }
+
+    printStats();
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <Arduino.h>
+#include <esp_partition.h>
+
+#include "fis_extractor.h"
+
+// A FIS snapshot and when it was taken.
+struct FisSample
+{
+    uint32_t time{0}; // unix time, 0 if the clock was not set
+    FisSnapshot snapshot;
+};
+
+// writes sample as {"ts":1700000000,"fields":{"lat":48.2,...}}, returns the length, 0 if it
+// does not fit into buf
+size_t formatSample(const FisSample &sample, char *buf, size_t len);
+
+// the same as a CBOR map {0: ts, 1: {field index: value, ...}}, see FisRecordKey
+size_t formatSampleCbor(const FisSample &sample, uint8_t *buf, size_t len);
+
+// Store-and-forward log for samples that could not be uploaded. The samples are kept compact
+// (only the present values, with their lengths) in a ring of 4 KB sectors, either in PSRAM or
+// in a raw flash partition. Flash is written strictly sequentially and a sector is only erased
+// right before it is filled again, so all sectors wear evenly. When the ring is full the sector
+// with the oldest samples is erased, uploaded or not.
+//
+// Uploaded samples are marked in place (a flag byte goes from 0xFF to 0x00, which flash can do
+// without an erase), so after a reboot the flash log knows where to continue.
+class SampleStore
+{
+public:
+    static constexpr size_t SECTOR_SIZE = 4096;
+
+    // position in the log, from begin() to end()
+    struct Cursor
+    {
+        uint16_t sector;
+        uint16_t offset;
+    };
+
+    // keeps the log in the data partition with this label, it survives reboots
+    bool beginFlash(const char *partitionLabel);
+
+    // keeps the log in size bytes of PSRAM
+    bool beginRam(size_t size);
+
+    bool ready() const { return sectorCount > 0; }
+
+    void push(const FisSample &sample);
+
+    // the oldest sample that was not uploaded yet
+    Cursor begin() const { return readCursor; }
+
+    // reads the sample at cursor and moves it to the next one, false at the end of the log
+    bool next(Cursor &cursor, FisSample &sample) const;
+
+    // marks everything before cursor as uploaded
+    void popUntil(const Cursor &cursor);
+
+    uint32_t pending() const { return pendingCount; }
+    uint32_t evicted() const { return evictedCount; }
+
+    void printStats() const;
+
+private:
+    struct RecordHeader
+    {
+        uint16_t len;  // of the payload, 0xFFFF where nothing was written yet
+        uint8_t state; // RECORD_PENDING or RECORD_UPLOADED
+        uint8_t check; // of the payload, catches records torn by a power loss
+    };
+
+    bool read(size_t address, void *buf, size_t len) const;
+    bool write(size_t address, const void *buf, size_t len);
+    bool eraseSector(uint16_t sector, uint32_t sequence);
+    uint32_t sectorSequence(uint16_t sector) const;
+    bool readRecord(uint16_t sector, uint16_t offset, RecordHeader &header) const;
+    uint16_t nextSector(uint16_t sector) const { return (sector + 1) % sectorCount; }
+    bool seek(Cursor &cursor, RecordHeader &header) const;
+    uint32_t countPending(uint16_t sector, uint16_t fromOffset) const;
+    void mount();
+
+    const esp_partition_t *partition{nullptr};
+    uint8_t *ram{nullptr};
+    uint16_t sectorCount{0};
+
+    Cursor readCursor{0, 0};
+    Cursor writeCursor{0, 0};
+    uint32_t writeSequence{0};
+
+    uint32_t pendingCount{0};
+    uint32_t evictedCount{0};
+};
@@ -0,0 +1,286 @@
+#include "sink.h"
+
+#include <new>
+
+#include <esp_heap_caps.h>
+
+#include "logger.h"
+
+Sink::Sink(const char *name, size_t batchMaxSamples, uint32_t batchMaxAgeMs, uint32_t stackSize)
+    : sinkName{name},
+      batchMaxSamples{std::min(std::max<size_t>(batchMaxSamples, 1), MAX_BATCH)},
+      batchMaxAgeMs{batchMaxAgeMs},
+      stackSize{stackSize},
+      retry{name}
+{
+}
+
+bool Sink::begin(size_t length)
+{
+    queueLength = std::max<size_t>(length, 1);
+    queue = xQueueCreate(queueLength, sizeof(SharedSample *));
+    if (!queue)
+    {
+        LOG_E("[SINK] %s: no memory for the queue", sinkName);
+        return false;
+    }
+
+    if (xTaskCreate(task, "sink", stackSize, this, 1, nullptr) != pdPASS)
+    {
+        LOG_E("[SINK] %s: the task could not be started", sinkName);
+        vQueueDelete(queue);
+        queue = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+void Sink::offer(SharedSample *sample)
+{
+    offeredCount.fetch_add(1, std::memory_order_relaxed);
+
+    if (!queue)
+    {
+        sample->release();
+        droppedCount.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    if (xQueueSend(queue, &sample, 0) == pdTRUE)
+    {
+        return;
+    }
+
+    // the sink is stuck, the oldest sample goes
+    SharedSample *dropped;
+    if (xQueueReceive(queue, &dropped, 0) == pdTRUE)
+    {
+        dropped->release();
+        droppedCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (xQueueSend(queue, &sample, 0) != pdTRUE)
+    {
+        sample->release();
+        droppedCount.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+SinkStats Sink::stats() const
+{
+    return {offeredCount.load(), sentCount.load(), droppedCount.load(), failedBatches.load()};
+}
+
+void Sink::printStats() const
+{
+    const SinkStats current = stats();
+    LOG_I("[SINK] %s: %u samples offered, %u sent, %u dropped, %u waiting, %u batches failed", sinkName,
+          current.offered, current.sent, current.dropped,
+          static_cast<unsigned>(queue ? uxQueueMessagesWaiting(queue) : 0), current.failed);
+    retry.printStats();
+}
+
+void Sink::task(void *sink)
+{
+    static_cast<Sink *>(sink)->run();
+}
+
+void Sink::run()
+{
+    for (;;)
+    {
+        maintain();
+
+        const bool backing_off = !retry.ready();
+        const bool due = batchCount >= batchMaxSamples || (batchCount > 0 && batchDeadline.expired());
+
+        if (due && !backing_off)
+        {
+            flush();
+            continue;
+        }
+
+        // sleep until a sample arrives, the batch gets too old or the back-off is over
+        uint32_t wait_ms = UINT32_MAX;
+        if (batchCount > 0 && !due)
+        {
+            wait_ms = batchDeadline.remainingMs();
+        }
+        if (backing_off)
+        {
+            wait_ms = std::min(wait_ms, retry.remainingMs());
+        }
+        wait_ms = std::min(wait_ms, maintenanceMs());
+
+        // a full batch waits for the back-off, meanwhile the queue takes the new samples
+        if (batchCount >= batchMaxSamples)
+        {
+            vTaskDelay(pdMS_TO_TICKS(wait_ms));
+            continue;
+        }
+
+        const TickType_t wait = wait_ms == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(wait_ms);
+        SharedSample *sample;
+        if (xQueueReceive(queue, &sample, wait) == pdTRUE)
+        {
+            if (batchCount == 0)
+            {
+                batchDeadline.start(batchMaxAgeMs);
+            }
+            batch[batchCount++] = sample;
+        }
+    }
+}
+
+void Sink::flush()
+{
+    // a backlog goes out in full batches
+    SharedSample *queued;
+    while (batchCount < batchMaxSamples && xQueueReceive(queue, &queued, 0) == pdTRUE)
+    {
+        batch[batchCount++] = queued;
+    }
+
+    const FisSample *samples[MAX_BATCH];
+    for (size_t idx = 0; idx < batchCount; ++idx)
+    {
+        samples[idx] = &batch[idx]->sample;
+    }
+
+    size_t count = batchCount;
+    FailureClass failure = FailureClass::CONNECT;
+    if (send(samples, count, failure))
+    {
+        retry.succeeded();
+    }
+    else
+    {
+        failedBatches.fetch_add(1, std::memory_order_relaxed);
+        retry.failed(failure);
+    }
+
+    // what did not go out is sent with the next flush
+    count = std::min(count, batchCount);
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        batch[idx]->release();
+    }
+    for (size_t idx = count; idx < batchCount; ++idx)
+    {
+        batch[idx - count] = batch[idx];
+    }
+    batchCount -= count;
+    sentCount.fetch_add(count, std::memory_order_relaxed);
+}
+
+bool SinkFanOut::add(Sink *sink)
+{
+    if (sinkCount >= MAX_SINKS || pool)
+    {
+        LOG_W("[SINK] no room for %s, at most %u sinks", sink->name(), static_cast<unsigned>(MAX_SINKS));
+        return false;
+    }
+
+    sinks[sinkCount++] = sink;
+    return true;
+}
+
+void SinkFanOut::begin(size_t queueLength)
+{
+    if (sinkCount == 0)
+    {
+        return;
+    }
+
+    size_t started = 0;
+    for (size_t idx = 0; idx < sinkCount; ++idx)
+    {
+        if (sinks[idx]->begin(queueLength))
+        {
+            sinks[started++] = sinks[idx];
+        }
+    }
+    sinkCount = started;
+
+    // every sink can hold on to its capacity at once, one more for the sample being published
+    poolSize = 1;
+    for (size_t idx = 0; idx < sinkCount; ++idx)
+    {
+        poolSize += sinks[idx]->capacity();
+    }
+
+    void *memory = heap_caps_malloc(poolSize * sizeof(SharedSample), psramFound() ? MALLOC_CAP_SPIRAM : MALLOC_CAP_8BIT);
+    if (!memory)
+    {
+        LOG_E("[SINK] no memory for %u samples, the sinks get nothing", static_cast<unsigned>(poolSize));
+        poolSize = 0;
+        return;
+    }
+
+    pool = static_cast<SharedSample *>(memory);
+    for (size_t idx = 0; idx < poolSize; ++idx)
+    {
+        new (&pool[idx]) SharedSample();
+    }
+
+    LOG_I("[SINK] %u sinks, a pool of %u samples (%u bytes)", static_cast<unsigned>(sinkCount),
+          static_cast<unsigned>(poolSize), static_cast<unsigned>(poolSize * sizeof(SharedSample)));
+}
+
+SharedSample *SinkFanOut::claim()
+{
+    // only this task takes slots, the sinks only give them back
+    for (size_t step = 0; step < poolSize; ++step)
+    {
+        SharedSample &slot = pool[(nextSlot + step) % poolSize];
+        if (slot.refs.load(std::memory_order_acquire) == 0)
+        {
+            nextSlot = (nextSlot + step + 1) % poolSize;
+            return &slot;
+        }
+    }
+
+    return nullptr;
+}
+
+void SinkFanOut::publish(uint32_t time, const FisSnapshot &snapshot)
+{
+    if (poolSize == 0)
+    {
+        return;
+    }
+
+    SharedSample *slot = claim();
+    if (!slot)
+    {
+        ++exhausted;
+        return;
+    }
+
+    slot->sample.time = time;
+    slot->sample.snapshot = snapshot;
+    // one reference per sink, each gives its own back
+    slot->refs.store(static_cast<uint8_t>(sinkCount), std::memory_order_release);
+
+    for (size_t idx = 0; idx < sinkCount; ++idx)
+    {
+        sinks[idx]->offer(slot);
+    }
+}
+
+void SinkFanOut::printStats() const
+{
+    if (sinkCount == 0)
+    {
+        return;
+    }
+
+    for (size_t idx = 0; idx < sinkCount; ++idx)
+    {
+        sinks[idx]->printStats();
+    }
+    if (exhausted > 0)
+    {
+        LOG_W("[SINK] %u samples found the pool exhausted", exhausted);
+    }
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+
+#include <Arduino.h>
+#include <freertos/queue.h>
+
+#include "deadline.h"
+#include "retry_policy.h"
+#include "sample_store.h"
+
+// A sample in the pool of SinkFanOut, shared by all sinks it was handed to. Whoever drops the
+// last reference gives the slot back.
+struct SharedSample
+{
+    FisSample sample;
+    std::atomic<uint8_t> refs{0};
+
+    void release() { refs.fetch_sub(1, std::memory_order_acq_rel); }
+};
+
+struct SinkStats
+{
+    uint32_t offered{0}; // samples handed to the sink
+    uint32_t sent{0};    // samples that arrived
+    uint32_t dropped{0}; // samples pushed out of the full queue
+    uint32_t failed{0};  // batches that did not go through
+};
+
+// A destination of the FIS stream next to the endpoint, configured with SINK_URLS. Every sink
+// has its own bounded queue, its own task, its own batch and its own RetryPolicy, so a sink
+// that is slow or down only ever holds up itself. Once its queue is full the oldest sample in
+// it is dropped, sinks have no store to fall back on.
+//
+// A batch goes out once batchMaxSamples are collected or the oldest of them is batchMaxAgeMs
+// old, together with whatever queued up in the meantime. While the sink backs off the batch
+// is kept and sent again.
+class Sink
+{
+public:
+    static constexpr size_t MAX_BATCH = 8;
+
+    Sink(const char *name, size_t batchMaxSamples, uint32_t batchMaxAgeMs, uint32_t stackSize);
+    virtual ~Sink() = default;
+
+    // creates the queue and starts the task
+    bool begin(size_t queueLength);
+
+    // the most samples the sink holds at once, in its queue and its batch
+    size_t capacity() const { return queueLength + batchMaxSamples; }
+
+    // hands a sample to the sink, which takes over one reference, never blocks
+    void offer(SharedSample *sample);
+
+    const char *name() const { return sinkName; }
+
+    SinkStats stats() const;
+    void printStats() const;
+
+protected:
+    // sends the first count samples, oldest first, and sets count to how many of them went out.
+    // If it returns true the rest follow right away, otherwise failure tells why and the rest
+    // waits for the back-off.
+    virtual bool send(const FisSample *const *samples, size_t &count, FailureClass &failure) = 0;
+
+    // the task calls maintain() at the latest after maintenanceMs(), also while it waits for
+    // samples, e.g. for the keep-alive of a connection
+    virtual uint32_t maintenanceMs() const { return UINT32_MAX; }
+    virtual void maintain() {}
+
+private:
+    static void task(void *sink);
+    void run();
+    void flush();
+
+    const char *sinkName;
+    const size_t batchMaxSamples;
+    const uint32_t batchMaxAgeMs;
+    const uint32_t stackSize;
+
+    size_t queueLength{0};
+    QueueHandle_t queue{nullptr};
+
+    // only the task of the sink
+    SharedSample *batch[MAX_BATCH]{};
+    size_t batchCount{0};
+    Deadline batchDeadline; // when the oldest sample of the batch is batchMaxAgeMs old
+    RetryPolicy retry;
+
+    std::atomic<uint32_t> offeredCount{0};
+    std::atomic<uint32_t> sentCount{0};
+    std::atomic<uint32_t> droppedCount{0};
+    std::atomic<uint32_t> failedBatches{0};
+};
+
+// Hands every sample to all sinks. A sample is copied once, into a pool that is large enough
+// for everything the sinks can hold together, and the sinks only get a reference to it.
+class SinkFanOut
+{
+public:
+    static constexpr size_t MAX_SINKS = 4;
+
+    // before begin()
+    bool add(Sink *sink);
+
+    // allocates the pool and starts the sinks, each with a queue of queueLength samples
+    void begin(size_t queueLength);
+
+    bool empty() const { return sinkCount == 0; }
+
+    // from the loop task
+    void publish(uint32_t time, const FisSnapshot &snapshot);
+
+    void printStats() const;
+
+private:
+    SharedSample *claim();
+
+    Sink *sinks[MAX_SINKS]{};
+    size_t sinkCount{0};
+
+    SharedSample *pool{nullptr};
+    size_t poolSize{0};
+    size_t nextSlot{0}; // where claim() starts looking
+
+    uint32_t exhausted{0}; // samples that found no free slot
+};
@@ -0,0 +1,188 @@
+#include "tls_arena.h"
+
+#include <atomic>
+#include <cstring>
+
+#include <esp_heap_caps.h>
+#include <freertos/semphr.h>
+#include <mbedtls/ssl_internal.h>
+
+#include "logger.h"
+
+// can be set from build_flags, e.g. -DTLS_ARENA_SESSIONS=1 if only one host is talked to
+#ifndef TLS_ARENA_SESSIONS
+#define TLS_ARENA_SESSIONS 2
+#endif
+
+namespace
+{
+static_assert(TLS_MAX_FRAGMENT_LEN == 0 || TLS_MAX_FRAGMENT_LEN == 512 || TLS_MAX_FRAGMENT_LEN == 1024 ||
+                  TLS_MAX_FRAGMENT_LEN == 2048 || TLS_MAX_FRAGMENT_LEN == 4096,
+              "TLS_MAX_FRAGMENT_LEN can only be 512, 1024, 2048 or 4096");
+
+#if TLS_MAX_FRAGMENT_LEN > 0
+constexpr size_t HANDSHAKE_SLOTS = 1;
+// what mbedtls_ssl_get_input_buflen() and mbedtls_ssl_get_output_buflen() shrink to
+constexpr size_t SESSION_BUFFER_LEN = MBEDTLS_SSL_HEADER_LEN + MBEDTLS_SSL_PAYLOAD_OVERHEAD + TLS_MAX_FRAGMENT_LEN;
+constexpr size_t SESSION_SLOTS = 2 * TLS_ARENA_SESSIONS;
+#else
+constexpr size_t HANDSHAKE_SLOTS = TLS_ARENA_SESSIONS;
+constexpr size_t SESSION_BUFFER_LEN = 0;
+constexpr size_t SESSION_SLOTS = 0;
+#endif
+
+struct Slot
+{
+    uint8_t *start;
+    size_t size;
+};
+
+// aligned for the word accesses of mbedTLS
+alignas(8) uint8_t inBuffers[HANDSHAKE_SLOTS][MBEDTLS_SSL_IN_BUFFER_LEN];
+alignas(8) uint8_t outBuffers[HANDSHAKE_SLOTS][MBEDTLS_SSL_OUT_BUFFER_LEN];
+#if TLS_MAX_FRAGMENT_LEN > 0
+alignas(8) uint8_t sessionBuffers[SESSION_SLOTS][SESSION_BUFFER_LEN];
+#endif
+
+constexpr size_t SLOTS = 2 * HANDSHAKE_SLOTS + SESSION_SLOTS;
+constexpr size_t ARENA_SIZE = sizeof(inBuffers) + sizeof(outBuffers) + SESSION_SLOTS * SESSION_BUFFER_LEN;
+
+// the smaller slots first, a request gets the first free slot of its size
+Slot arenaSlot(size_t idx)
+{
+#if TLS_MAX_FRAGMENT_LEN > 0
+    if (idx < SESSION_SLOTS)
+    {
+        return {sessionBuffers[idx], SESSION_BUFFER_LEN};
+    }
+    idx -= SESSION_SLOTS;
+#endif
+    if (idx < HANDSHAKE_SLOTS)
+    {
+        return {outBuffers[idx], MBEDTLS_SSL_OUT_BUFFER_LEN};
+    }
+    return {inBuffers[idx - HANDSHAKE_SLOTS], MBEDTLS_SSL_IN_BUFFER_LEN};
+}
+
+std::atomic<bool> slotUsed[SLOTS]{};
+
+std::atomic<uint32_t> slotsInUse{0};
+std::atomic<uint32_t> peakSlotsInUse{0};
+std::atomic<uint32_t> slotAllocations{0};
+std::atomic<uint32_t> heapFallbacks{0};
+
+// only needed while there are fewer pairs of full size slots than sessions
+SemaphoreHandle_t handshakeMutex = HANDSHAKE_SLOTS < TLS_ARENA_SESSIONS ? xSemaphoreCreateMutex() : nullptr;
+
+// the slot ptr is the start of, -1 if it is not in the arena
+int slotOf(const void *ptr)
+{
+    for (size_t idx = 0; idx < SLOTS; ++idx)
+    {
+        if (arenaSlot(idx).start == ptr)
+        {
+            return static_cast<int>(idx);
+        }
+    }
+    return -1;
+}
+
+// a free slot of exactly that size, certificates and the like of a handshake can come close
+// to the size of an out buffer, but must not take one
+void *claim(size_t size)
+{
+    for (size_t idx = 0; idx < SLOTS; ++idx)
+    {
+        const Slot slot = arenaSlot(idx);
+        if (size != slot.size)
+        {
+            continue;
+        }
+
+        bool expected = false;
+        if (slotUsed[idx].compare_exchange_strong(expected, true, std::memory_order_acquire))
+        {
+            const uint32_t used = slotsInUse.fetch_add(1, std::memory_order_relaxed) + 1;
+            uint32_t peak = peakSlotsInUse.load(std::memory_order_relaxed);
+            while (used > peak && !peakSlotsInUse.compare_exchange_weak(peak, used, std::memory_order_relaxed))
+            {
+            }
+            slotAllocations.fetch_add(1, std::memory_order_relaxed);
+            return slot.start;
+        }
+    }
+
+    return nullptr;
+}
+
+bool isRecordBuffer(size_t size)
+{
+    return size == MBEDTLS_SSL_OUT_BUFFER_LEN || size == MBEDTLS_SSL_IN_BUFFER_LEN ||
+           (SESSION_BUFFER_LEN > 0 && size == SESSION_BUFFER_LEN);
+}
+} // namespace
+
+// replace the allocator of esp-idf, see CONFIG_MBEDTLS_CUSTOM_MEM_ALLOC
+extern "C" void *esp_mbedtls_mem_calloc(size_t n, size_t size)
+{
+    if (size != 0 && n > SIZE_MAX / size)
+    {
+        return nullptr;
+    }
+
+    const size_t total = n * size;
+    void *ptr = claim(total);
+    if (ptr)
+    {
+        memset(ptr, 0, total);
+        return ptr;
+    }
+
+    if (isRecordBuffer(total))
+    {
+        heapFallbacks.fetch_add(1, std::memory_order_relaxed);
+    }
+    return heap_caps_calloc(n, size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+
+extern "C" void esp_mbedtls_mem_free(void *ptr)
+{
+    const int slot = slotOf(ptr);
+    if (slot < 0)
+    {
+        heap_caps_free(ptr);
+        return;
+    }
+
+    slotsInUse.fetch_sub(1, std::memory_order_relaxed);
+    slotUsed[slot].store(false, std::memory_order_release);
+}
+
+void tlsArenaBeginHandshake()
+{
+    if (handshakeMutex)
+    {
+        xSemaphoreTake(handshakeMutex, portMAX_DELAY);
+    }
+}
+
+void tlsArenaEndHandshake()
+{
+    if (handshakeMutex)
+    {
+        xSemaphoreGive(handshakeMutex);
+    }
+}
+
+TlsArenaStats tlsArenaStats()
+{
+    return {slotsInUse.load(), peakSlotsInUse.load(), slotAllocations.load(), heapFallbacks.load()};
+}
+
+void tlsArenaPrintStats()
+{
+    const TlsArenaStats stats = tlsArenaStats();
+    LOG_I("[TLS] arena of %u bytes: %u of %u record buffers in use (peak %u), %u handed out, %u went to the heap",
+          static_cast<unsigned>(ARENA_SIZE), stats.slotsInUse, static_cast<unsigned>(SLOTS), stats.peakSlotsInUse,
+          stats.slotAllocations, stats.heapFallbacks);
+}
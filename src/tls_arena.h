@@ -0,0 +1,39 @@
+#pragma once
+
+#include <Arduino.h>
+
+// can be set from build_flags, e.g. -DTLS_MAX_FRAGMENT_LEN=2048, see below
+#ifndef TLS_MAX_FRAGMENT_LEN
+#define TLS_MAX_FRAGMENT_LEN 0
+#endif
+
+struct TlsArenaStats
+{
+    uint32_t slotsInUse;
+    uint32_t peakSlotsInUse;
+    uint32_t slotAllocations; // record buffers handed out of the arena
+    uint32_t heapFallbacks;    // record buffers that found no free slot and went to the heap
+};
+
+// The record buffers of mbedTLS (16 KB in, 4 KB out per session) are the largest blocks on
+// the heap, and they come and go with every handshake. In between, small allocations settle
+// in the holes they leave, until there is no block large enough for the next handshake.
+//
+// With CONFIG_MBEDTLS_CUSTOM_MEM_ALLOC (sdkconfig.esp32dev) all allocations of mbedTLS come
+// here. Record buffers are served from a static arena, everything else still goes to the
+// internal heap.
+//
+// By default the arena has one in and one out slot per TLS_ARENA_SESSIONS. With
+// TLS_MAX_FRAGMENT_LEN (512, 1024, 2048 or 4096) the client asks the servers for records of
+// at most that size, and CONFIG_MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH shrinks both buffers to it
+// once the handshake is done. Then the full size buffers are only needed during a handshake:
+// the arena keeps a single pair of them, handshakes take turns on it (tlsArenaBeginHandshake),
+// and each session keeps two small slots. A server that ignores the request keeps its full
+// size buffers, the next handshake then has to go to the heap, which is counted.
+TlsArenaStats tlsArenaStats();
+void tlsArenaPrintStats();
+
+// around a handshake, until the buffers are either shrunk or freed with the failed connection,
+// waits while another handshake holds the full size slots
+void tlsArenaBeginHandshake();
+void tlsArenaEndHandshake();
@@ -0,0 +1,512 @@
+#include "tls_client.h"
+
+#include <lwip/sockets.h>
+#include <lwip/netdb.h>
+
+#include <WiFi.h>
+#include <esp_heap_caps.h>
+#include <mbedtls/base64.h>
+#include <mbedtls/sha256.h>
+
+#include "deadline.h"
+#include "dns_cache.h"
+#include "logger.h"
+#include "metrics.h"
+#include "tls_arena.h"
+
+// Part of the WiFiClientSecure library, the header has the same name as the esp-idf one
+extern "C" esp_err_t arduino_esp_crt_bundle_attach(void *conf);
+
+namespace
+{
+constexpr const char *const DRBG_PERSONALIZATION = "esp32-tls";
+constexpr int32_t DEFAULT_CONNECT_TIMEOUT_MS = 30000; // same default as ssl_client
+
+// the code of the max_fragment_length extension (RFC 6066)
+constexpr unsigned char maxFragLenCode(size_t len)
+{
+    return len == 512 ? MBEDTLS_SSL_MAX_FRAG_LEN_512
+         : len == 1024 ? MBEDTLS_SSL_MAX_FRAG_LEN_1024
+         : len == 2048 ? MBEDTLS_SSL_MAX_FRAG_LEN_2048
+         : len == 4096 ? MBEDTLS_SSL_MAX_FRAG_LEN_4096
+                       : MBEDTLS_SSL_MAX_FRAG_LEN_NONE;
+}
+
+void logTlsError(const char *what, int ret)
+{
+    char error_buf[100];
+    mbedtls_strerror(ret, error_buf, sizeof(error_buf));
+    LOG_W("[TLS] %s failed: -0x%x %s", what, -ret, error_buf);
+}
+} // namespace
+
+TlsClient::TlsClient()
+{
+    mbedtls_ssl_session_init(&savedSession);
+}
+
+TlsClient::~TlsClient()
+{
+    mbedtls_ssl_session_free(&savedSession);
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port)
+{
+    // without a host name there is no session to resume
+    return WiFiClientSecure::connect(ip, port);
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port, int32_t timeout)
+{
+    return WiFiClientSecure::connect(ip, port, timeout);
+}
+
+int TlsClient::connect(const char *host, uint16_t port)
+{
+    return connect(host, port, _timeout);
+}
+
+int TlsClient::connect(const char *host, uint16_t port, int32_t timeout)
+{
+    if (!_use_insecure && !_use_ca_bundle)
+    {
+        LOG_E("[TLS] only insecure or CA bundle mode is supported");
+        return 0;
+    }
+
+    if (sslclient->socket >= 0)
+    {
+        stop();
+    }
+
+    lastConnectFailure = ConnectFailure::NONE;
+
+    // failed steps count as well, a timeout is what makes a wagon fall behind
+    int64_t step_start = Deadline::now();
+    IPAddress address;
+    const bool resolved = dnsResolve(host, address);
+    observeLatency(Stage::DNS, Deadline::msSince(step_start));
+    if (!resolved)
+    {
+        LOG_W("[TLS] could not resolve %s", host);
+        lastConnectFailure = ConnectFailure::DNS;
+        return 0;
+    }
+
+    step_start = Deadline::now();
+    const int socket = connectSocket(address, port, timeout > 0 ? timeout : DEFAULT_CONNECT_TIMEOUT_MS);
+    observeLatency(Stage::CONNECT, Deadline::msSince(step_start));
+    if (socket < 0)
+    {
+        lastConnectFailure = ConnectFailure::TCP;
+        return 0;
+    }
+
+    const bool resume = haveSession && strcmp(sessionHost, host) == 0;
+
+    step_start = Deadline::now();
+    tlsArenaBeginHandshake();
+    const bool handshaken = handshake(host, resume);
+    if (!handshaken)
+    {
+        // frees the full size buffers before the next handshake may take them
+        stop();
+    }
+    tlsArenaEndHandshake();
+    observeLatency(Stage::TLS, Deadline::msSince(step_start));
+    if (!handshaken)
+    {
+        // a session the server chokes on would break every further attempt
+        forgetSession();
+        lastConnectFailure = ConnectFailure::TLS;
+        return 0;
+    }
+
+    _connected = true;
+    return 1;
+}
+
+int TlsClient::read()
+{
+    const int c = WiFiClientSecure::read();
+    if (c >= 0)
+    {
+        ++receivedBytes;
+        countBytesIn(1);
+    }
+    return c;
+}
+
+int TlsClient::read(uint8_t *buf, size_t size)
+{
+    const int read_len = WiFiClientSecure::read(buf, size);
+    if (read_len > 0)
+    {
+        receivedBytes += read_len;
+        countBytesIn(read_len);
+    }
+    return read_len;
+}
+
+size_t TlsClient::write(const uint8_t *buf, size_t size)
+{
+    const size_t written = WiFiClientSecure::write(buf, size);
+    countBytesOut(written);
+    return written;
+}
+
+bool TlsClient::waitForData(uint32_t timeout_ms)
+{
+    const uint32_t start = millis();
+
+    while (true)
+    {
+        // also pulls in what already arrived, a partial TLS record does not count as data
+        if (available() > 0)
+        {
+            return true;
+        }
+
+        const uint32_t elapsed = millis() - start;
+        if (!connected() || sslclient->socket < 0 || elapsed >= timeout_ms)
+        {
+            return false;
+        }
+
+        const uint32_t remaining = timeout_ms - elapsed;
+        timeval tv;
+        tv.tv_sec = remaining / 1000;
+        tv.tv_usec = (remaining % 1000) * 1000;
+
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET(sslclient->socket, &fdset);
+
+        if (lwip_select(sslclient->socket + 1, &fdset, nullptr, nullptr, &tv) <= 0)
+        {
+            return false;
+        }
+    }
+}
+
+bool TlsClient::setSpkiPins(const char *pins)
+{
+    bool valid = true;
+    spkiPinCount = 0;
+
+    while (*pins)
+    {
+        const char *end = strchr(pins, ',');
+        const size_t len = end ? static_cast<size_t>(end - pins) : strlen(pins);
+
+        size_t decoded = 0;
+        uint8_t hash[SPKI_HASH_LEN + 1]; // one more, a longer value has to fail
+        if (len > 0 &&
+            (mbedtls_base64_decode(hash, sizeof(hash), &decoded, reinterpret_cast<const unsigned char *>(pins),
+                                   len) != 0 ||
+             decoded != SPKI_HASH_LEN))
+        {
+            LOG_E("[TLS] pin %.*s is not a base64 SHA-256", static_cast<int>(len), pins);
+            valid = false;
+        }
+        else if (len > 0 && spkiPinCount == MAX_PINS)
+        {
+            LOG_E("[TLS] more than %u pins", static_cast<unsigned>(MAX_PINS));
+            valid = false;
+        }
+        else if (len > 0)
+        {
+            memcpy(spkiPins[spkiPinCount++], hash, SPKI_HASH_LEN);
+        }
+
+        pins += end ? len + 1 : len;
+    }
+
+    return valid;
+}
+
+void TlsClient::forgetSession()
+{
+    mbedtls_ssl_session_free(&savedSession);
+    mbedtls_ssl_session_init(&savedSession);
+    haveSession = false;
+}
+
+int TlsClient::connectSocket(IPAddress ip, uint16_t port, int32_t timeout)
+{
+    const int fd = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0)
+    {
+        LOG_W("[TLS] opening socket failed");
+        return -1;
+    }
+
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = ip;
+    server_addr.sin_port = htons(port);
+
+    timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+
+    // connect non-blocking, so the timeout applies to the TCP handshake as well
+    lwip_fcntl(fd, F_SETFL, lwip_fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    int res = lwip_connect(fd, reinterpret_cast<sockaddr *>(&server_addr), sizeof(server_addr));
+    if (res < 0 && errno != EINPROGRESS)
+    {
+        LOG_W("[TLS] connect failed, errno: %d", errno);
+        lwip_close(fd);
+        return -1;
+    }
+
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(fd, &fdset);
+
+    res = lwip_select(fd + 1, nullptr, &fdset, nullptr, &tv);
+    if (res <= 0)
+    {
+        LOG_W("[TLS] connect %s", res == 0 ? "timed out" : "failed");
+        lwip_close(fd);
+        return -1;
+    }
+
+    int sock_err = 0;
+    socklen_t len = sizeof(sock_err);
+    if (lwip_getsockopt(fd, SOL_SOCKET, SO_ERROR, &sock_err, &len) < 0 || sock_err != 0)
+    {
+        LOG_W("[TLS] connect failed, socket error: %d", sock_err);
+        lwip_close(fd);
+        return -1;
+    }
+
+    lwip_fcntl(fd, F_SETFL, lwip_fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+
+    const int enable = 1;
+    lwip_setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    lwip_setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    lwip_setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    lwip_setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+
+    sslclient->socket = fd;
+    return fd;
+}
+
+bool TlsClient::handshake(const char *host, bool resume)
+{
+    int ret;
+    // what the session holds, roughly, the other task allocates meanwhile as well
+    const size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+
+    // same setup as start_ssl_client() of WiFiClientSecure, plus the saved session
+    mbedtls_entropy_init(&sslclient->entropy_ctx);
+
+    if ((ret = mbedtls_ctr_drbg_seed(&sslclient->drbg_ctx, mbedtls_entropy_func, &sslclient->entropy_ctx,
+                                     reinterpret_cast<const unsigned char *>(DRBG_PERSONALIZATION),
+                                     strlen(DRBG_PERSONALIZATION))) != 0)
+    {
+        logTlsError("seeding the random number generator", ret);
+        return false;
+    }
+
+    if ((ret = mbedtls_ssl_config_defaults(&sslclient->ssl_conf, MBEDTLS_SSL_IS_CLIENT,
+                                           MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT)) != 0)
+    {
+        logTlsError("setting up the TLS config", ret);
+        return false;
+    }
+
+    if (_use_insecure)
+    {
+        mbedtls_ssl_conf_authmode(&sslclient->ssl_conf, MBEDTLS_SSL_VERIFY_NONE);
+    }
+    else if ((ret = arduino_esp_crt_bundle_attach(&sslclient->ssl_conf)) != 0)
+    {
+        logTlsError("attaching the CA bundle", ret);
+        return false;
+    }
+    else
+    {
+        // the bundle stays the fallback for keys that are not trusted yet
+        bundleVerify = sslclient->ssl_conf.f_vrfy;
+        bundleVerifyCtx = sslclient->ssl_conf.p_vrfy;
+        keyCheck = KeyCheck::PENDING;
+        chainDepth = 0;
+        mbedtls_ssl_conf_verify(&sslclient->ssl_conf, verifyCertificate, this);
+    }
+
+    mbedtls_ssl_conf_session_tickets(&sslclient->ssl_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+    if (TLS_MAX_FRAGMENT_LEN > 0 &&
+        (ret = mbedtls_ssl_conf_max_frag_len(&sslclient->ssl_conf, maxFragLenCode(TLS_MAX_FRAGMENT_LEN))) != 0)
+    {
+        logTlsError("setting the max fragment length", ret);
+        return false;
+    }
+    mbedtls_ssl_conf_rng(&sslclient->ssl_conf, mbedtls_ctr_drbg_random, &sslclient->drbg_ctx);
+
+    if ((ret = mbedtls_ssl_setup(&sslclient->ssl_ctx, &sslclient->ssl_conf)) != 0)
+    {
+        logTlsError("setting up the TLS context", ret);
+        return false;
+    }
+
+    if ((ret = mbedtls_ssl_set_hostname(&sslclient->ssl_ctx, host)) != 0)
+    {
+        logTlsError("setting the host name", ret);
+        return false;
+    }
+
+    if (resume && (ret = mbedtls_ssl_set_session(&sslclient->ssl_ctx, &savedSession)) != 0)
+    {
+        // not fatal, we just do a full handshake
+        logTlsError("setting the saved session", ret);
+        resume = false;
+    }
+
+    mbedtls_ssl_set_bio(&sslclient->ssl_ctx, &sslclient->socket, mbedtls_net_send, mbedtls_net_recv, nullptr);
+
+    const uint32_t handshake_start = millis();
+    while ((ret = mbedtls_ssl_handshake(&sslclient->ssl_ctx)) != 0)
+    {
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+        {
+            logTlsError("handshake", ret);
+            return false;
+        }
+
+        if (millis() - handshake_start > sslclient->handshake_timeout)
+        {
+            LOG_W("[TLS] handshake timed out");
+            return false;
+        }
+
+        vTaskDelay(2);
+    }
+
+    if (!_use_insecure)
+    {
+        const uint32_t flags = mbedtls_ssl_get_verify_result(&sslclient->ssl_ctx);
+        if (flags != 0)
+        {
+            char verify_buf[256];
+            mbedtls_x509_crt_verify_info(verify_buf, sizeof(verify_buf), "  ! ", flags);
+            LOG_W("[TLS] failed to verify peer certificate:\n%s", verify_buf);
+            return false;
+        }
+    }
+
+    // mbedtls has no flag for it, but a resumed session keeps the start time of the saved one,
+    // while a full handshake stamps a new one
+    const bool resumed = resume && sslclient->ssl_ctx.session->start == savedSession.start;
+
+    if (resumed)
+    {
+        ++resumedHandshakeCount;
+    }
+    else
+    {
+        ++fullHandshakeCount;
+    }
+
+    // a resumed handshake does not look at the certificate at all
+    if (keyCheck == KeyCheck::PINNED)
+    {
+        ++pinnedVerificationCount;
+    }
+    else if (keyCheck == KeyCheck::CHAIN)
+    {
+        ++chainVerificationCount;
+        memcpy(verifiedSpki, leafSpki, SPKI_HASH_LEN);
+        haveVerifiedSpki = true;
+    }
+    keyCheck = KeyCheck::PENDING;
+
+    sessionHeap = static_cast<int32_t>(free_before - heap_caps_get_free_size(MALLOC_CAP_8BIT));
+
+    LOG_I("[TLS] %s handshake with %s took %u ms, records up to %u/%u bytes in/out, %d bytes of heap",
+          resumed ? "resumed" : "full", host, static_cast<unsigned>(millis() - handshake_start),
+          static_cast<unsigned>(mbedtls_ssl_get_input_max_frag_len(&sslclient->ssl_ctx)),
+          static_cast<unsigned>(mbedtls_ssl_get_output_max_frag_len(&sslclient->ssl_ctx)), sessionHeap);
+
+    // keep the session (and a fresh ticket, if the server sent one) for the next reconnect
+    if ((ret = mbedtls_ssl_get_session(&sslclient->ssl_ctx, &savedSession)) == 0)
+    {
+        haveSession = true;
+        strncpy(sessionHost, host, sizeof(sessionHost) - 1);
+    }
+    else
+    {
+        logTlsError("saving the session", ret);
+        forgetSession();
+    }
+
+    return true;
+}
+
+// called for every certificate of the chain, from the top down to the server's own at depth 0,
+// with the flags mbedtls found for it. mbedtls adds up the flags of all calls, and the server's
+// certificate is only seen in the last one (the session does not keep the peer certificate,
+// MBEDTLS_SSL_KEEP_PEER_CERTIFICATE is off), so the certificates above it are only recorded, they
+// stay alive until the verification is done. Once the key is known, a pinned one is accepted as
+// is, for any other the bundle is run over the recorded chain in the order mbedtls would have.
+int TlsClient::verifyCertificate(void *ctx, mbedtls_x509_crt *crt, int depth, uint32_t *flags)
+{
+    TlsClient &client = *static_cast<TlsClient *>(ctx);
+
+    if (depth >= MAX_CHAIN_DEPTH)
+    {
+        // deeper than mbedtls goes, verified right away
+        return client.bundleVerify ? client.bundleVerify(client.bundleVerifyCtx, crt, depth, flags) : 0;
+    }
+    if (depth > 0)
+    {
+        client.chain[depth] = {crt, *flags};
+        client.chainDepth = std::max(client.chainDepth, depth);
+        *flags = 0;
+        return 0;
+    }
+
+    const bool hashed = mbedtls_sha256_ret(crt->pk_raw.p, crt->pk_raw.len, client.leafSpki, 0) == 0;
+    if (!hashed)
+    {
+        // no key hashes to zeros, so none gets trusted for it later
+        memset(client.leafSpki, 0, sizeof(client.leafSpki));
+    }
+    client.keyCheck = hashed && client.trustedKey(client.leafSpki) ? KeyCheck::PINNED : KeyCheck::CHAIN;
+
+    if (client.keyCheck == KeyCheck::PINNED)
+    {
+        // the key is what we trust, not the names, dates or issuers around it
+        *flags = 0;
+        return 0;
+    }
+
+    int result = 0;
+    uint32_t chain_flags = 0;
+    for (int idx = client.chainDepth; idx > 0; --idx)
+    {
+        ChainEntry &entry = client.chain[idx];
+        const int ret =
+            client.bundleVerify ? client.bundleVerify(client.bundleVerifyCtx, entry.crt, idx, &entry.flags) : 0;
+        chain_flags |= entry.flags;
+        result = result != 0 ? result : ret;
+    }
+    const int ret = client.bundleVerify ? client.bundleVerify(client.bundleVerifyCtx, crt, 0, flags) : 0;
+    *flags |= chain_flags;
+    return result != 0 ? result : ret;
+}
+
+bool TlsClient::trustedKey(const uint8_t *hash) const
+{
+    for (size_t idx = 0; idx < spkiPinCount; ++idx)
+    {
+        if (memcmp(spkiPins[idx], hash, SPKI_HASH_LEN) == 0)
+        {
+            return true;
+        }
+    }
+
+    return haveVerifiedSpki && memcmp(verifiedSpki, hash, SPKI_HASH_LEN) == 0;
+}
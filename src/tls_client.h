@@ -0,0 +1,122 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClientSecure.h>
+
+// WiFiClientSecure that keeps the TLS session of its last handshake and offers it to the
+// server on the next connect (session ticket or session ID), so a reconnect only needs an
+// abbreviated handshake instead of a full key exchange and certificate chain verification.
+// One client should only ever talk to one host, the session is bound to it.
+// Only the insecure and CA bundle modes of WiFiClientSecure are supported.
+//
+// In CA bundle mode the server can also be pinned by the SHA-256 of its public key
+// (SubjectPublicKeyInfo). A full handshake with a pinned key costs one hash, the chain is not
+// searched in the bundle. Other keys are verified against the bundle, and a key that passed
+// is trusted like a pin for the rest of the boot, a rotated certificate costs one chain
+// verification instead of one per handshake.
+class TlsClient : public WiFiClientSecure
+{
+public:
+    // the step the last connect failed at
+    enum class ConnectFailure : uint8_t
+    {
+        NONE,
+        DNS,
+        TCP,
+        TLS
+    };
+
+    static constexpr size_t MAX_PINS = 4;
+    static constexpr size_t SPKI_HASH_LEN = 32;
+
+    TlsClient();
+    ~TlsClient();
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(IPAddress ip, uint16_t port, int32_t timeout) override;
+    int connect(const char *host, uint16_t port) override;
+    int connect(const char *host, uint16_t port, int32_t timeout) override;
+
+    // counting what goes through, for the throughput and the metrics
+    using WiFiClientSecure::read;
+    int read() override;
+    int read(uint8_t *buf, size_t size) override;
+    using WiFiClientSecure::write;
+    size_t write(const uint8_t *buf, size_t size) override;
+
+    // decrypted bytes read so far, over all connections
+    uint32_t bytesReceived() const { return receivedBytes; }
+
+    // blocks until decrypted data can be read, the connection closed or timeout_ms passed,
+    // returns true if there is data
+    bool waitForData(uint32_t timeout_ms);
+
+    // the next connect does a full handshake again
+    void forgetSession();
+
+    // the pin-sha256 values of the server's keys, base64 and separated by commas, the current
+    // key and a backup, returns false if one of them is malformed, it is left out then
+    bool setSpkiPins(const char *pins);
+
+    ConnectFailure connectFailure() const { return lastConnectFailure; }
+
+    uint32_t fullHandshakes() const { return fullHandshakeCount; }
+    uint32_t resumedHandshakes() const { return resumedHandshakeCount; }
+    // full handshakes in CA bundle mode, by how the key was trusted
+    uint32_t pinnedVerifications() const { return pinnedVerificationCount; }
+    uint32_t chainVerifications() const { return chainVerificationCount; }
+
+    // the heap the last handshake left allocated, the arena does not count
+    int32_t sessionHeapBytes() const { return sessionHeap; }
+
+private:
+    enum class KeyCheck : uint8_t
+    {
+        PENDING,
+        PINNED, // the key is one of the pins, or was verified before
+        CHAIN   // the chain is verified against the bundle
+    };
+
+    int connectSocket(IPAddress ip, uint16_t port, int32_t timeout);
+    bool handshake(const char *host, bool resume);
+
+    static int verifyCertificate(void *ctx, mbedtls_x509_crt *crt, int depth, uint32_t *flags);
+    bool trustedKey(const uint8_t *hash) const;
+
+    mbedtls_ssl_session savedSession;
+    bool haveSession{false};
+    char sessionHost[64]{};
+
+    uint8_t spkiPins[MAX_PINS][SPKI_HASH_LEN]{};
+    size_t spkiPinCount{0};
+    uint8_t verifiedSpki[SPKI_HASH_LEN]{}; // of the last key the bundle vouched for
+    bool haveVerifiedSpki{false};
+
+    // of the handshake in progress
+    int (*bundleVerify)(void *, mbedtls_x509_crt *, int, uint32_t *){nullptr};
+    void *bundleVerifyCtx{nullptr};
+    KeyCheck keyCheck{KeyCheck::PENDING};
+    uint8_t leafSpki[SPKI_HASH_LEN]{};
+    // the certificates above the server's, by depth, with the flags mbedtls found for them. The
+    // bundle only looks at them once the server's key turned out not to be pinned. mbedtls takes
+    // up to MBEDTLS_X509_MAX_INTERMEDIATE_CA (8) intermediates, plus the root
+    static constexpr int MAX_CHAIN_DEPTH = 10;
+    struct ChainEntry
+    {
+        mbedtls_x509_crt *crt;
+        uint32_t flags;
+    };
+    ChainEntry chain[MAX_CHAIN_DEPTH]{};
+    int chainDepth{0}; // of the top certificate seen, 0 for none
+
+    ConnectFailure lastConnectFailure{ConnectFailure::NONE};
+
+    uint32_t receivedBytes{0};
+
+    uint32_t fullHandshakeCount{0};
+    uint32_t resumedHandshakeCount{0};
+    uint32_t pinnedVerificationCount{0};
+    uint32_t chainVerificationCount{0};
+
+    int32_t sessionHeap{0};
+};
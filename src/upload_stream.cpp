@@ -0,0 +1,567 @@
+#include "upload_stream.h"
+
+#include <string_view>
+
+#include <HTTPClient.h>
+
+#include "logger.h"
+
+static_assert(UploadStream::CHUNK_SIZE <= 0xffff, "chunk header only has room for 4 hex digits");
+
+bool parseUrl(const char *url, UrlParts &parts)
+{
+    std::string_view rest{url};
+
+    if (rest.substr(0, 8) == "https://")
+    {
+        parts.scheme = UrlScheme::HTTPS;
+        parts.port = 443;
+        rest.remove_prefix(8);
+    }
+    else if (rest.substr(0, 7) == "http://")
+    {
+        parts.scheme = UrlScheme::HTTP;
+        parts.port = 80;
+        rest.remove_prefix(7);
+    }
+    else if (rest.substr(0, 7) == "coap://")
+    {
+        parts.scheme = UrlScheme::COAP;
+        parts.port = 5683;
+        rest.remove_prefix(7);
+    }
+    else if (rest.substr(0, 8) == "mqtts://")
+    {
+        parts.scheme = UrlScheme::MQTTS;
+        parts.port = 8883;
+        rest.remove_prefix(8);
+    }
+    else
+    {
+        return false;
+    }
+
+    const auto path_pos = rest.find('/');
+    std::string_view authority = rest.substr(0, path_pos);
+    parts.path = path_pos == std::string_view::npos ? "/" : rest.data() + path_pos;
+
+    const auto port_pos = authority.find(':');
+    if (port_pos != std::string_view::npos)
+    {
+        parts.port = static_cast<uint16_t>(strtoul(authority.data() + port_pos + 1, nullptr, 10));
+        parts.defaultPort = false;
+        authority = authority.substr(0, port_pos);
+    }
+
+    if (authority.empty() || authority.size() >= sizeof(parts.host) || parts.port == 0)
+    {
+        return false;
+    }
+
+    memcpy(parts.host, authority.data(), authority.size());
+    parts.host[authority.size()] = '\0';
+
+    return true;
+}
+
+UploadStream::UploadStream(HostConnection &connection) : connection{connection}, client{connection.client()}
+{
+}
+
+void UploadStream::addHeader(const char *name, const char *value)
+{
+    if (headerCount < headers.size())
+    {
+        headers[headerCount++] = {name, value};
+    }
+    else
+    {
+        LOG_W("[UPLOAD] too many headers, dropping %s", name);
+    }
+}
+
+bool UploadStream::begin(const char *url, int length)
+{
+    beganAt = Deadline::now();
+    holdUrl = nullptr;
+
+    UrlParts parts;
+    if (!parseUrl(url, parts) || (parts.scheme != UrlScheme::HTTPS && parts.scheme != UrlScheme::HTTP))
+    {
+        LOG_W("[UPLOAD] invalid url: %s", url);
+        return false;
+    }
+
+    chunked = length < 0;
+    contentLength = length;
+    totalWritten = 0;
+    buffered = 0;
+
+    char header[512];
+    size_t pos = 0;
+
+    const auto append = [&](const char *format, auto... args) -> void
+    {
+        if (pos < sizeof(header))
+        {
+            pos += snprintf(header + pos, sizeof(header) - pos, format, args...);
+        }
+    };
+
+    append("POST %s HTTP/1.1\r\n", parts.path);
+    if (parts.defaultPort)
+    {
+        append("Host: %s\r\n", parts.host);
+    }
+    else
+    {
+        append("Host: %s:%u\r\n", parts.host, parts.port);
+    }
+    append("%s", "User-Agent: ESP32HTTPClient\r\n");
+
+    for (uint8_t idx = 0; idx < headerCount; ++idx)
+    {
+        append("%s: %s\r\n", headers[idx].name, headers[idx].value);
+    }
+
+    if (chunked)
+    {
+        append("%s", "Transfer-Encoding: chunked\r\n\r\n");
+    }
+    else
+    {
+        append("Content-Length: %d\r\n\r\n", contentLength);
+    }
+
+    if (pos >= sizeof(header))
+    {
+        LOG_W("[UPLOAD] request header too long");
+        return false;
+    }
+
+    while (true)
+    {
+        connection.countRequest();
+
+        reusedConnection = client.connected();
+        if (!reusedConnection && !client.connect(parts.host, parts.port))
+        {
+            LOG_W("[UPLOAD] connecting to %s:%u failed", parts.host, parts.port);
+            connection.countFailure();
+            return false;
+        }
+
+        if (client.write(reinterpret_cast<const uint8_t *>(header), pos) == pos)
+        {
+            break;
+        }
+
+        if (!reusedConnection)
+        {
+            LOG_W("[UPLOAD] sending request header failed");
+            connection.countFailure();
+            return false;
+        }
+
+        // the server closed the kept-alive connection while it was idle, nothing went out yet
+        LOG_I("[UPLOAD] kept-alive connection to %s was closed, reconnecting", parts.host);
+        connection.drop();
+    }
+
+    active = true;
+    return true;
+}
+
+void UploadStream::beginDeferred(const char *url, uint8_t *holdBuffer, size_t capacity)
+{
+    holdUrl = url;
+    hold = holdBuffer;
+    holdCapacity = capacity;
+    held = 0;
+}
+
+bool UploadStream::sendHeld(int length)
+{
+    const char *const url = holdUrl;
+    const size_t held_len = held;
+    if (!begin(url, length))
+    {
+        return false;
+    }
+
+    return write(hold, held_len) == held_len;
+}
+
+size_t UploadStream::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t UploadStream::write(const uint8_t *buf, size_t size)
+{
+    if (holding())
+    {
+        if (held + size <= holdCapacity)
+        {
+            memcpy(hold + held, buf, size);
+            held += size;
+            return size;
+        }
+
+        // too large to hold back, the rest follows as it comes
+        if (!sendHeld(-1))
+        {
+            return 0;
+        }
+    }
+
+    if (!active)
+    {
+        return 0;
+    }
+
+    size_t done = 0;
+    while (done < size)
+    {
+        const size_t len = std::min(size - done, CHUNK_SIZE - buffered);
+        memcpy(buffer + CHUNK_HEADER_LEN + buffered, buf + done, len);
+        buffered += len;
+        done += len;
+
+        if (buffered == CHUNK_SIZE && !sendBuffered())
+        {
+            return 0;
+        }
+    }
+
+    totalWritten += size;
+    return size;
+}
+
+bool UploadStream::sendBuffered()
+{
+    if (buffered == 0)
+    {
+        return true;
+    }
+
+    const uint8_t *data = buffer + CHUNK_HEADER_LEN;
+    size_t len = buffered;
+
+    if (chunked)
+    {
+        // frame the chunk in place, so it goes out with a single write
+        char chunk_header[CHUNK_HEADER_LEN + 1];
+        snprintf(chunk_header, sizeof(chunk_header), "%04x\r\n", static_cast<unsigned>(buffered));
+        memcpy(buffer, chunk_header, CHUNK_HEADER_LEN);
+        buffer[CHUNK_HEADER_LEN + buffered] = '\r';
+        buffer[CHUNK_HEADER_LEN + buffered + 1] = '\n';
+
+        data = buffer;
+        len = CHUNK_HEADER_LEN + buffered + CHUNK_TRAILER_LEN;
+    }
+
+    buffered = 0;
+
+    if (client.write(data, len) != len)
+    {
+        LOG_W("[UPLOAD] sending body failed");
+        fail();
+        return false;
+    }
+
+    return true;
+}
+
+int UploadStream::finish()
+{
+    if (!holding())
+    {
+        bool stale = false;
+        return complete(false, stale);
+    }
+
+    // the whole body is still in the hold buffer, it can go out once more if the server closed the
+    // kept-alive connection while it was idle
+    const char *const url = holdUrl;
+    const size_t held_len = held;
+    bool stale = false;
+    const auto send = [&]()
+    {
+        if (!sendHeld(static_cast<int>(held_len)))
+        {
+            return active ? HTTPC_ERROR_SEND_PAYLOAD_FAILED : HTTPC_ERROR_CONNECTION_REFUSED;
+        }
+        return complete(true, stale);
+    };
+
+    int code = send();
+    if (stale)
+    {
+        LOG_I("[UPLOAD] kept-alive connection was closed, sending again");
+        connection.drop();
+        holdUrl = url;
+        held = held_len;
+        code = send();
+    }
+    return code;
+}
+
+int UploadStream::complete(bool resendable, bool &stale)
+{
+    stale = false;
+
+    if (!active)
+    {
+        return HTTPC_ERROR_NOT_CONNECTED;
+    }
+
+    if (!sendBuffered())
+    {
+        return HTTPC_ERROR_SEND_PAYLOAD_FAILED;
+    }
+
+    if (chunked)
+    {
+        constexpr const char *const LAST_CHUNK = "0\r\n\r\n";
+        if (client.write(reinterpret_cast<const uint8_t *>(LAST_CHUNK), 5) != 5)
+        {
+            fail();
+            return HTTPC_ERROR_SEND_PAYLOAD_FAILED;
+        }
+    }
+    else if (totalWritten != static_cast<size_t>(contentLength))
+    {
+        LOG_I("[UPLOAD] body has %u of %d bytes", static_cast<unsigned>(totalWritten), contentLength);
+        fail();
+        return HTTPC_ERROR_SEND_PAYLOAD_FAILED;
+    }
+
+    const uint32_t sent_at = millis();
+    if (!waitForData(sent_at))
+    {
+        // nothing of a response came, on a reused connection most likely because the server
+        // closed it, that is no failure of the host if the request can be sent again
+        stale = resendable && reusedConnection;
+        if (stale)
+        {
+            active = false;
+            buffered = 0;
+        }
+        else
+        {
+            fail();
+        }
+        return HTTPC_ERROR_READ_TIMEOUT;
+    }
+
+    // status line looks like "HTTP/1.1 200 OK"
+    char line[128];
+    if (!readLine(line, sizeof(line), sent_at))
+    {
+        fail();
+        return HTTPC_ERROR_READ_TIMEOUT;
+    }
+
+    int code = 0;
+    if (strncmp(line, "HTTP/1.", 7) == 0 && strlen(line) >= 12)
+    {
+        code = atoi(line + 9);
+    }
+
+    if (code <= 0)
+    {
+        fail();
+        return HTTPC_ERROR_NO_HTTP_SERVER;
+    }
+
+    // HTTP/1.1 connections stay open unless the server says otherwise
+    bool keep_alive = line[7] == '1';
+    bool body_chunked = false;
+    int body_length = -1;
+    acceptPostValue[0] = '\0';
+
+    while (true)
+    {
+        if (!readLine(line, sizeof(line), millis()))
+        {
+            fail();
+            return HTTPC_ERROR_READ_TIMEOUT;
+        }
+
+        if (line[0] == '\0')
+        {
+            break;
+        }
+
+        if (strncasecmp(line, "Content-Length:", 15) == 0)
+        {
+            body_length = atoi(line + 15);
+        }
+        else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+        {
+            body_chunked = strcasestr(line + 18, "chunked") != nullptr;
+        }
+        else if (strncasecmp(line, "Connection:", 11) == 0)
+        {
+            keep_alive = strcasestr(line + 11, "close") == nullptr;
+        }
+        else if (strncasecmp(line, "Accept-Post:", 12) == 0)
+        {
+            const char *value = line + 12;
+            while (*value == ' ')
+            {
+                ++value;
+            }
+            snprintf(acceptPostValue, sizeof(acceptPostValue), "%s", value);
+        }
+    }
+
+    // without a length the body only ends when the server closes the connection
+    if (!body_chunked && body_length < 0 && code != HTTP_CODE_NO_CONTENT && code != HTTP_CODE_NOT_MODIFIED)
+    {
+        keep_alive = false;
+    }
+
+    if (!keep_alive)
+    {
+        client.stop();
+    }
+    else if (!readResponseBody(body_length, body_chunked, millis()))
+    {
+        connection.countFailure();
+    }
+
+    active = false;
+
+    return code;
+}
+
+void UploadStream::abort()
+{
+    if (holding())
+    {
+        // the endpoint never heard of it, the connection can stay
+        holdUrl = nullptr;
+        return;
+    }
+
+    // not the connection's fault, it is only closed because the endpoint already has part of
+    // the request
+    if (active)
+    {
+        connection.drop();
+    }
+    active = false;
+    buffered = 0;
+}
+
+void UploadStream::fail()
+{
+    connection.countFailure();
+    active = false;
+    buffered = 0;
+}
+
+bool UploadStream::readResponseBody(int bodyLength, bool bodyChunked, uint32_t startMillis)
+{
+    if (!bodyChunked)
+    {
+        return bodyLength <= 0 || skipBytes(bodyLength, startMillis);
+    }
+
+    char line[32];
+    while (true)
+    {
+        if (!readLine(line, sizeof(line), startMillis))
+        {
+            return false;
+        }
+
+        const size_t chunk_len = strtoul(line, nullptr, 16);
+        if (chunk_len == 0)
+        {
+            // skip trailers up to the final empty line
+            do
+            {
+                if (!readLine(line, sizeof(line), startMillis))
+                {
+                    return false;
+                }
+            } while (line[0] != '\0');
+
+            return true;
+        }
+
+        // the chunk data is followed by a "\r\n"
+        if (!skipBytes(chunk_len, startMillis) || !readLine(line, sizeof(line), startMillis))
+        {
+            return false;
+        }
+    }
+}
+
+bool UploadStream::skipBytes(size_t len, uint32_t startMillis)
+{
+    uint8_t discard[64];
+
+    while (len > 0)
+    {
+        if (!waitForData(startMillis))
+        {
+            return false;
+        }
+
+        const int read = client.read(discard, std::min(len, sizeof(discard)));
+        if (read > 0)
+        {
+            len -= read;
+        }
+    }
+
+    return true;
+}
+
+bool UploadStream::waitForData(uint32_t startMillis)
+{
+    while (!client.available())
+    {
+        if (!client.connected() || millis() - startMillis > responseTimeoutMs)
+        {
+            return false;
+        }
+        delay(1);
+    }
+    return true;
+}
+
+bool UploadStream::readLine(char *line, size_t len, uint32_t startMillis)
+{
+    size_t pos = 0;
+
+    while (true)
+    {
+        if (!waitForData(startMillis))
+        {
+            return false;
+        }
+
+        const int c = client.read();
+        if (c < 0 || c == '\r')
+        {
+            continue;
+        }
+        if (c == '\n')
+        {
+            break;
+        }
+        // overlong lines get truncated, the rest is skipped
+        if (pos + 1 < len)
+        {
+            line[pos++] = static_cast<char>(c);
+        }
+    }
+
+    line[pos] = '\0';
+    return true;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <array>
+
+#include <Arduino.h>
+
+#include "deadline.h"
+#include "host_connection.h"
+
+enum class UrlScheme : uint8_t
+{
+    HTTP,
+    HTTPS,
+    COAP, // CoAP over UDP, see CoapSink
+    MQTTS // MQTT 5 over TLS, see MqttSink
+};
+
+struct UrlParts
+{
+    UrlScheme scheme{UrlScheme::HTTPS};
+    char host[64]{};
+    uint16_t port{443};
+    bool defaultPort{true};
+    const char *path{"/"}; // points into the parsed url
+};
+
+// splits "https://host[:port]/path" (or http://, coap://, mqtts://) into its parts, returns
+// false for anything else
+bool parseUrl(const char *url, UrlParts &parts);
+
+// POSTs a request body that is written to it piece by piece, so the body never has to
+// exist in memory as a whole. With a known length the body is sent with Content-Length,
+// otherwise with chunked transfer encoding. The response is read to the end, so the
+// connection can be kept alive. Errors are reported with the HTTPC_ERROR_* codes.
+class UploadStream : public Stream
+{
+public:
+    static constexpr size_t CHUNK_SIZE = 512;
+    static constexpr size_t MAX_HEADERS = 4;
+
+    explicit UploadStream(HostConnection &connection);
+
+    // name and value have to stay valid until the request header was sent
+    void addHeader(const char *name, const char *value);
+    void setResponseTimeout(uint32_t timeoutMs) { responseTimeoutMs = timeoutMs; }
+
+    // connects and sends the request header, contentLength < 0 selects chunked encoding
+    bool begin(const char *url, int contentLength = -1);
+
+    // holds the body back in holdBuffer instead, until it is known whether it has to be sent at
+    // all. The request only goes out once more than capacity bytes were written, chunked, or with
+    // finish(), with the Content-Length of what was held. Until then abort() sends nothing.
+    // url and holdBuffer have to stay valid until finish() or abort().
+    void beginDeferred(const char *url, uint8_t *holdBuffer, size_t capacity);
+
+    // nothing went out yet
+    bool holding() const { return holdUrl != nullptr; }
+
+    // sends the rest of the body and returns the HTTP status code of the response. A request that
+    // was held as a whole goes out once more on a new connection if the kept-alive one it was sent
+    // on got no response, the server closed it while it was idle
+    int finish();
+
+    // drops the connection, the endpoint never sees a complete request. A deliberate abort is not
+    // counted as a failure of the connection
+    void abort();
+
+    size_t bytesWritten() const { return totalWritten; }
+
+    // since begin() was called
+    uint32_t elapsedMs() const { return Deadline::msSince(beganAt); }
+
+    // the Accept-Post header of the response, the media types the endpoint takes, "" if it sent none
+    const char *acceptPost() const { return acceptPostValue; }
+
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buf, size_t size) override;
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    void flush() override {}
+
+private:
+    // room for the "xxxx\r\n" chunk header in front of and the "\r\n" behind the data
+    static constexpr size_t CHUNK_HEADER_LEN = 6;
+    static constexpr size_t CHUNK_TRAILER_LEN = 2;
+
+    bool sendBuffered();
+    // counts the failure and drops the connection
+    void fail();
+    // begins the held request with contentLength and passes the held bytes on
+    bool sendHeld(int contentLength);
+    // sends what is buffered and reads the response. Without a response on a reused connection,
+    // stale is set instead of counting a failure when the request can be sent again (resendable)
+    int complete(bool resendable, bool &stale);
+    bool readResponseBody(int bodyLength, bool bodyChunked, uint32_t startMillis);
+    bool readLine(char *line, size_t len, uint32_t startMillis);
+    bool skipBytes(size_t len, uint32_t startMillis);
+    // for a byte of the response, false if the connection closed or stalled
+    bool waitForData(uint32_t startMillis);
+
+    HostConnection &connection;
+    WiFiClient &client;
+
+    struct Header
+    {
+        const char *name;
+        const char *value;
+    };
+    std::array<Header, MAX_HEADERS> headers{};
+    uint8_t headerCount{0};
+
+    uint32_t responseTimeoutMs{10000};
+
+    int64_t beganAt{0};
+    bool active{false};
+    bool reusedConnection{false}; // the request went out on an already open connection
+    bool chunked{true};
+    int contentLength{-1};
+    size_t totalWritten{0};
+
+    const char *holdUrl{nullptr};
+    uint8_t *hold{nullptr};
+    size_t holdCapacity{0};
+    size_t held{0};
+
+    char acceptPostValue[64]{};
+
+    uint8_t buffer[CHUNK_HEADER_LEN + CHUNK_SIZE + CHUNK_TRAILER_LEN];
+    size_t buffered{0};
+};
@@ -0,0 +1,76 @@
+#include "wall_clock.h"
+
+#include <sys/time.h>
+
+#include "logger.h"
+
+namespace
+{
+// anything earlier means the clock was never set since power on
+constexpr time_t CLOCK_VALID_AFTER = 1577836800; // 2020-01-01
+
+constexpr time_t MAX_CLOCK_ERROR_S = 60;
+
+// days since 1970-01-01 of a date in the proleptic Gregorian calendar
+int64_t daysFromCivil(int year, unsigned month, unsigned day)
+{
+    year -= month <= 2;
+    const int era = (year >= 0 ? year : year - 399) / 400;
+    const unsigned year_of_era = static_cast<unsigned>(year - era * 400);
+    const unsigned day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const unsigned day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return static_cast<int64_t>(era) * 146097 + day_of_era - 719468;
+}
+} // namespace
+
+bool clockValid()
+{
+    return time(nullptr) > CLOCK_VALID_AFTER;
+}
+
+uint32_t unixTime()
+{
+    return clockValid() ? static_cast<uint32_t>(time(nullptr)) : 0;
+}
+
+time_t syncClock(const char *dateHeader)
+{
+    time_t date = 0;
+    if (!parseHttpDate(dateHeader, date))
+    {
+        return 0;
+    }
+
+    const time_t now = time(nullptr);
+    if (now < date - MAX_CLOCK_ERROR_S || now > date + MAX_CLOCK_ERROR_S)
+    {
+        const timeval tv{date, 0};
+        settimeofday(&tv, nullptr);
+        LOG_I("[CLOCK] set to %ld from the Date header", static_cast<long>(date));
+    }
+
+    return date;
+}
+
+bool parseHttpDate(const char *value, time_t &result)
+{
+    static constexpr const char *const MONTHS = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    int day, year, hour, minute, second;
+    char month_name[4]{};
+
+    if (sscanf(value, "%*3s, %d %3s %d %d:%d:%d GMT", &day, month_name, &year, &hour, &minute, &second) != 6)
+    {
+        return false;
+    }
+
+    const char *month_pos = strstr(MONTHS, month_name);
+    if (strlen(month_name) != 3 || !month_pos || (month_pos - MONTHS) % 3 != 0)
+    {
+        return false;
+    }
+
+    const unsigned month = (month_pos - MONTHS) / 3 + 1;
+    result = daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+    return true;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <Arduino.h>
+
+// NTP is not reachable before the portal login, so the clock is set from the Date header of
+// Railnet's responses instead. A second of accuracy is plenty for the FIS samples.
+
+// the clock was set since power on
+bool clockValid();
+
+// unix time, 0 if the clock is not set
+uint32_t unixTime();
+
+// sets the clock from an HTTP Date header value if it is off by more than a minute,
+// returns the time of the header, 0 if it could not be parsed
+time_t syncClock(const char *dateHeader);
+
+// parses an IMF-fixdate as sent in the HTTP Date header ("Sun, 06 Nov 1994 08:49:37 GMT")
+bool parseHttpDate(const char *value, time_t &result);
@@ -0,0 +1,285 @@
+#include "wifi_link.h"
+
+#include <algorithm>
+
+#include <Preferences.h>
+#include <esp_attr.h>
+
+#include "gzip_stream.h"
+#include "logger.h"
+
+namespace
+{
+constexpr const char *const NAMESPACE = "wifi";
+constexpr uint8_t FORMAT_VERSION = 1;
+
+// survives a soft reset but not a power cycle, the check tells whether it holds a lease
+RTC_NOINIT_ATTR WifiLease rtcLease;
+RTC_NOINIT_ATTR uint32_t rtcLeaseCheck;
+
+uint32_t leaseCheck(const WifiLease &lease)
+{
+    return crc32Update(FORMAT_VERSION, reinterpret_cast<const uint8_t *>(&lease), sizeof(lease));
+}
+} // namespace
+
+void WifiLink::begin()
+{
+    // the link is kept up here, the driver must not reconnect on its own or write every
+    // directed connect to flash
+    WiFi.persistent(false);
+    WiFi.setAutoReconnect(false);
+    // if it comes to a scan, the strongest AP wins, not the first one found
+    WiFi.setScanMethod(WIFI_ALL_CHANNEL_SCAN);
+    WiFi.setSortMethod(WIFI_CONNECT_AP_BY_SIGNAL);
+    WiFi.onEvent([this](arduino_event_id_t event, arduino_event_info_t info) { onEvent(event, info); });
+
+    loadLease();
+
+    downSince = Deadline::now();
+    if (haveLease)
+    {
+        connectDirected(lease.bssid, lease.channel);
+    }
+    else
+    {
+        connectScanning();
+    }
+}
+
+void WifiLink::handover(const uint8_t *bssid, uint8_t channel)
+{
+    downSince = Deadline::now();
+    associated = false;
+    gotIp = false;
+    connectDirected(bssid, channel);
+}
+
+WifiLink::Event WifiLink::poll()
+{
+    if (phase == Phase::UP)
+    {
+        if (!disconnected.exchange(false))
+        {
+            return Event::NONE;
+        }
+
+        LOG_W("[WIFI] disconnected, reason %u", disconnectReason.load());
+        downSince = Deadline::now();
+        associated = false;
+        gotIp = false;
+
+        if (haveLease)
+        {
+            connectDirected(lease.bssid, lease.channel);
+        }
+        else
+        {
+            connectScanning();
+        }
+        return Event::DOWN;
+    }
+
+    if (associated.exchange(false))
+    {
+        // the AP took us, from now on it is up to DHCP
+        attemptDeadline.start(SCAN_TIMEOUT_MS);
+        dhcpDeadline.start(DHCP_TIMEOUT_MS);
+    }
+
+    if (gotIp.exchange(false))
+    {
+        return linkUp();
+    }
+
+    if (dhcpDeadline.expired())
+    {
+        dhcpDeadline.stop();
+        if (useCachedLease())
+        {
+            return linkUp();
+        }
+    }
+
+    // leaving the AP we were on for the one we connect to is no failure
+    const bool failed = disconnected.exchange(false) && disconnectReason != WIFI_REASON_ASSOC_LEAVE;
+
+    if (failed || attemptDeadline.expired())
+    {
+        if (phase == Phase::DIRECTED)
+        {
+            LOG_W("[WIFI] cached access point did not take us, reason %u", disconnectReason.load());
+        }
+        dhcpDeadline.stop();
+        connectScanning();
+    }
+
+    return Event::NONE;
+}
+
+void WifiLink::printStats() const
+{
+    const uint32_t average_ms = connectCount ? static_cast<uint32_t>(totalConnectMs / connectCount) : 0;
+    LOG_I("[WIFI] %u connects, %u directed, %u with the cached lease, last %u ms, average %u ms, max %u ms",
+          connectCount, directedCount, staticCount, lastConnectMs, average_ms, maxConnectMs);
+}
+
+// runs in the event task of the driver
+void WifiLink::onEvent(arduino_event_id_t event, arduino_event_info_t info)
+{
+    switch (event)
+    {
+    case ARDUINO_EVENT_WIFI_STA_CONNECTED:
+        associated = true;
+        break;
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+        gotIp = true;
+        break;
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+        disconnectReason = info.wifi_sta_disconnected.reason;
+        disconnected = true;
+        break;
+    default:
+        break;
+    }
+}
+
+void WifiLink::connectDirected(const uint8_t *bssid, uint8_t channel)
+{
+    phase = Phase::DIRECTED;
+    useDhcp();
+
+    LOG_I("[WIFI] connecting to %02x:%02x:%02x:%02x:%02x:%02x on channel %u", bssid[0], bssid[1],
+          bssid[2], bssid[3], bssid[4], bssid[5], channel);
+    WiFi.begin(ssid, nullptr, channel, bssid);
+    attemptDeadline.start(DIRECTED_TIMEOUT_MS);
+}
+
+void WifiLink::connectScanning()
+{
+    phase = Phase::SCANNING;
+    useDhcp();
+
+    LOG_I("[WIFI] scanning for %s", ssid);
+    WiFi.begin(ssid);
+    attemptDeadline.start(SCAN_TIMEOUT_MS);
+}
+
+// a cached lease configured for the last connection must not stick to the next one
+void WifiLink::useDhcp()
+{
+    if (staticIp)
+    {
+        WiFi.config(IPAddress(), IPAddress(), IPAddress());
+        staticIp = false;
+    }
+}
+
+bool WifiLink::useCachedLease()
+{
+    if (!haveLease || !leaseTrusted)
+    {
+        return false;
+    }
+
+    LOG_W("[WIFI] no answer from DHCP, using the cached lease");
+    if (!WiFi.config(IPAddress(lease.ip), IPAddress(lease.gateway), IPAddress(lease.subnet), IPAddress(lease.dns)))
+    {
+        return false;
+    }
+
+    staticIp = true;
+    ++staticCount;
+    return true;
+}
+
+WifiLink::Event WifiLink::linkUp()
+{
+    const bool directed = phase == Phase::DIRECTED;
+    const uint32_t elapsed_ms = static_cast<uint32_t>((Deadline::now() - downSince) / 1000);
+
+    phase = Phase::UP;
+    attemptDeadline.stop();
+    dhcpDeadline.stop();
+
+    ++connectCount;
+    if (directed)
+    {
+        ++directedCount;
+    }
+    lastConnectMs = elapsed_ms;
+    maxConnectMs = std::max(maxConnectMs, elapsed_ms);
+    totalConnectMs += elapsed_ms;
+
+    LOG_I("[WIFI] up after %u ms, %s, %s: %s", elapsed_ms, directed ? "directed" : "scanned",
+          staticIp ? "cached lease" : "DHCP", WiFi.localIP().toString().c_str());
+
+    if (!staticIp)
+    {
+        saveLease();
+    }
+    return Event::UP;
+}
+
+void WifiLink::loadLease()
+{
+    if (rtcLeaseCheck == leaseCheck(rtcLease))
+    {
+        lease = rtcLease;
+        haveLease = true;
+        leaseTrusted = true;
+        LOG_I("[WIFI] lease restored from RTC memory");
+        return;
+    }
+
+    Preferences preferences;
+    if (!preferences.begin(NAMESPACE, true))
+    {
+        return;
+    }
+
+    if (preferences.getUChar("version", 0) == FORMAT_VERSION &&
+        preferences.getBytes("lease", &lease, sizeof(lease)) == sizeof(lease))
+    {
+        haveLease = true;
+        LOG_I("[WIFI] access point restored from NVS");
+    }
+    preferences.end();
+}
+
+void WifiLink::saveLease()
+{
+    WifiLease current{};
+    memcpy(current.bssid, WiFi.BSSID(), sizeof(current.bssid));
+    current.channel = WiFi.channel();
+    current.ip = WiFi.localIP();
+    current.gateway = WiFi.gatewayIP();
+    current.subnet = WiFi.subnetMask();
+    current.dns = WiFi.dnsIP(0);
+
+    rtcLease = current;
+    rtcLeaseCheck = leaseCheck(current);
+
+    const bool changed = !haveLease || memcmp(&current, &lease, sizeof(current)) != 0;
+    lease = current;
+    haveLease = true;
+    leaseTrusted = true;
+
+    // NVS is only written on a handover or a new lease, not on every reconnect
+    if (!changed)
+    {
+        return;
+    }
+
+    Preferences preferences;
+    if (!preferences.begin(NAMESPACE, false))
+    {
+        LOG_W("[WIFI] opening NVS failed");
+        return;
+    }
+
+    preferences.remove("version");
+    preferences.putBytes("lease", &lease, sizeof(lease));
+    preferences.putUChar("version", FORMAT_VERSION);
+    preferences.end();
+}
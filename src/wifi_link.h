@@ -0,0 +1,101 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#include <atomic>
+
+#include "deadline.h"
+
+// what is needed to get back onto the network without a scan and, if DHCP does not answer,
+// without DHCP
+struct WifiLease
+{
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint32_t ip;
+    uint32_t gateway;
+    uint32_t subnet;
+    uint32_t dns;
+};
+
+// Keeps the station connected to one SSID. The first attempt after a disconnect or a reboot is
+// a directed connect to the BSSID and channel of the last good connection, which needs no scan.
+// Only if that AP does not take us within DIRECTED_TIMEOUT_MS the SSID is scanned for. If DHCP
+// does not answer within DHCP_TIMEOUT_MS the last lease is configured statically, but only one
+// from this boot or from RTC memory (a soft reset), one from NVS may belong to another train.
+//
+// The driver reports through WiFi.onEvent, poll() acts on it from the loop task, nothing blocks.
+class WifiLink
+{
+public:
+    static constexpr uint32_t DIRECTED_TIMEOUT_MS = 3000;
+    static constexpr uint32_t SCAN_TIMEOUT_MS = 15000;
+    static constexpr uint32_t DHCP_TIMEOUT_MS = 4000;
+
+    enum class Event : uint8_t
+    {
+        NONE,
+        UP,  // there is an IP now
+        DOWN // the link was lost, a reconnect is running
+    };
+
+    explicit WifiLink(const char *ssid) : ssid{ssid} {}
+
+    // WiFi has to be in station mode, starts the first connect
+    void begin();
+
+    // call it from the loop, drives the connect attempts
+    Event poll();
+
+    bool up() const { return phase == Phase::UP; }
+
+    // moves to another AP of the SSID, up() is false until the link is up there. If that AP
+    // does not take us the SSID is scanned for as after any failed directed connect.
+    void handover(const uint8_t *bssid, uint8_t channel);
+
+    void printStats() const;
+
+private:
+    enum class Phase : uint8_t
+    {
+        DIRECTED, // connecting to the cached BSSID, or the one handed over to
+        SCANNING, // connecting to whichever AP of the SSID the driver finds
+        UP
+    };
+
+    void onEvent(arduino_event_id_t event, arduino_event_info_t info);
+
+    void connectDirected(const uint8_t *bssid, uint8_t channel);
+    void connectScanning();
+    void useDhcp();
+    bool useCachedLease();
+    Event linkUp();
+
+    void loadLease();
+    void saveLease();
+
+    const char *ssid;
+    Phase phase{Phase::SCANNING};
+
+    Deadline attemptDeadline;
+    Deadline dhcpDeadline;       // from the association on, until a lease is expected
+    int64_t downSince{0};        // when the link was lost, or the first connect started
+    bool staticIp{false};
+
+    WifiLease lease{};
+    bool haveLease{false};
+    bool leaseTrusted{false}; // the IP part may be used without DHCP
+
+    std::atomic<bool> associated{false};
+    std::atomic<bool> gotIp{false};
+    std::atomic<bool> disconnected{false};
+    std::atomic<uint8_t> disconnectReason{0};
+
+    uint32_t connectCount{0};
+    uint32_t directedCount{0}; // connects that needed no scan
+    uint32_t staticCount{0};   // connects that went without DHCP
+    uint32_t lastConnectMs{0};
+    uint32_t maxConnectMs{0};
+    uint64_t totalConnectMs{0};
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+// What the parsers take from the Arduino core, for the native env. Print and Stream have the
+// virtuals of the core, so the classes that override them build unchanged.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+class Print
+{
+public:
+    virtual ~Print() = default;
+
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buf, size_t size)
+    {
+        size_t written = 0;
+        while (written < size && write(buf[written]))
+        {
+            ++written;
+        }
+        return written;
+    }
+    size_t write(const char *str) { return write(reinterpret_cast<const uint8_t *>(str), strlen(str)); }
+
+    virtual void flush() {}
+};
+
+class Stream : public Print
+{
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
@@ -0,0 +1,264 @@
+#pragma once
+
+// A captive portal page and a combined.json in the shape Railnet serves them, the tokens, ids and
+// positions are made up. The page has a language switch with a _token before the login form and a
+// feedback form behind it, the document nests arrays and objects around the FIS fields.
+
+constexpr const char PORTAL_PAGE[] = R"capture(<!DOCTYPE html>
+<html lang="en">
+<head>
+  <meta charset="utf-8">
+  <meta name="viewport" content="width=device-width, initial-scale=1">
+  <meta name="csrf-token" content="c3ZrUGx0bXRsTk9wYW5zZWxkV3l3cWJxbHZzZ0x6">
+  <title>Railnet - Connect to Internet</title>
+  <link rel="stylesheet" href="/assets/css/app.css?id=5a1f2e">
+  <style>
+    .connect-form input[type="submit"] { width: 100%; padding: .75rem; }
+    .offer { display: inline-block; margin: .5rem; }
+  </style>
+  <script>
+    window.railnet = {"locale":"en","connected":false,"value":"not a form value"};
+  </script>
+</head>
+<body class="page page--connect">
+  <header class="header">
+    <form class="language-switch" method="post" action="/language">
+      <input type="hidden" name="_token" value="not-the-login-token">
+      <select name="locale" onchange="this.form.submit()">
+        <option value="de">Deutsch</option>
+        <option value="en" selected>English</option>
+      </select>
+    </form>
+  </header>
+  <main class="main">
+    <h1>Welcome on board</h1>
+    <p>Free WiFi on ÖBB trains. Please accept the terms of use to connect.</p>
+    <form class="connect-form" method="POST" action="https://railnet.oebb.at/en/connecttoweb">
+      <input type="hidden"
+             name="_token" value="c3ZrUGx0bXRsTk9wYW5zZWxkV3l3cWJxbHZzZ0x6">
+      <input value="5f3e2d1c-0b9a-4876-a5d4-c3b2a1908f7e" type="hidden" name="_ceid">
+      <label class="checkbox">
+        <input type="checkbox" id="checkit" name="checkit" value="1" required>
+        I accept the <a href="/en/terms">terms of use</a>
+      </label>
+      <input type=hidden name="form_type" value="free">
+      <input type="submit" value="Connect to internet">
+    </form>
+    <ul class="offers">
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/1" title="Offer 1">
+          <img src="/assets/media/offers/1.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 1</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/2" title="Offer 2">
+          <img src="/assets/media/offers/2.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 2</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/3" title="Offer 3">
+          <img src="/assets/media/offers/3.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 3</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/4" title="Offer 4">
+          <img src="/assets/media/offers/4.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 4</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/5" title="Offer 5">
+          <img src="/assets/media/offers/5.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 5</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/6" title="Offer 6">
+          <img src="/assets/media/offers/6.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 6</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/7" title="Offer 7">
+          <img src="/assets/media/offers/7.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 7</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/8" title="Offer 8">
+          <img src="/assets/media/offers/8.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 8</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/9" title="Offer 9">
+          <img src="/assets/media/offers/9.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 9</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/10" title="Offer 10">
+          <img src="/assets/media/offers/10.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 10</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/11" title="Offer 11">
+          <img src="/assets/media/offers/11.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 11</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/12" title="Offer 12">
+          <img src="/assets/media/offers/12.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 12</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/13" title="Offer 13">
+          <img src="/assets/media/offers/13.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 13</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/14" title="Offer 14">
+          <img src="/assets/media/offers/14.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 14</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/15" title="Offer 15">
+          <img src="/assets/media/offers/15.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 15</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/16" title="Offer 16">
+          <img src="/assets/media/offers/16.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 16</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/17" title="Offer 17">
+          <img src="/assets/media/offers/17.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 17</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/18" title="Offer 18">
+          <img src="/assets/media/offers/18.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 18</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/19" title="Offer 19">
+          <img src="/assets/media/offers/19.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 19</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/20" title="Offer 20">
+          <img src="/assets/media/offers/20.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 20</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/21" title="Offer 21">
+          <img src="/assets/media/offers/21.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 21</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/22" title="Offer 22">
+          <img src="/assets/media/offers/22.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 22</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/23" title="Offer 23">
+          <img src="/assets/media/offers/23.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 23</span>
+        </a>
+      </li>
+      <li class="offer">
+        <a href="https://railnet.oebb.at/en/offers/24" title="Offer 24">
+          <img src="/assets/media/offers/24.jpg" alt="" width="320" height="180" loading="lazy">
+          <span class="offer__title">Offer 24</span>
+        </a>
+      </li>
+    </ul>
+  </main>
+  <footer class="footer">
+    <form class="feedback" method="post" action="https://railnet.oebb.at/en/feedback">
+      <input type="hidden" name="_token" value="c3ZrUGx0bXRsTk9wYW5zZWxkV3l3cWJxbHZzZ0x6">
+      <textarea name="message"></textarea>
+    </form>
+    <p>&copy; ÖBB-Personenverkehr AG</p>
+  </footer>
+  <script src="/assets/js/app.js?id=77c1d0" defer></script>
+</body>
+</html>
+)capture";
+
+constexpr const char *const PORTAL_TOKEN = "c3ZrUGx0bXRsTk9wYW5zZWxkV3l3cWJxbHZzZ0x6";
+constexpr const char *const PORTAL_CEID = "5f3e2d1c-0b9a-4876-a5d4-c3b2a1908f7e";
+constexpr const char *const PORTAL_CHECKIT = "1";
+constexpr const char *const PORTAL_FORM_TYPE = "free";
+
+constexpr const char COMBINED_JSON[] = R"capture({
+  "operator": "OEBB",
+  "trainType": "RJX",
+  "tripNumber": "662",
+  "lineNumber": null,
+  "latitude": 48.1590594,
+  "longitude": 15.5267453,
+  "speed": 187,
+  "delay": 3,
+  "altitude": 271.4,
+  "heading": 271.9,
+  "gpsValid": true,
+  "destination": {"de": "Bregenz", "en": "Bregenz", "all": "Bregenz"},
+  "currentStation": {"id": "8100108", "name": {"de": "St. P\u00f6lten Hbf", "en": "St. P\u00f6lten Hbf"}, "track": "3"},
+  "nextStation": {"id": "8100013", "name": {"de": "Amstetten", "en": "Amstetten"}, "track": "2", "arrival": {"scheduled": "07:38", "forecast": "07:41"}},
+  "wagons": [[1, "first"], [2, "first"], [3, "bistro"], [4, "second", {"seats": 72, "bikes": 0}], [5, "second", {}], [6, "second", []]],
+  "notifications": [],
+  "stations": [
+    {"id":"8100000","name":{"de":"Wien Hbf","en":"Wien Hbf","all":"Wien Hbf"},"track":"1","arrival":{"scheduled":"06:00","forecast":"06:03"},"departure":{"scheduled":"06:02","forecast":"06:05"},"served":true,"distanceFromStart":0},
+    {"id":"8100037","name":{"de":"Wien Meidling","en":"Wien Meidling","all":"Wien Meidling"},"track":"2","arrival":{"scheduled":"06:17","forecast":"06:20"},"departure":{"scheduled":"06:19","forecast":"06:22"},"served":true,"distanceFromStart":31400},
+    {"id":"8100074","name":{"de":"St. Pölten Hbf","en":"St. Pölten Hbf","all":"St. Pölten Hbf"},"track":"3","arrival":{"scheduled":"06:34","forecast":"06:37"},"departure":{"scheduled":"06:36","forecast":"06:39"},"served":true,"distanceFromStart":62800},
+    {"id":"8100111","name":{"de":"Amstetten","en":"Amstetten","all":"Amstetten"},"track":"4","arrival":{"scheduled":"07:51","forecast":"07:54"},"departure":{"scheduled":"07:53","forecast":"07:56"},"served":true,"distanceFromStart":94200},
+    {"id":"8100148","name":{"de":"Linz Hbf","en":"Linz Hbf","all":"Linz Hbf"},"track":"5","arrival":{"scheduled":"07:08","forecast":"07:11"},"departure":{"scheduled":"07:10","forecast":"07:13"},"served":true,"distanceFromStart":125600},
+    {"id":"8100185","name":{"de":"Wels Hbf","en":"Wels Hbf","all":"Wels Hbf"},"track":"6","arrival":{"scheduled":"07:25","forecast":"07:28"},"departure":{"scheduled":"07:27","forecast":"07:30"},"served":false,"distanceFromStart":157000},
+    {"id":"8100222","name":{"de":"Attnang-Puchheim","en":"Attnang-Puchheim","all":"Attnang-Puchheim"},"track":"7","arrival":{"scheduled":"08:42","forecast":"08:45"},"departure":{"scheduled":"08:44","forecast":"08:47"},"served":false,"distanceFromStart":188400},
+    {"id":"8100259","name":{"de":"Vöcklabruck","en":"Vöcklabruck","all":"Vöcklabruck"},"track":"8","arrival":{"scheduled":"08:59","forecast":"08:02"},"departure":{"scheduled":"08:01","forecast":"08:04"},"served":false,"distanceFromStart":219800},
+    {"id":"8100296","name":{"de":"Salzburg Hbf","en":"Salzburg Hbf","all":"Salzburg Hbf"},"track":"9","arrival":{"scheduled":"08:16","forecast":"08:19"},"departure":{"scheduled":"08:18","forecast":"08:21"},"served":false,"distanceFromStart":251200},
+    {"id":"8100333","name":{"de":"Kufstein","en":"Kufstein","all":"Kufstein"},"track":"1","arrival":{"scheduled":"09:33","forecast":"09:36"},"departure":{"scheduled":"09:35","forecast":"09:38"},"served":false,"distanceFromStart":282600},
+    {"id":"8100370","name":{"de":"Wörgl Hbf","en":"Wörgl Hbf","all":"Wörgl Hbf"},"track":"2","arrival":{"scheduled":"09:50","forecast":"09:53"},"departure":{"scheduled":"09:52","forecast":"09:55"},"served":false,"distanceFromStart":314000},
+    {"id":"8100407","name":{"de":"Jenbach","en":"Jenbach","all":"Jenbach"},"track":"3","arrival":{"scheduled":"09:07","forecast":"09:10"},"departure":{"scheduled":"09:09","forecast":"09:12"},"served":false,"distanceFromStart":345400},
+    {"id":"8100444","name":{"de":"Innsbruck Hbf","en":"Innsbruck Hbf","all":"Innsbruck Hbf"},"track":"4","arrival":{"scheduled":"10:24","forecast":"10:27"},"departure":{"scheduled":"10:26","forecast":"10:29"},"served":false,"distanceFromStart":376800},
+    {"id":"8100481","name":{"de":"Landeck-Zams","en":"Landeck-Zams","all":"Landeck-Zams"},"track":"5","arrival":{"scheduled":"10:41","forecast":"10:44"},"departure":{"scheduled":"10:43","forecast":"10:46"},"served":false,"distanceFromStart":408200},
+    {"id":"8100518","name":{"de":"St. Anton am Arlberg","en":"St. Anton am Arlberg","all":"St. Anton am Arlberg"},"track":"6","arrival":{"scheduled":"10:58","forecast":"10:01"},"departure":{"scheduled":"10:00","forecast":"10:03"},"served":false,"distanceFromStart":439600},
+    {"id":"8100555","name":{"de":"Bludenz","en":"Bludenz","all":"Bludenz"},"track":"7","arrival":{"scheduled":"11:15","forecast":"11:18"},"departure":{"scheduled":"11:17","forecast":"11:20"},"served":false,"distanceFromStart":471000},
+    {"id":"8100592","name":{"de":"Feldkirch","en":"Feldkirch","all":"Feldkirch"},"track":"8","arrival":{"scheduled":"11:32","forecast":"11:35"},"departure":{"scheduled":"11:34","forecast":"11:37"},"served":false,"distanceFromStart":502400},
+    {"id":"8100629","name":{"de":"Dornbirn","en":"Dornbirn","all":"Dornbirn"},"track":"9","arrival":{"scheduled":"11:49","forecast":"11:52"},"departure":{"scheduled":"11:51","forecast":"11:54"},"served":false,"distanceFromStart":533800},
+    {"id":"8100666","name":{"de":"Bregenz","en":"Bregenz","all":"Bregenz"},"track":"1","arrival":{"scheduled":"12:06","forecast":"12:09"},"departure":{"scheduled":"12:08","forecast":"12:11"},"served":false,"distanceFromStart":565200}
+  ]
+}
+)capture";
+
+// the FIS_FIELDS in combined.json, in their order, strings as written without the quotes
+constexpr const char *const COMBINED_JSON_VALUES[] = {
+    "48.1590594",
+    "15.5267453",
+    "187",
+    "3",
+    "RJX",
+    "662",
+    "Bregenz",
+    "St. P\\u00f6lten Hbf",
+    "Amstetten",
+    "07:41",
+};
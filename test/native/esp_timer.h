@@ -0,0 +1,6 @@
+#pragma once
+
+#include <cstdint>
+
+// microseconds on the steady clock of the host, see native.cpp
+int64_t esp_timer_get_time();
@@ -0,0 +1,142 @@
+#include "native.h"
+
+#include <chrono>
+#include <cstdarg>
+#include <new>
+
+#include <sys/resource.h>
+
+#include "logger.h"
+
+namespace
+{
+AllocationStats allocations;
+uint64_t parsed[static_cast<size_t>(Parser::COUNT)]{};
+uint64_t parseUs[static_cast<size_t>(Parser::COUNT)]{};
+
+// the size is kept in front of the block, so delete knows what it gives back
+constexpr size_t SIZE_ROOM = alignof(std::max_align_t);
+
+void *countedAlloc(size_t size)
+{
+    uint8_t *block = static_cast<uint8_t *>(malloc(size + SIZE_ROOM));
+    if (!block)
+    {
+        throw std::bad_alloc();
+    }
+
+    memcpy(block, &size, sizeof(size));
+    ++allocations.allocations;
+    allocations.liveBytes += size;
+    if (allocations.liveBytes > allocations.peakBytes)
+    {
+        allocations.peakBytes = allocations.liveBytes;
+    }
+    return block + SIZE_ROOM;
+}
+
+void countedFree(void *ptr)
+{
+    if (!ptr)
+    {
+        return;
+    }
+
+    uint8_t *block = static_cast<uint8_t *>(ptr) - SIZE_ROOM;
+    size_t size;
+    memcpy(&size, block, sizeof(size));
+    allocations.liveBytes -= size;
+    free(block);
+}
+} // namespace
+
+void *operator new(size_t size)
+{
+    return countedAlloc(size);
+}
+
+void *operator new[](size_t size)
+{
+    return countedAlloc(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    countedFree(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    countedFree(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    countedFree(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    countedFree(ptr);
+}
+
+int64_t esp_timer_get_time()
+{
+    const auto since_start = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::microseconds>(since_start).count();
+}
+
+// the LOG_ macros already left out what is below LOG_LEVEL
+void logWrite(uint8_t, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    putchar('\n');
+}
+
+void countParsed(Parser parser, uint32_t bytes, uint32_t us)
+{
+    parsed[static_cast<size_t>(parser)] += bytes;
+    parseUs[static_cast<size_t>(parser)] += us;
+}
+
+void resetNativeCounters()
+{
+    // what is still allocated stays counted, it is given back later
+    allocations.allocations = 0;
+    allocations.peakBytes = allocations.liveBytes;
+    memset(parsed, 0, sizeof(parsed));
+    memset(parseUs, 0, sizeof(parseUs));
+}
+
+AllocationStats allocationStats()
+{
+    return allocations;
+}
+
+uint64_t parsedBytes(Parser parser)
+{
+    return parsed[static_cast<size_t>(parser)];
+}
+
+uint64_t parseMicroseconds(Parser parser)
+{
+    return parseUs[static_cast<size_t>(parser)];
+}
+
+size_t maxResidentBytes()
+{
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return 0;
+    }
+
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+}
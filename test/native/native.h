@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "metrics.h"
+
+// The counters of the native env: what the parsers reported with countParsed(), and what was
+// allocated with new, through the counting operator new of native.cpp. The parsers are C++ and
+// allocate nothing, a malloc() of theirs shows on the device in the heap gauges.
+
+struct AllocationStats
+{
+    uint32_t allocations{0};
+    size_t liveBytes{0};
+    size_t peakBytes{0}; // the most that was allocated at a time since resetNativeCounters()
+};
+
+void resetNativeCounters();
+
+AllocationStats allocationStats();
+
+uint64_t parsedBytes(Parser parser);
+uint64_t parseMicroseconds(Parser parser);
+
+// the peak resident set of the process so far, 0 where it is not known
+size_t maxResidentBytes();
@@ -0,0 +1,126 @@
+#include <chrono>
+
+#include <unity.h>
+
+#include "captures.h"
+#include "fis_extractor.h"
+#include "native.h"
+#include "portal_parser.h"
+
+// The throughput of the parsers on the captures, in the chunk sizes the firmware reads with,
+// with what they allocate and the memory they take. pio test -e native -f test_native_bench -v
+// prints the numbers. The host is much faster than an ESP32, compare runs on the same machine,
+// the device reports its own numbers in fis_parsed_bytes_total and fis_parse_microseconds_total.
+
+namespace
+{
+constexpr size_t CHUNK_SIZES[] = {1, 16, 64, 256, 1024, 4096};
+constexpr size_t MIN_BYTES = 16 * 1024 * 1024; // per chunk size, enough for a stable number
+
+struct Result
+{
+    uint64_t bytes{0};
+    int64_t us{0};
+};
+
+template <typename Parse>
+Result run(const char *text, size_t len, size_t chunk, Parse parse)
+{
+    Result result;
+    const auto started = std::chrono::steady_clock::now();
+    while (result.bytes < MIN_BYTES)
+    {
+        result.bytes += parse(text, len, chunk);
+    }
+    result.us =
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count();
+    return result;
+}
+
+// the bytes the parser looked at
+size_t parsePortal(const char *text, size_t len, size_t chunk)
+{
+    PortalFormParser parser;
+    parser.reset();
+    size_t pos = 0;
+    while (pos < len && !parser.finished())
+    {
+        const size_t take = std::min(chunk, len - pos);
+        parser.parse(text + pos, take);
+        pos += take;
+    }
+    TEST_ASSERT_EQUAL(ParserState::DONE, parser.state());
+    return pos;
+}
+
+size_t parseFis(const char *text, size_t len, size_t chunk)
+{
+    FisSnapshot snapshot;
+    FisExtractor extractor{snapshot};
+    for (size_t pos = 0; pos < len; pos += chunk)
+    {
+        extractor.write(reinterpret_cast<const uint8_t *>(text + pos), std::min(chunk, len - pos));
+    }
+    TEST_ASSERT_TRUE(extractor.complete());
+    return len;
+}
+
+template <typename Parse>
+void benchmark(const char *name, const char *text, size_t len, size_t objectSize, Parse parse)
+{
+    char line[160];
+    snprintf(line, sizeof(line), "%s: %u bytes, the parser object takes %u bytes", name, static_cast<unsigned>(len),
+             static_cast<unsigned>(objectSize));
+    TEST_MESSAGE(line);
+
+    for (const size_t chunk : CHUNK_SIZES)
+    {
+        resetNativeCounters();
+        const Result result = run(text, len, chunk, parse);
+        const AllocationStats allocations = allocationStats();
+
+        snprintf(line, sizeof(line), "%s: chunks of %4u bytes: %7.1f MB/s, %u allocations, %u bytes heap at most",
+                 name, static_cast<unsigned>(chunk), result.us > 0 ? static_cast<double>(result.bytes) / result.us : 0.0,
+                 static_cast<unsigned>(allocations.allocations), static_cast<unsigned>(allocations.peakBytes));
+        TEST_MESSAGE(line);
+
+        // nothing on the heap, however the response is cut up
+        TEST_ASSERT_EQUAL_UINT32(0, allocations.allocations);
+    }
+}
+} // namespace
+
+void setUp()
+{
+    resetNativeCounters();
+}
+
+void tearDown() {}
+
+void test_portal_parser_throughput()
+{
+    benchmark("portal", PORTAL_PAGE, sizeof(PORTAL_PAGE) - 1, sizeof(PortalFormParser), parsePortal);
+}
+
+void test_fis_extractor_throughput()
+{
+    benchmark("combined.json", COMBINED_JSON, sizeof(COMBINED_JSON) - 1, sizeof(FisExtractor) + sizeof(FisSnapshot),
+              parseFis);
+}
+
+void test_peak_memory()
+{
+    char line[96];
+    snprintf(line, sizeof(line), "peak resident set of the runner: %u KB",
+             static_cast<unsigned>(maxResidentBytes() / 1024));
+    TEST_MESSAGE(line);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_portal_parser_throughput);
+    RUN_TEST(test_fis_extractor_throughput);
+    RUN_TEST(test_peak_memory);
+    return UNITY_END();
+}
@@ -0,0 +1,218 @@
+#include <random>
+#include <string>
+
+#include <unity.h>
+
+#include "captures.h"
+#include "fis_extractor.h"
+#include "native.h"
+#include "portal_parser.h"
+
+// Replays the captures in every chunk size from 1 to MAX_CHUNK and in random splits, the
+// parsers have to find the same values wherever the chunks of a response end.
+
+namespace
+{
+constexpr size_t MAX_CHUNK = 1024;
+constexpr size_t RANDOM_SPLITS = 2000;
+constexpr uint32_t SEED = 20261014;
+
+// the bytes a FisExtractor forwards
+class CollectStream : public Stream
+{
+public:
+    size_t write(uint8_t c) override
+    {
+        data += static_cast<char>(c);
+        return 1;
+    }
+    size_t write(const uint8_t *buf, size_t size) override
+    {
+        data.append(reinterpret_cast<const char *>(buf), size);
+        return size;
+    }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+
+    std::string data;
+};
+
+// feeds text in the chunks next_chunk() tells, until feed() wants no more, like the loop in
+// main.cpp reads a response
+template <typename NextChunk, typename Feed>
+void replay(const char *text, size_t len, NextChunk next_chunk, Feed feed)
+{
+    for (size_t pos = 0; pos < len;)
+    {
+        const size_t chunk = std::min(next_chunk(), len - pos);
+        if (!feed(text + pos, chunk))
+        {
+            return;
+        }
+        pos += chunk;
+    }
+}
+
+void checkForm(const PortalFormParser &parser, const char *split)
+{
+    TEST_ASSERT_EQUAL_MESSAGE(ParserState::DONE, parser.state(), split);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(PORTAL_TOKEN, parser.form()._token.c_str(), split);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(PORTAL_CEID, parser.form()._ceid.c_str(), split);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(PORTAL_CHECKIT, parser.form().checkit.c_str(), split);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(PORTAL_FORM_TYPE, parser.form().form_type.c_str(), split);
+}
+
+template <typename NextChunk>
+void parsePortal(NextChunk next_chunk, const char *split)
+{
+    PortalFormParser parser;
+    parser.reset();
+    replay(PORTAL_PAGE, sizeof(PORTAL_PAGE) - 1, next_chunk,
+           [&](const char *buf, size_t len)
+           {
+               parser.parse(buf, len);
+               return !parser.finished();
+           });
+    checkForm(parser, split);
+}
+
+void checkSnapshot(const FisSnapshot &snapshot, const char *split)
+{
+    for (size_t idx = 0; idx < FIS_FIELD_COUNT; ++idx)
+    {
+        const FisValue &value = snapshot.values[idx];
+        TEST_ASSERT_TRUE_MESSAGE(value.present, split);
+        TEST_ASSERT_EQUAL_STRING_MESSAGE(COMBINED_JSON_VALUES[idx], value.text, split);
+    }
+}
+
+template <typename NextChunk>
+void parseFis(NextChunk next_chunk, const char *split)
+{
+    FisSnapshot snapshot;
+    CollectStream forwarded;
+    FisExtractor extractor{snapshot, &forwarded};
+    replay(COMBINED_JSON, sizeof(COMBINED_JSON) - 1, next_chunk,
+           [&](const char *buf, size_t len)
+           { return extractor.write(reinterpret_cast<const uint8_t *>(buf), len) == len; });
+
+    TEST_ASSERT_TRUE_MESSAGE(extractor.complete(), split);
+    TEST_ASSERT_FALSE_MESSAGE(extractor.forwardFailed(), split);
+    TEST_ASSERT_TRUE_MESSAGE(forwarded.data == COMBINED_JSON, split);
+    checkSnapshot(snapshot, split);
+}
+
+void forEveryChunkSize(void (*parse)(size_t chunk, const char *split))
+{
+    char split[32];
+    for (size_t chunk = 1; chunk <= MAX_CHUNK; ++chunk)
+    {
+        snprintf(split, sizeof(split), "chunks of %u", static_cast<unsigned>(chunk));
+        parse(chunk, split);
+    }
+}
+} // namespace
+
+void setUp()
+{
+    resetNativeCounters();
+}
+
+void tearDown() {}
+
+void test_portal_whole_page()
+{
+    PortalFormParser parser;
+    parser.reset();
+    TEST_ASSERT_TRUE(parser.parse(PORTAL_PAGE, sizeof(PORTAL_PAGE) - 1));
+    checkForm(parser, "whole page");
+
+    // the parser stops at the end of the form, the rest of the page is never looked at
+    TEST_ASSERT_LESS_THAN(sizeof(PORTAL_PAGE) - 1, parsedBytes(Parser::PORTAL));
+    TEST_ASSERT_EQUAL_UINT32(0, allocationStats().allocations);
+}
+
+void test_portal_every_chunk_size()
+{
+    forEveryChunkSize([](size_t chunk, const char *split) { parsePortal([chunk]() { return chunk; }, split); });
+    TEST_ASSERT_EQUAL_UINT32(0, allocationStats().allocations);
+}
+
+void test_portal_random_splits()
+{
+    std::mt19937 random{SEED};
+    std::uniform_int_distribution<size_t> chunk_len{0, MAX_CHUNK};
+
+    char split[48];
+    for (size_t run = 0; run < RANDOM_SPLITS; ++run)
+    {
+        snprintf(split, sizeof(split), "random split %u, seed %u", static_cast<unsigned>(run),
+                 static_cast<unsigned>(SEED));
+        // empty reads included, a read may return nothing
+        parsePortal([&]() { return chunk_len(random); }, split);
+    }
+}
+
+void test_portal_without_login_form()
+{
+    static const char page[] = "<html><form action=\"/language\"><input name=\"_token\" value=\"x\"></form></html>";
+    PortalFormParser parser;
+    parser.reset();
+    TEST_ASSERT_FALSE(parser.parse(page, sizeof(page) - 1));
+    TEST_ASSERT_FALSE(parser.form().complete());
+}
+
+void test_fis_whole_document()
+{
+    FisSnapshot snapshot;
+    FisExtractor extractor{snapshot};
+    const size_t len = sizeof(COMBINED_JSON) - 1;
+    TEST_ASSERT_EQUAL(len, extractor.write(reinterpret_cast<const uint8_t *>(COMBINED_JSON), len));
+    TEST_ASSERT_TRUE(extractor.complete());
+    checkSnapshot(snapshot, "whole document");
+
+    TEST_ASSERT_EQUAL_UINT32(len, parsedBytes(Parser::FIS));
+    TEST_ASSERT_EQUAL_UINT32(0, allocationStats().allocations);
+}
+
+void test_fis_every_chunk_size()
+{
+    forEveryChunkSize([](size_t chunk, const char *split) { parseFis([chunk]() { return chunk; }, split); });
+}
+
+void test_fis_random_splits()
+{
+    std::mt19937 random{SEED};
+    std::uniform_int_distribution<size_t> chunk_len{0, MAX_CHUNK};
+
+    char split[48];
+    for (size_t run = 0; run < RANDOM_SPLITS; ++run)
+    {
+        snprintf(split, sizeof(split), "random split %u, seed %u", static_cast<unsigned>(run),
+                 static_cast<unsigned>(SEED));
+        parseFis([&]() { return chunk_len(random); }, split);
+    }
+}
+
+void test_fis_cut_off_document()
+{
+    FisSnapshot snapshot;
+    FisExtractor extractor{snapshot};
+    extractor.write(reinterpret_cast<const uint8_t *>(COMBINED_JSON), sizeof(COMBINED_JSON) / 2);
+    TEST_ASSERT_FALSE(extractor.complete());
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_portal_whole_page);
+    RUN_TEST(test_portal_every_chunk_size);
+    RUN_TEST(test_portal_random_splits);
+    RUN_TEST(test_portal_without_login_form);
+    RUN_TEST(test_fis_whole_document);
+    RUN_TEST(test_fis_every_chunk_size);
+    RUN_TEST(test_fis_random_splits);
+    RUN_TEST(test_fis_cut_off_document);
+    return UNITY_END();
+}